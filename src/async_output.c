@@ -0,0 +1,150 @@
+#define _GNU_SOURCE // for `fopencookie`
+
+#include "async_output.h"
+
+#include <pthread.h>
+
+typedef struct AsyncChunk {
+  struct AsyncChunk *next;
+  FILE *dest;
+  usize len;
+  char bytes[];
+} AsyncChunk;
+
+struct AsyncWriter {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t chunk_available;
+  pthread_cond_t space_available;
+  /// Queue of chunks to be written, guarded by `lock`.
+  AsyncChunk *head;
+  AsyncChunk *tail;
+  /// Guarded by `lock`.
+  usize queued_bytes;
+  /// Guarded by `lock`.
+  bool shutdown;
+};
+
+typedef struct AsyncStream {
+  AsyncWriter *writer;
+  FILE *dest;
+} AsyncStream;
+
+static void *async_writer_main(void *writer_) {
+  AsyncWriter *writer = writer_;
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (writer->head == NULL && !writer->shutdown)
+      pthread_cond_wait(&writer->chunk_available, &writer->lock);
+    AsyncChunk *chunk = writer->head;
+    if (chunk == NULL)
+      break;
+    writer->head = chunk->next;
+    if (writer->head == NULL)
+      writer->tail = NULL;
+    pthread_mutex_unlock(&writer->lock);
+
+    fwrite(chunk->bytes, 1, chunk->len, chunk->dest);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->queued_bytes -= chunk->len;
+    pthread_cond_broadcast(&writer->space_available);
+    // Only flush the destination when there is nothing else to write, so consecutive chunks are coalesced.
+    if (writer->head == NULL) {
+      pthread_mutex_unlock(&writer->lock);
+      fflush(chunk->dest);
+      pthread_mutex_lock(&writer->lock);
+    }
+    xfree(chunk);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+AsyncWriter *async_writer_new(void) {
+  AsyncWriter *writer = xalloc(AsyncWriter, 1);
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->chunk_available, NULL);
+  pthread_cond_init(&writer->space_available, NULL);
+  writer->head = NULL;
+  writer->tail = NULL;
+  writer->queued_bytes = 0;
+  writer->shutdown = false;
+  if (pthread_create(&writer->thread, NULL, async_writer_main, writer) != 0) {
+    panic_printf("Failed to create thread\n");
+  }
+  return writer;
+}
+
+static void async_writer_push(AsyncWriter *writer, FILE *dest, const char *buf, usize len) {
+  AsyncChunk *chunk = malloc(sizeof(AsyncChunk) + len);
+  if (chunk == NULL)
+    alloc_fail_handler();
+  chunk->next = NULL;
+  chunk->dest = dest;
+  chunk->len = len;
+  memcpy(chunk->bytes, buf, len);
+  pthread_mutex_lock(&writer->lock);
+  while (writer->queued_bytes > ASYNC_OUTPUT_MAX_QUEUED)
+    pthread_cond_wait(&writer->space_available, &writer->lock);
+  if (writer->tail == NULL)
+    writer->head = chunk;
+  else
+    writer->tail->next = chunk;
+  writer->tail = chunk;
+  writer->queued_bytes += len;
+  pthread_cond_signal(&writer->chunk_available);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+#ifdef MODERN_APPLE
+static int async_stream_write(void *stream_, const char *buf, int len) {
+  AsyncStream *stream = stream_;
+  async_writer_push(stream->writer, stream->dest, buf, (usize)len);
+  return len;
+}
+#else
+static ssize_t async_stream_write(void *stream_, const char *buf, size_t len) {
+  AsyncStream *stream = stream_;
+  async_writer_push(stream->writer, stream->dest, buf, len);
+  return (ssize_t)len;
+}
+#endif
+
+static int async_stream_close(void *stream_) {
+  xfree(stream_);
+  return 0;
+}
+
+FILE *async_writer_open(AsyncWriter *writer, FILE *dest) {
+  AsyncStream *stream = xalloc(AsyncStream, 1);
+  stream->writer = writer;
+  stream->dest = dest;
+#ifdef MODERN_APPLE
+  FILE *file = funopen(stream, NULL, async_stream_write, NULL, async_stream_close);
+#else
+  cookie_io_functions_t io_functions = {
+      .read = NULL,
+      .write = async_stream_write,
+      .seek = NULL,
+      .close = async_stream_close,
+  };
+  FILE *file = fopencookie(stream, "w", io_functions);
+#endif
+  if (file == NULL)
+    alloc_fail_handler();
+  setvbuf(file, NULL, _IOFBF, ASYNC_OUTPUT_BUFFER_SIZE);
+  return file;
+}
+
+void async_writer_free(AsyncWriter *writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->shutdown = true;
+  pthread_cond_signal(&writer->chunk_available);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->chunk_available);
+  pthread_cond_destroy(&writer->space_available);
+  xfree(writer);
+}
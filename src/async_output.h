@@ -0,0 +1,28 @@
+#pragma once
+
+#include "common.h"
+
+/// Capacity of the stdio buffer of a stream opened with `async_writer_open`.
+#define ASYNC_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/// Maximum number of bytes waiting to be written, after which writing to the streams blocks until the writer thread
+/// catches up.
+#define ASYNC_OUTPUT_MAX_QUEUED (16 * 1024 * 1024)
+
+/// A thread writing the output of many streams.
+///
+/// Every stream opened on the writer has its own stdio buffer, so machines printing concurrently don't contend on the
+/// lock of the destination file.
+/// Whenever the buffer of a stream is full (or flushed), its content is queued and written to the destination by the
+/// writer thread in one large write, preserving the order of writes of every stream.
+typedef struct AsyncWriter AsyncWriter;
+
+AsyncWriter *async_writer_new(void);
+
+/// Open a stream whose output is written to `dest` by the writer thread.
+/// The stream can be used in place of `Machine::io_stdout`, closing it queues the remaining buffered output.
+FILE *async_writer_open(AsyncWriter *writer, FILE *dest);
+
+/// Wait until all queued output has been written and stop the writer thread.
+/// All streams opened on the writer must have been closed.
+void async_writer_free(AsyncWriter *writer);
@@ -0,0 +1,276 @@
+#include "batch.h"
+#include "fileformat.h"
+#include "machine.h"
+#include "native_math.h"
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+typedef struct BatchProgram {
+  char *path;
+  /// Whether the program file could be opened, `load_result` and `image` are only set if so.
+  bool exists;
+  ProgramLoadResult load_result;
+  ProgramImage image;
+} BatchProgram;
+
+typedef struct BatchJob {
+  /// Index into `Batch::programs`, which is reallocated as programs are added.
+  usize program_index;
+  /// `NULL` for no input.
+  char *input_path;
+  u64 argc;
+  /// `argv[0]` is the program path, `argv[argc]` is `NULL`.
+  char **argv;
+} BatchJob;
+
+typedef struct BatchResult {
+  BatchJob *job;
+  FILE *job_stdin;
+  FILE *job_stdout;
+  FILE *job_stderr;
+  i32 exit_code;
+  char *stdout_buf;
+  usize stdout_len;
+  char *stderr_buf;
+  usize stderr_len;
+} BatchResult;
+
+typedef struct Batch {
+  BatchProgram *programs;
+  usize programs_len;
+  usize programs_cap;
+  BatchJob *jobs;
+  usize jobs_len;
+  usize jobs_cap;
+  BatchResult *results;
+  atomic_size_t next_job;
+} Batch;
+
+/// Index of the program at `path`, loaded on its first use.
+static usize batch_program(Batch *batch, const char *path) {
+  for (usize i = 0; i < batch->programs_len; ++i) {
+    if (strcmp(batch->programs[i].path, path) == 0)
+      return i;
+  }
+  if (batch->programs_len == batch->programs_cap) {
+    batch->programs_cap = batch->programs_cap == 0 ? 8 : batch->programs_cap * 2;
+    batch->programs = xrealloc(batch->programs, BatchProgram, batch->programs_cap);
+  }
+  BatchProgram *program = &batch->programs[batch->programs_len];
+  memset(program, 0, sizeof(BatchProgram));
+  program->path = strdup(path);
+  // A missing program only fails the jobs running it.
+  FILE *file = fopen(path, "rb");
+  if (file != NULL) {
+    program->exists = true;
+    program->load_result = load_program_image_from_file(&program->image, file);
+    fclose(file);
+  }
+  return batch->programs_len++;
+}
+
+static void batch_parse_jobs(Batch *batch, FILE *f) {
+  char *line = NULL;
+  usize line_cap = 0;
+  while (getline(&line, &line_cap, f) > 0) {
+    char *saveptr = NULL;
+    char *program_path = strtok_r(line, " \t\r\n", &saveptr);
+    if (program_path == NULL || program_path[0] == '#')
+      continue;
+    char *input_path = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (input_path == NULL) {
+      panic_printf("Job #%zu: expects an input file (or `-` for no input) after the program path\n", batch->jobs_len);
+    }
+    BatchJob job = {
+        .program_index = 0,
+        .input_path = strcmp(input_path, "-") == 0 ? NULL : strdup(input_path),
+        .argc = 1,
+        .argv = xalloc(char *, 2),
+    };
+    job.argv[0] = strdup(program_path);
+    for (char *arg = strtok_r(NULL, " \t\r\n", &saveptr); arg != NULL; arg = strtok_r(NULL, " \t\r\n", &saveptr)) {
+      job.argv = xrealloc(job.argv, char *, job.argc + 2);
+      job.argv[job.argc++] = strdup(arg);
+    }
+    job.argv[job.argc] = NULL;
+    // Programs are only loaded once and shared between jobs.
+    job.program_index = batch_program(batch, program_path);
+    if (batch->jobs_len == batch->jobs_cap) {
+      batch->jobs_cap = batch->jobs_cap == 0 ? 64 : batch->jobs_cap * 2;
+      batch->jobs = xrealloc(batch->jobs, BatchJob, batch->jobs_cap);
+    }
+    batch->jobs[batch->jobs_len++] = job;
+  }
+  free(line);
+}
+
+/// Open the streams of the job and load the program into the machine.
+/// Returns `false` if the job has failed before starting.
+static bool batch_job_start(Batch *batch, Machine *machine, BatchJob *job, BatchResult *result) {
+  result->job = job;
+  result->job_stdout = open_memstream(&result->stdout_buf, &result->stdout_len);
+  result->job_stderr = open_memstream(&result->stderr_buf, &result->stderr_len);
+  if (result->job_stdout == NULL || result->job_stderr == NULL)
+    alloc_fail_handler();
+  // With no input, reading stdin behaves as reading an empty file.
+  const char *input_path = job->input_path != NULL ? job->input_path : "/dev/null";
+  result->job_stdin = fopen(input_path, "rb");
+  if (result->job_stdin == NULL) {
+    fprintf(result->job_stderr, "Input path %s doesn't exist\n", input_path);
+    result->exit_code = 1;
+    return false;
+  }
+  const BatchProgram *program = &batch->programs[job->program_index];
+  if (!program->exists) {
+    fprintf(result->job_stderr, "Program path %s doesn't exist\n", program->path);
+    result->exit_code = 1;
+    return false;
+  }
+  if (program->load_result != ProgramLoadOk) {
+    fprintf(result->job_stderr, "Program load error: %s\n", program_load_result_name(program->load_result));
+    result->exit_code = 1;
+    return false;
+  }
+  machine_reset(machine);
+  machine_load_image(machine, &program->image);
+  machine->io_stdin = result->job_stdin;
+  machine->io_stdout = result->job_stdout;
+  machine->io_stderr = result->job_stderr;
+  machine->reg_0 = job->argc;
+  machine->reg_1 = (u64)job->argv;
+  return true;
+}
+
+static void batch_job_finish(BatchResult *result) {
+  if (result->job_stdin != NULL)
+    fclose(result->job_stdin);
+  fclose(result->job_stdout);
+  fclose(result->job_stderr);
+}
+
+static void *batch_worker(void *batch_) {
+  Batch *batch = batch_;
+  Machine machine = machine_new(MACHINE_NOT_SILENT, NULL, NULL);
+  machine.native_registry = native_math_registry();
+  for (;;) {
+    usize i = atomic_fetch_add(&batch->next_job, 1);
+    if (i >= batch->jobs_len)
+      break;
+    BatchResult *result = &batch->results[i];
+    if (batch_job_start(batch, &machine, &batch->jobs[i], result)) {
+      machine_run(&machine);
+      result->exit_code = machine.exit_code;
+    }
+    batch_job_finish(result);
+  }
+  machine_free(&machine);
+  return NULL;
+}
+
+static void batch_scheduled_job_finish(Machine *machine, void *result_) {
+  BatchResult *result = result_;
+  result->exit_code = machine->exit_code;
+  batch_job_finish(result);
+  machine_free(machine);
+  xfree(machine);
+}
+
+/// Every job gets its own machine, all of them multiplexed on the scheduler.
+static void batch_run_scheduled(Batch *batch, u32 n_threads, u32 n_io_threads, u64 quantum) {
+  Scheduler *scheduler = scheduler_new(n_threads, n_io_threads, quantum);
+  for (usize i = 0; i < batch->jobs_len; ++i) {
+    BatchResult *result = &batch->results[i];
+    Machine *machine = xalloc(Machine, 1);
+    *machine = machine_new(MACHINE_NOT_SILENT, NULL, NULL);
+    machine->native_registry = native_math_registry();
+    if (batch_job_start(batch, machine, &batch->jobs[i], result)) {
+      scheduler_spawn(scheduler, machine, batch_scheduled_job_finish, result);
+    } else {
+      batch_job_finish(result);
+      machine_free(machine);
+      xfree(machine);
+    }
+  }
+  scheduler_wait(scheduler);
+  scheduler_free(scheduler);
+}
+
+static f64 monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (f64)ts.tv_sec + (f64)ts.tv_nsec / 1e9;
+}
+
+i32 batch_main(const char *jobs_path, u32 n_threads, u32 n_io_threads, u64 quantum) {
+  xassert(n_threads > 0);
+  Batch batch = {0};
+  FILE *jobs_file = fopen(jobs_path, "r");
+  if (jobs_file == NULL) {
+    panic_printf("Path %s doesn't exist\n", jobs_path);
+  }
+  batch_parse_jobs(&batch, jobs_file);
+  fclose(jobs_file);
+  batch.results = calloc(batch.jobs_len, sizeof(BatchResult));
+  if (batch.results == NULL && batch.jobs_len != 0)
+    alloc_fail_handler();
+  atomic_init(&batch.next_job, 0);
+
+  if (n_threads > batch.jobs_len && batch.jobs_len != 0)
+    n_threads = (u32)batch.jobs_len;
+  f64 start = monotonic_seconds();
+  if (quantum != 0) {
+    batch_run_scheduled(&batch, n_threads, n_io_threads, quantum);
+  } else {
+    pthread_t *threads = xalloc(pthread_t, n_threads);
+    for (u32 i = 0; i < n_threads; ++i) {
+      if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) {
+        panic_printf("Unable to spawn worker thread\n");
+      }
+    }
+    for (u32 i = 0; i < n_threads; ++i)
+      pthread_join(threads[i], NULL);
+    xfree(threads);
+  }
+  f64 elapsed = monotonic_seconds() - start;
+
+  usize n_failed = 0;
+  for (usize i = 0; i < batch.jobs_len; ++i) {
+    const BatchJob *job = &batch.jobs[i];
+    BatchResult *result = &batch.results[i];
+    if (result->exit_code != 0)
+      ++n_failed;
+    if (result->exit_code == MACHINE_EXIT_FAULT)
+      printf("--- job %zu: %s (fault)\n", i, job->argv[0]);
+    else
+      printf("--- job %zu: %s (exit code %d)\n", i, job->argv[0], result->exit_code);
+    fwrite(result->stdout_buf, 1, result->stdout_len, stdout);
+    if (result->stderr_len != 0) {
+      fprintf(stderr, "--- job %zu: %s (stderr)\n", i, job->argv[0]);
+      fwrite(result->stderr_buf, 1, result->stderr_len, stderr);
+    }
+    free(result->stdout_buf);
+    free(result->stderr_buf);
+  }
+  fflush(stdout);
+  fprintf(stderr, "--- %zu jobs (%zu failed) on %u threads in %.3lfs (%.1lf jobs/s)\n", batch.jobs_len, n_failed,
+          n_threads, elapsed, elapsed > 0 ? (f64)batch.jobs_len / elapsed : 0.0);
+
+  for (usize i = 0; i < batch.jobs_len; ++i) {
+    for (u64 j = 0; j < batch.jobs[i].argc; ++j)
+      free(batch.jobs[i].argv[j]);
+    xfree(batch.jobs[i].argv);
+    free(batch.jobs[i].input_path);
+  }
+  for (usize i = 0; i < batch.programs_len; ++i) {
+    if (batch.programs[i].exists)
+      program_image_free(&batch.programs[i].image);
+    free(batch.programs[i].path);
+  }
+  xfree(batch.programs);
+  xfree(batch.jobs);
+  xfree(batch.results);
+  return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+
+/// Run the jobs listed in the file at `jobs_path` on `n_threads` worker threads, each worker with its own machine.
+///
+/// Each non-empty line of the jobs file that doesn't start with `#` is a job, in the form of:
+///
+/// ```
+/// PROGRAM INPUT [ARGS ...]
+/// ```
+///
+/// `INPUT` is the file used as stdin of the program, or `-` for no input.
+/// Upon starting, `r0` is set to `argc` and `r1` to a real-memory `char **argv` (with `argv[0]` being `PROGRAM`).
+///
+/// If `quantum` is not `0`, every job gets its own machine and all jobs are multiplexed on an M:N scheduler (see
+/// `scheduler.h`) with `n_threads` workers and `n_io_threads` threads for blocking I/O, preempting machines every
+/// `quantum` instructions.
+///
+/// The stdout, stderr and exit code of every job are reported in job order after all jobs are finished.
+/// Returns `0` if all jobs exited with code `0`, `1` otherwise.
+i32 batch_main(const char *jobs_path, u32 n_threads, u32 n_io_threads, u64 quantum);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdatomic.h>
+
+/// A message is a real-memory buffer handed off from the sender to the receiver without copying.
+/// After sending, the buffer is owned by the receiver (usually to be `free`d after use).
+typedef struct ChannelMessage {
+  u64 ptr;
+  u64 len;
+} ChannelMessage;
+
+typedef struct ChannelSlot {
+  atomic_size_t sequence;
+  ChannelMessage message;
+} ChannelSlot;
+
+/// Bounded lock-free MPMC channel between machines (Vyukov's bounded queue), also used for SPSC.
+/// Each slot has a sequence number telling whether it is ready to be written or read at a given position, so senders
+/// and receivers only contend on their own end of the ring buffer.
+typedef struct Channel {
+  usize mask;
+  ChannelSlot *slots;
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  atomic_bool closed;
+} Channel;
+
+/// `capacity` is rounded up to a power of two.
+static inline Channel *channel_new(usize capacity) {
+  usize cap = 1;
+  while (cap < capacity)
+    cap *= 2;
+  Channel *channel = xalloc(Channel, 1);
+  channel->mask = cap - 1;
+  channel->slots = xalloc(ChannelSlot, cap);
+  for (usize i = 0; i < cap; ++i)
+    atomic_init(&channel->slots[i].sequence, i);
+  atomic_init(&channel->head, 0);
+  atomic_init(&channel->tail, 0);
+  atomic_init(&channel->closed, false);
+  return channel;
+}
+
+static inline void channel_free(Channel *channel) {
+  xfree(channel->slots);
+  xfree(channel);
+}
+
+/// Returns `false` if the channel is full.
+static inline bool channel_try_send(Channel *channel, ChannelMessage message) {
+  usize pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+  for (;;) {
+    ChannelSlot *slot = &channel->slots[pos & channel->mask];
+    usize sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    isize diff = (isize)sequence - (isize)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&channel->head, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        slot->message = message;
+        atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    }
+  }
+}
+
+/// Returns `false` if the channel is empty.
+static inline bool channel_try_recv(Channel *channel, ChannelMessage *message) {
+  usize pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+  for (;;) {
+    ChannelSlot *slot = &channel->slots[pos & channel->mask];
+    usize sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    isize diff = (isize)sequence - (isize)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&channel->tail, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *message = slot->message;
+        atomic_store_explicit(&slot->sequence, pos + channel->mask + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    }
+  }
+}
+
+/// Messages sent before closing can still be received.
+static inline void channel_close(Channel *channel) {
+  atomic_store_explicit(&channel->closed, true, memory_order_release);
+}
+
+static inline bool channel_is_closed(Channel *channel) {
+  return atomic_load_explicit(&channel->closed, memory_order_acquire);
+}
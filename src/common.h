@@ -136,7 +136,7 @@ attribute(always_inline) static inline void *xalloc_(usize len) {
     alloc_fail_handler();
   return p;
 }
-#define xalloc(TY, COUNT) ((TY *)xalloc_(sizeof(TY) * COUNT))
+#define xalloc(TY, COUNT) ((TY *)xalloc_(sizeof(TY) * (COUNT)))
 #endif
 
 #ifndef xrealloc
@@ -146,7 +146,7 @@ attribute(always_inline) static inline void *xrealloc_(void *p, usize len) {
     alloc_fail_handler();
   return p;
 }
-#define xrealloc(P, TY, COUNT) ((TY *)xrealloc_((P), sizeof(TY) * COUNT))
+#define xrealloc(P, TY, COUNT) ((TY *)xrealloc_((P), sizeof(TY) * (COUNT)))
 #endif
 
 #ifndef xfree
@@ -0,0 +1,205 @@
+#include "disasm.h"
+#include "machine.h"
+#include "values.h"
+
+typedef struct InstInfo {
+  const char *name;
+  /// Whether the oplen is printed after the name.
+  bool has_oplen;
+  /// Operands in the order they are printed, each character being:
+  /// - `r`: register in the next 4-bit operand
+  /// - `n`: number in the next 4-bit operand
+  /// - `-`: skip the next 4-bit operand
+  /// - `f`: the `flags` byte
+  /// - `I`: immediate of big instructions
+  /// - `J`: jump target in the form of a 16-bit offset in byte 1~2
+  /// - `M`: register mask in byte 1~2
+  /// - `T`: jump target in the form of a 16-bit offset in byte 2~3
+  /// - `i`: signed 16-bit immediate in byte 2~3
+  /// - `u`: unsigned 16-bit immediate in byte 2~3
+  const char *operands;
+} InstInfo;
+
+static const InstInfo INST_INFOS[64] = {
+    [0] = {"brk", false, ""},
+    [1] = {"cbrk", false, "f"},
+    [2] = {"nop", false, ""},
+    [3] = {"load_imm", true, "rI"},
+    [4] = {"load_dir", true, "rrf"},
+    [5] = {"load_ind", true, "rrfI"},
+    [6] = {"store_imm", true, "-rfI"},
+    [7] = {"store_dir", true, "rrf"},
+    [8] = {"store_ind", true, "rrfI"},
+    [9] = {"mov", true, "rr"},
+    [10] = {"cmp", true, "rr"},
+    [11] = {"fcmp", true, "rr"},
+    [12] = {"csel", true, "rrrf"},
+    [13] = {"b", false, "Jf"},
+    [14] = {"j", false, "J"},
+    [15] = {"add", true, "rrr"},
+    [16] = {"sub", true, "rrr"},
+    [17] = {"mul", true, "rrr"},
+    [18] = {"div", true, "rrr"},
+    [19] = {"mod", true, "rrr"},
+    [20] = {"iadd", true, "rrr"},
+    [21] = {"isub", true, "rrr"},
+    [22] = {"imul", true, "rrr"},
+    [23] = {"idiv", true, "rrr"},
+    [24] = {"imod", true, "rrr"},
+    [25] = {"fadd", true, "rrr"},
+    [26] = {"fsub", true, "rrr"},
+    [27] = {"fmul", true, "rrr"},
+    [28] = {"fdiv", true, "rrr"},
+    [29] = {"fmod", true, "rrr"},
+    [30] = {"ineg", true, "rr"},
+    [31] = {"fneg", true, "rr"},
+    [32] = {"shl", true, "rrr"},
+    [33] = {"shr", true, "rrr"},
+    [34] = {"and", true, "rrr"},
+    [35] = {"or", true, "rrr"},
+    [36] = {"xor", true, "rrr"},
+    [37] = {"not", true, "rr"},
+    [38] = {"muladd", true, "rrrr"},
+    [39] = {"call", false, "J"},
+    [40] = {"ccall", false, "Jf"},
+    [41] = {"ret", false, ""},
+    [42] = {"push", true, "r"},
+    [43] = {"pop", true, "r"},
+    [44] = {"libc_call", false, "f"},
+    [45] = {"native_call", false, "I"},
+    [46] = {"vtoreal", false, "rr"},
+    [47] = {"cvt", false, "rrf"},
+    [48] = {"fmath", true, "rrrrf"},
+    [49] = {"alui", true, "rni"},
+    [50] = {"loop", true, "r-T"},
+    [51] = {"jr", false, "rf"},
+    [52] = {"jtab", false, "r-u"},
+    [53] = {"tcall", false, "Jf"},
+    [54] = {"pushm", false, "Mf"},
+    [55] = {"popm", false, "Mf"},
+    [56] = {"ldsp", true, "r-u"},
+    [57] = {"stsp", true, "r-u"},
+    [58] = {"load_idx", true, "rrrfI"},
+    [59] = {"store_idx", true, "rrrfI"},
+    [60] = {"bitop", true, "rrrf"},
+    [61] = {"perf", false, "rf"},
+    [63] = {"breakpoint", false, ""},
+};
+
+static const char *const REG_NAMES[16] = {
+    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "r13", "status", "sp",
+};
+
+static const char *const LIBC_NAMES[256] = {
+    [LIBC_exit] = "exit",           [LIBC_malloc] = "malloc",       [LIBC_realloc] = "realloc",
+    [LIBC_free] = "free",           [LIBC_fwrite] = "fwrite",       [LIBC_fread] = "fread",
+    [LIBC_printf] = "printf",       [LIBC_fprintf] = "fprintf",     [LIBC_scanf] = "scanf",
+    [LIBC_fscanf] = "fscanf",       [LIBC_puts] = "puts",           [LIBC_fputs] = "fputs",
+    [LIBC_snprintf] = "snprintf",   [LIBC_fopen] = "fopen",         [LIBC_fclose] = "fclose",
+    [LIBC_memcpy] = "memcpy",       [LIBC_memmove] = "memmove",     [LIBC_memset] = "memset",
+    [LIBC_bzero] = "bzero",         [LIBC_strlen] = "strlen",       [LIBC_strcpy] = "strcpy",
+    [LIBC_strcat] = "strcat",       [LIBC_strcmp] = "strcmp",       [LIBC_chan_send] = "chan_send",
+    [LIBC_chan_recv] = "chan_recv", [LIBC_chan_close] = "chan_close",
+};
+
+static const char OPLEN_NAMES[4] = {'q', 'd', 'w', 'b'};
+
+const char *disasm_name(u8 inst0) {
+  return INST_INFOS[inst0 >> 2].name;
+}
+
+bool disasm_has_oplen(u8 inst0) {
+  return INST_INFOS[inst0 >> 2].has_oplen;
+}
+
+const char *disasm_reg_name(u8 reg) {
+  return REG_NAMES[reg & 0xF];
+}
+
+const char *disasm_libc_name(u8 callcode) {
+  return LIBC_NAMES[callcode];
+}
+
+void disasm_label(u8 inst0, char *buf, usize buf_len) {
+  const InstInfo *info = &INST_INFOS[inst0 >> 2];
+  if (info->name == NULL)
+    snprintf(buf, buf_len, "(illegal 0x%02X)", inst0);
+  else if (info->has_oplen)
+    snprintf(buf, buf_len, "%s %c", info->name, OPLEN_NAMES[inst0 & 0b11]);
+  else
+    snprintf(buf, buf_len, "%s", info->name);
+}
+
+u32 disasm_len(const u8 *text, u16 pc) {
+  if (pc + 4 > VMEM_SEG_SIZE)
+    return 0;
+  const u8 *inst = &text[pc];
+  const InstInfo *info = &INST_INFOS[inst[0] >> 2];
+  if (info->name == NULL)
+    return 0;
+  u32 len = 4;
+  if (strchr(info->operands, 'I') != NULL)
+    len += imm_len(GET_FLAGS(inst));
+  if ((inst[0] & 0b11111100) == OPCODE_JTAB)
+    len += 2 * (u32)(u16)GET_IMM16(inst);
+  if (pc + len > VMEM_SEG_SIZE)
+    return 0;
+  return len;
+}
+
+u32 disasm(const u8 *text, u16 pc, char *buf, usize buf_len) {
+  u32 len = disasm_len(text, pc);
+  if (len == 0) {
+    snprintf(buf, buf_len, "(illegal)");
+    return 0;
+  }
+  const u8 *inst = &text[pc];
+  const InstInfo *info = &INST_INFOS[inst[0] >> 2];
+  const u8 nibbles[4] = {GET_OPERAND0(inst), GET_OPERAND1(inst), GET_OPERAND2(inst), GET_OPERAND3(inst)};
+  usize n = 0;
+#define DISASM_PRINT(...) n += snprintf(buf + n, n < buf_len ? buf_len - n : 0, __VA_ARGS__)
+  DISASM_PRINT("%s", info->name);
+  if (info->has_oplen)
+    DISASM_PRINT(" %c", OPLEN_NAMES[inst[0] & 0b11]);
+  u8 nibble = 0;
+  bool first = true;
+  for (const char *c = info->operands; *c != '\0'; ++c) {
+    if (*c == '-') {
+      ++nibble;
+      continue;
+    }
+    DISASM_PRINT(first ? " " : ", ");
+    first = false;
+    switch (*c) {
+    case 'r':
+      DISASM_PRINT("%s", REG_NAMES[nibbles[nibble++]]);
+      break;
+    case 'n':
+      DISASM_PRINT("%u", nibbles[nibble++]);
+      break;
+    case 'f':
+      DISASM_PRINT("0x%02X", GET_FLAGS(inst));
+      break;
+    case 'I':
+      DISASM_PRINT("0x%llX", decode_imm(&inst[4], GET_FLAGS(inst)));
+      break;
+    case 'J':
+      DISASM_PRINT("0x1%04X", (u16)(pc + 4 + GET_JUMP_OFFSET(inst)));
+      break;
+    case 'M':
+      DISASM_PRINT("0x%04X", GET_REG_MASK(inst));
+      break;
+    case 'T':
+      DISASM_PRINT("0x1%04X", (u16)(pc + 4 + GET_IMM16(inst)));
+      break;
+    case 'i':
+      DISASM_PRINT("%d", GET_IMM16(inst));
+      break;
+    case 'u':
+      DISASM_PRINT("%u", (u16)GET_IMM16(inst));
+      break;
+    }
+  }
+#undef DISASM_PRINT
+  return len;
+}
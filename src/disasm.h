@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+/// Name of the instruction with the first byte `inst0` (e.g. `"add"`), `NULL` if the opcode is illegal.
+const char *disasm_name(u8 inst0);
+
+/// Whether the oplen of the instruction with the first byte `inst0` is relevant to the operation.
+bool disasm_has_oplen(u8 inst0);
+
+/// Print the name of the instruction with the first byte `inst0` into `buf`, followed by the oplen if it is relevant
+/// (e.g. `"add q"`).
+void disasm_label(u8 inst0, char *buf, usize buf_len);
+
+/// Name of the register `reg` (in `[0, 16)`, e.g. `"r1"` or `"sp"`).
+const char *disasm_reg_name(u8 reg);
+
+/// Name of the libc function with the callcode `callcode` (e.g. `"printf"`), `NULL` if the callcode is illegal.
+const char *disasm_libc_name(u8 callcode);
+
+/// Length in bytes of the instruction on `text[pc]`, including the data of big instructions and the table of `jtab`.
+/// Returns 0 if the instruction is illegal or runs past the end of the text segment.
+u32 disasm_len(const u8 *text, u16 pc);
+
+/// Disassemble the instruction on `text[pc]` into `buf` (e.g. `"add q r1, r1, r2"`).
+/// Returns the length of the instruction in bytes (see `disasm_len`).
+u32 disasm(const u8 *text, u16 pc, char *buf, usize buf_len);
@@ -1,28 +1,28 @@
 #include "fileformat.h"
 #include "endian.h"
 
-void print_program_load_result(ProgramLoadResult r) {
+const char *program_load_result_name(ProgramLoadResult r) {
   switch (r) {
   case ProgramLoadOk:
-    printf("ProgramLoadOk");
-    break;
+    return "ProgramLoadOk";
   case ProgramLoadErrorInvalidFileHeader:
-    printf("ProgramLoadErrorInvalidFileHeader");
-    break;
+    return "ProgramLoadErrorInvalidFileHeader";
   case ProgramLoadErrorInvalidBlockHeader:
-    printf("ProgramLoadErrorInvalidBlockHeader");
-    break;
+    return "ProgramLoadErrorInvalidBlockHeader";
   case ProgramLoadErrorEofInBlock:
-    printf("ProgramLoadErrorEofInBlock");
-    break;
+    return "ProgramLoadErrorEofInBlock";
   case ProgramLoadErrorOutOfBound:
-    printf("ProgramLoadErrorOutOfBound");
-    break;
+    return "ProgramLoadErrorOutOfBound";
   }
+  return "";
 }
 
+void print_program_load_result(ProgramLoadResult r) { printf("%s", program_load_result_name(r)); }
+
 typedef struct ProgramLoadState {
-  Machine *restrict machine;
+  u8 *vmem_stack;
+  u8 *vmem_text;
+  u8 *vmem_data;
   FILE *f;
   bool finished;
 } ProgramLoadState;
@@ -33,23 +33,57 @@ static inline ProgramLoadResult read_block(ProgramLoadState *state);
 
 static inline ProgramLoadResult write_bytes(ProgramLoadState *state, const u8 *bytes, u32 start_address, u16 length);
 
-ProgramLoadResult load_machine_state_from_file(Machine *restrict machine, FILE *f) {
-  ProgramLoadState state = {
-      .machine = machine,
-      .f = f,
-      .finished = false,
-  };
-  ProgramLoadResult check_header_result = check_header(&state);
+static inline ProgramLoadResult load_segments_from_file(ProgramLoadState *state) {
+  ProgramLoadResult check_header_result = check_header(state);
   if (check_header_result != ProgramLoadOk)
     return check_header_result;
-  while (!state.finished) {
-    ProgramLoadResult read_block_result = read_block(&state);
+  while (!state->finished) {
+    ProgramLoadResult read_block_result = read_block(state);
     if (read_block_result != ProgramLoadOk)
       return read_block_result;
   }
   return ProgramLoadOk;
 }
 
+ProgramLoadResult load_machine_state_from_file(Machine *restrict machine, FILE *f) {
+  ProgramLoadState state = {
+      .vmem_stack = machine->vmem_stack,
+      .vmem_text = machine->vmem_text,
+      .vmem_data = machine->vmem_data,
+      .f = f,
+      .finished = false,
+  };
+  return load_segments_from_file(&state);
+}
+
+ProgramLoadResult load_program_image_from_file(ProgramImage *image, FILE *f) {
+  image->vmem_stack = calloc(VMEM_SEG_SIZE, 1);
+  image->vmem_text = calloc(VMEM_SEG_SIZE, 1);
+  image->vmem_data = calloc(VMEM_SEG_SIZE, 1);
+  if (image->vmem_stack == NULL || image->vmem_text == NULL || image->vmem_data == NULL)
+    alloc_fail_handler();
+  ProgramLoadState state = {
+      .vmem_stack = image->vmem_stack,
+      .vmem_text = image->vmem_text,
+      .vmem_data = image->vmem_data,
+      .f = f,
+      .finished = false,
+  };
+  return load_segments_from_file(&state);
+}
+
+void program_image_free(ProgramImage *image) {
+  xfree(image->vmem_stack);
+  xfree(image->vmem_text);
+  xfree(image->vmem_data);
+}
+
+void machine_load_image(Machine *machine, const ProgramImage *image) {
+  memcpy(machine->vmem_stack, image->vmem_stack, VMEM_SEG_SIZE);
+  memcpy(machine->vmem_text, image->vmem_text, VMEM_SEG_SIZE);
+  memcpy(machine->vmem_data, image->vmem_data, VMEM_SEG_SIZE);
+}
+
 static inline ProgramLoadResult check_header(ProgramLoadState *state) {
   static const u8 expected_header[11] = "LBVMProgram";
   u8 found_header[11] = {0};
@@ -76,9 +110,11 @@ static inline ProgramLoadResult read_block(ProgramLoadState *state) {
   if (length == 0)
     return ProgramLoadOk;
   u8 *bytes = xalloc(u8, length);
-  if (fread(bytes, 1, length, state->f) != length)
-    return ProgramLoadErrorEofInBlock;
-  return write_bytes(state, bytes, start_address, length);
+  ProgramLoadResult result = ProgramLoadErrorEofInBlock;
+  if (fread(bytes, 1, length, state->f) == length)
+    result = write_bytes(state, bytes, start_address, length);
+  xfree(bytes);
+  return result;
 }
 
 static inline ProgramLoadResult write_bytes(ProgramLoadState *state, const u8 *bytes, u32 start_address, u16 length) {
@@ -87,13 +123,13 @@ static inline ProgramLoadResult write_bytes(ProgramLoadState *state, const u8 *b
   u8 *restrict p;
   switch (start_address) {
   case 0x00000 ... 0x0FFFF: {
-    p = &state->machine->vmem_stack[start_address - 0x00000];
+    p = &state->vmem_stack[start_address - 0x00000];
   } break;
   case 0x10000 ... 0x1FFFF: {
-    p = &state->machine->vmem_text[start_address - 0x10000];
+    p = &state->vmem_text[start_address - 0x10000];
   } break;
   case 0x20000 ... 0x2FFFF: {
-    p = &state->machine->vmem_data[start_address - 0x20000];
+    p = &state->vmem_data[start_address - 0x20000];
   } break;
   default:
     return ProgramLoadErrorOutOfBound;
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "common.h"
 #include "debug_utils.h"
 
@@ -11,6 +13,23 @@ typedef enum ProgramLoadResult {
   ProgramLoadErrorOutOfBound,
 } ProgramLoadResult;
 
+const char *program_load_result_name(ProgramLoadResult r);
+
 void print_program_load_result(ProgramLoadResult r);
 
 ProgramLoadResult load_machine_state_from_file(Machine *restrict machine, FILE *f);
+
+/// A loaded program file that can be loaded into many machines without reading the file again.
+typedef struct ProgramImage {
+  u8 *vmem_stack;
+  u8 *vmem_text;
+  u8 *vmem_data;
+} ProgramImage;
+
+/// Bytes not covered by any block of the program file are zero.
+ProgramLoadResult load_program_image_from_file(ProgramImage *image, FILE *f);
+
+void program_image_free(ProgramImage *image);
+
+/// Copy the segments of the image into the machine's memory.
+void machine_load_image(Machine *machine, const ProgramImage *image);
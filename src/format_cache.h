@@ -0,0 +1,380 @@
+#pragma once
+
+#include "common.h"
+
+/// Number of entries of a format cache, must be a power of two.
+#define FORMAT_CACHE_SIZE 64
+
+/// Longer format strings are always handled by libc.
+#define FORMAT_MAX_LEN 4096
+
+typedef enum FormatOpKind {
+  FormatOpLiteral,
+  FormatOpSigned,
+  FormatOpUnsigned,
+  FormatOpFloat,
+  FormatOpChar,
+  FormatOpString,
+  FormatOpPointer,
+} FormatOpKind;
+
+typedef struct FormatOp {
+  u8 kind;
+  /// Conversion character, e.g. `d`, `x`, `s`.
+  char conv;
+  /// Size in bytes of integer arguments after applying the length modifier.
+  u8 int_size;
+  /// No flags other than `-` and `0`, and no precision, so the conversion can be done without libc.
+  bool simple;
+  bool left_align;
+  bool zero_pad;
+  u16 width;
+  /// For literals, the slice of `FormatEntry::text` to be copied.
+  /// For conversions, the offset in `FormatEntry::text` of the conversion spec to be passed to `snprintf`, where
+  /// integer conversions always use the `ll` length modifier.
+  u32 start;
+  u32 len;
+} FormatOp;
+
+typedef struct FormatEntry {
+  const char *addr;
+  /// `false` if the format uses features not supported by the cache (e.g. `*` width, `%n`), in which case it is
+  /// handled by libc.
+  bool cacheable;
+  /// Number of arguments used by the format.
+  u32 n_args;
+  FormatOp *ops;
+  u32 ops_len;
+  /// Copy of the format string, followed by the conversion specs of `ops`.
+  char *text;
+  usize text_len;
+} FormatEntry;
+
+/// Cache of parsed `printf` format strings of a machine, keyed by the address of the format string.
+/// Entries keep a copy of the format string, so that a format modified by the program is parsed again.
+/// Formatting with a parsed format reads only the arguments that the format actually uses, and does the simple
+/// conversions without going through libc.
+typedef struct FormatCache {
+  FormatEntry entries[FORMAT_CACHE_SIZE];
+  /// Output of the last `format_cache_run`.
+  char *out;
+  usize out_len;
+  usize out_cap;
+} FormatCache;
+
+static inline FormatCache *format_cache_new() {
+  FormatCache *cache = xalloc(FormatCache, 1);
+  memset(cache, 0, sizeof(FormatCache));
+  return cache;
+}
+
+static inline void format_entry_clear(FormatEntry *entry) {
+  xfree(entry->ops);
+  xfree(entry->text);
+  memset(entry, 0, sizeof(FormatEntry));
+}
+
+static inline void format_cache_free(FormatCache *cache) {
+  for (usize i = 0; i < FORMAT_CACHE_SIZE; ++i)
+    format_entry_clear(&cache->entries[i]);
+  xfree(cache->out);
+  xfree(cache);
+}
+
+static inline void format_entry_push_op(FormatEntry *entry, FormatOp op) {
+  entry->ops = xrealloc(entry->ops, FormatOp, entry->ops_len + 1);
+  entry->ops[entry->ops_len++] = op;
+}
+
+static inline void format_entry_push_text(FormatEntry *entry, const char *text, usize len) {
+  entry->text = xrealloc(entry->text, char, entry->text_len + len);
+  memcpy(&entry->text[entry->text_len], text, len);
+  entry->text_len += len;
+}
+
+/// Parse the format string into `entry`, which must be empty.
+/// Returns `false` if the format is not cacheable.
+static inline bool format_entry_parse(FormatEntry *entry, const char *format, usize len) {
+  format_entry_push_text(entry, format, len + 1);
+  usize i = 0;
+  while (i < len) {
+    if (format[i] != '%') {
+      usize start = i;
+      while (i < len && format[i] != '%')
+        ++i;
+      format_entry_push_op(entry, (FormatOp){.kind = FormatOpLiteral, .start = start, .len = i - start});
+      continue;
+    }
+    ++i;
+    if (format[i] == '%') {
+      format_entry_push_op(entry, (FormatOp){.kind = FormatOpLiteral, .start = i, .len = 1});
+      ++i;
+      continue;
+    }
+    // Flags, width and precision.
+    usize options_start = i;
+    bool simple = true;
+    bool left_align = false;
+    bool zero_pad = false;
+    for (; format[i] != '\0' && strchr("-+ #0", format[i]) != NULL; ++i) {
+      left_align |= format[i] == '-';
+      zero_pad |= format[i] == '0';
+      simple &= format[i] == '-' || format[i] == '0';
+    }
+    u32 width = 0;
+    for (; format[i] >= '0' && format[i] <= '9'; ++i)
+      width = width < 10000 ? width * 10 + (u32)(format[i] - '0') : width;
+    simple &= width < 10000;
+    if (format[i] == '.') {
+      simple = false;
+      for (++i; format[i] >= '0' && format[i] <= '9'; ++i)
+        ;
+    }
+    usize options_end = i;
+    u32 length = 4;
+    bool has_length = true;
+    if (format[i] == 'h' && format[i + 1] == 'h') {
+      length = 1;
+      i += 2;
+    } else if (format[i] == 'h') {
+      length = 2;
+      ++i;
+    } else if (format[i] == 'l' && format[i + 1] == 'l') {
+      length = 8;
+      i += 2;
+    } else if (format[i] == 'l' || format[i] == 'z' || format[i] == 'j' || format[i] == 't' || format[i] == 'q') {
+      length = 8;
+      ++i;
+    } else {
+      has_length = false;
+    }
+    FormatOp op = {
+        .conv = format[i],
+        .int_size = length,
+        .simple = simple,
+        .left_align = left_align,
+        .zero_pad = zero_pad && !left_align,
+        .width = (u16)width,
+    };
+    switch (format[i]) {
+    case 'd':
+    case 'i':
+      op.kind = FormatOpSigned;
+      break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      op.kind = FormatOpUnsigned;
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      op.kind = FormatOpFloat;
+      break;
+    case 'c':
+      op.kind = FormatOpChar;
+      op.simple &= !zero_pad;
+      break;
+    case 's':
+      op.kind = FormatOpString;
+      op.simple &= !zero_pad;
+      break;
+    case 'p':
+      op.kind = FormatOpPointer;
+      break;
+    default:
+      // `*` width or precision, `%n`, `L`, wide characters, invalid specs, etc.
+      return false;
+    }
+    if (has_length && op.kind != FormatOpSigned && op.kind != FormatOpUnsigned &&
+        !(op.kind == FormatOpFloat && length == 8 && format[i - 1] == 'l'))
+      return false;
+    ++i;
+    // Conversion spec for `snprintf`, e.g. `%08llx`.
+    op.start = entry->text_len;
+    format_entry_push_text(entry, "%", 1);
+    format_entry_push_text(entry, &format[options_start], options_end - options_start);
+    if (op.kind == FormatOpSigned || op.kind == FormatOpUnsigned)
+      format_entry_push_text(entry, "ll", 2);
+    format_entry_push_text(entry, &op.conv, 1);
+    format_entry_push_text(entry, "", 1);
+    op.len = entry->text_len - op.start - 1;
+    format_entry_push_op(entry, op);
+    ++entry->n_args;
+  }
+  return true;
+}
+
+/// Returns `NULL` if the format has to be handled by libc.
+attribute(noinline) static inline const FormatEntry *format_cache_get(FormatCache *cache, const char *format) {
+  FormatEntry *entry = &cache->entries[((usize)format >> 3) & (FORMAT_CACHE_SIZE - 1)];
+  // Comparing with the copy of the format string detects formats modified by the program.
+  if (entry->addr == format && strcmp(entry->text, format) == 0)
+    return entry->cacheable ? entry : NULL;
+  usize len = strnlen(format, FORMAT_MAX_LEN + 1);
+  if (len > FORMAT_MAX_LEN)
+    return NULL;
+  format_entry_clear(entry);
+  entry->addr = format;
+  entry->cacheable = format_entry_parse(entry, format, len);
+  return entry->cacheable ? entry : NULL;
+}
+
+static inline void format_cache_reserve(FormatCache *cache, usize len) {
+  if (cache->out_len + len <= cache->out_cap)
+    return;
+  usize cap = cache->out_cap == 0 ? 256 : cache->out_cap;
+  while (cap < cache->out_len + len)
+    cap *= 2;
+  cache->out = xrealloc(cache->out, char, cap);
+  cache->out_cap = cap;
+}
+
+static inline void format_cache_append(FormatCache *cache, const char *bytes, usize len) {
+  format_cache_reserve(cache, len);
+  memcpy(&cache->out[cache->out_len], bytes, len);
+  cache->out_len += len;
+}
+
+/// Write the decimal digits of `value` to the end of `buf`, returns the number of digits.
+static inline usize format_dec(char buf[20], u64 value) {
+  usize i = 20;
+  do {
+    buf[--i] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  return 20 - i;
+}
+
+/// Write the hexadecimal digits of `value` to the end of `buf`, returns the number of digits.
+static inline usize format_hex(char buf[20], u64 value, bool uppercase) {
+  const char *digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+  usize i = 20;
+  do {
+    buf[--i] = digits[value & 0xF];
+    value >>= 4;
+  } while (value != 0);
+  return 20 - i;
+}
+
+/// Append a field padded to the width of the conversion, `sign` is put before the zero padding.
+static inline void format_cache_append_field(FormatCache *cache, const FormatOp *op, bool sign, const char *bytes,
+                                             usize len) {
+  usize total = len + sign;
+  usize padding = op->width > total ? op->width - total : 0;
+  format_cache_reserve(cache, total + padding);
+  char *out = &cache->out[cache->out_len];
+  if (!op->left_align && !op->zero_pad) {
+    memset(out, ' ', padding);
+    out += padding;
+  }
+  if (sign)
+    *out++ = '-';
+  if (op->zero_pad) {
+    memset(out, '0', padding);
+    out += padding;
+  }
+  memcpy(out, bytes, len);
+  out += len;
+  if (op->left_align) {
+    memset(out, ' ', padding);
+    out += padding;
+  }
+  cache->out_len += total + padding;
+}
+
+/// Append the output of `snprintf` with a conversion spec and one argument.
+#define format_cache_append_snprintf(CACHE, SPEC, ARG)                                                                 \
+  {                                                                                                                    \
+    usize avail_ = (CACHE)->out_cap - (CACHE)->out_len;                                                                \
+    i32 n_ = snprintf(&(CACHE)->out[(CACHE)->out_len], avail_, (SPEC), (ARG));                                         \
+    if (n_ > 0 && (usize)n_ >= avail_) {                                                                               \
+      format_cache_reserve((CACHE), (usize)n_ + 1);                                                                    \
+      snprintf(&(CACHE)->out[(CACHE)->out_len], (usize)n_ + 1, (SPEC), (ARG));                                         \
+    }                                                                                                                  \
+    if (n_ > 0)                                                                                                        \
+      (CACHE)->out_len += (usize)n_;                                                                                   \
+  }
+
+/// Truncate an integer argument to its size, sign extending if `is_signed`.
+static inline u64 format_int_arg(u64 value, u8 int_size, bool is_signed) {
+  switch (int_size) {
+  case 1:
+    return is_signed ? (u64)(i64)(i8)value : (u64)(u8)value;
+  case 2:
+    return is_signed ? (u64)(i64)(i16)value : (u64)(u16)value;
+  case 4:
+    return is_signed ? (u64)(i64)(i32)value : (u64)(u32)value;
+  default:
+    return value;
+  }
+}
+
+/// Format the arguments `args[0..entry->n_args]` into `cache->out` (not null-terminated), returns the length of the
+/// output.
+/// Floating-point arguments are the `f64` in the bits of the argument.
+attribute(noinline) static inline usize format_cache_run(FormatCache *cache, const FormatEntry *entry, const u64 *args) {
+  cache->out_len = 0;
+  format_cache_reserve(cache, 64);
+  const u64 *arg = args;
+  for (u32 i = 0; i < entry->ops_len; ++i) {
+    const FormatOp *op = &entry->ops[i];
+    const char *spec = &entry->text[op->start];
+    switch (op->kind) {
+    case FormatOpLiteral:
+      format_cache_append(cache, spec, op->len);
+      break;
+    case FormatOpSigned: {
+      i64 value = (i64)format_int_arg(*arg++, op->int_size, true);
+      if (op->simple) {
+        char buf[20];
+        usize len = format_dec(buf, value < 0 ? -(u64)value : (u64)value);
+        format_cache_append_field(cache, op, value < 0, &buf[20 - len], len);
+      } else {
+        format_cache_append_snprintf(cache, spec, (long long)value);
+      }
+    } break;
+    case FormatOpUnsigned: {
+      u64 value = format_int_arg(*arg++, op->int_size, false);
+      if (op->simple && op->conv != 'o') {
+        char buf[20];
+        usize len = op->conv == 'u' ? format_dec(buf, value) : format_hex(buf, value, op->conv == 'X');
+        format_cache_append_field(cache, op, false, &buf[20 - len], len);
+      } else {
+        format_cache_append_snprintf(cache, spec, (unsigned long long)value);
+      }
+    } break;
+    case FormatOpFloat: {
+      f64 value = transmute(f64, *arg++);
+      format_cache_append_snprintf(cache, spec, value);
+    } break;
+    case FormatOpChar: {
+      char value = (char)*arg++;
+      if (op->simple)
+        format_cache_append_field(cache, op, false, &value, 1);
+      else
+        format_cache_append_snprintf(cache, spec, (int)value);
+    } break;
+    case FormatOpString: {
+      const char *value = (const char *)*arg++;
+      if (op->simple && value == NULL)
+        format_cache_append_field(cache, op, false, "(null)", 6);
+      else if (op->simple)
+        format_cache_append_field(cache, op, false, value, strlen(value));
+      else
+        format_cache_append_snprintf(cache, spec, value);
+    } break;
+    case FormatOpPointer: {
+      void *value = (void *)*arg++;
+      format_cache_append_snprintf(cache, spec, value);
+    } break;
+    }
+  }
+  return cache->out_len;
+}
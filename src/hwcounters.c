@@ -0,0 +1,142 @@
+#include "hwcounters.h"
+#include "perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *const HW_COUNTER_NAMES[HW_COUNTER_COUNT] = {
+    [HW_CYCLES] = "cycles",
+    [HW_INSTRUCTIONS] = "instructions",
+    [HW_BRANCH_MISSES] = "branch misses",
+    [HW_L1I_MISSES] = "L1i misses",
+    [HW_L1D_MISSES] = "L1d misses",
+};
+
+#ifdef __linux__
+
+static const struct {
+  u32 type;
+  u64 config;
+} HW_COUNTER_EVENTS[HW_COUNTER_COUNT] = {
+    [HW_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [HW_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [HW_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [HW_L1I_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    [HW_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+};
+
+/// The first available counter, which leads the group.
+static int group_leader(const HwCounters *counters) {
+  for (u32 i = 0; i < HW_COUNTER_COUNT; ++i) {
+    if (counters->fds[i] != -1)
+      return counters->fds[i];
+  }
+  return -1;
+}
+
+void hw_counters_start(HwCounters *counters) {
+  memset(counters, 0, sizeof(HwCounters));
+  int leader = -1;
+  for (u32 i = 0; i < HW_COUNTER_COUNT; ++i) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = HW_COUNTER_EVENTS[i].type;
+    attr.config = HW_COUNTER_EVENTS[i].config;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (leader == -1)
+      leader = counters->fds[i];
+  }
+  if (leader != -1) {
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  counters->start_ns = monotonic_ns();
+}
+
+void hw_counters_stop(HwCounters *counters) {
+  counters->ns = monotonic_ns() - counters->start_ns;
+  int leader = group_leader(counters);
+  if (leader == -1)
+    return;
+  ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  // `nr`, `time_enabled`, `time_running`, then the values in the order the counters joined the group.
+  u64 data[3 + HW_COUNTER_COUNT] = {0};
+  if (read(leader, data, sizeof(data)) < (ssize_t)(3 * sizeof(u64))) {
+    for (u32 i = 0; i < HW_COUNTER_COUNT; ++i) {
+      if (counters->fds[i] != -1)
+        close(counters->fds[i]);
+      counters->fds[i] = -1;
+    }
+    return;
+  }
+  u64 enabled = data[1];
+  u64 running = data[2];
+  counters->scaled = running != 0 && running < enabled;
+  u64 n = 0;
+  for (u32 i = 0; i < HW_COUNTER_COUNT; ++i) {
+    if (counters->fds[i] == -1)
+      continue;
+    u64 value = n < data[0] ? data[3 + n] : 0;
+    ++n;
+    counters->values[i] = counters->scaled ? (u64)((f64)value * (f64)enabled / (f64)running) : value;
+  }
+  for (u32 i = 0; i < HW_COUNTER_COUNT; ++i) {
+    if (counters->fds[i] != -1)
+      close(counters->fds[i]);
+  }
+}
+
+#else
+
+void hw_counters_start(HwCounters *counters) {
+  memset(counters, 0, sizeof(HwCounters));
+  for (u32 i = 0; i < HW_COUNTER_COUNT; ++i)
+    counters->fds[i] = -1;
+  counters->start_ns = monotonic_ns();
+}
+
+void hw_counters_stop(HwCounters *counters) {
+  counters->ns = monotonic_ns() - counters->start_ns;
+}
+
+#endif
+
+void hw_counters_report(const HwCounters *counters, u64 n_insts, FILE *stream) {
+  fprintf(stream, "=== perf counters\n");
+  fprintf(stream, "%-16s %16s %16s\n", "counter", "total", "per guest inst");
+  fprintf(stream, "%-16s %16llu", "wall time (ns)", counters->ns);
+  if (n_insts != 0)
+    fprintf(stream, " %16.3f", (f64)counters->ns / (f64)n_insts);
+  fprintf(stream, "\n");
+  bool any = false;
+  for (u32 i = 0; i < HW_COUNTER_COUNT; ++i) {
+    if (counters->fds[i] == -1) {
+      fprintf(stream, "%-16s %16s\n", HW_COUNTER_NAMES[i], "unavailable");
+      continue;
+    }
+    any = true;
+    fprintf(stream, "%-16s %16llu", HW_COUNTER_NAMES[i], counters->values[i]);
+    if (n_insts != 0)
+      fprintf(stream, " %16.3f", (f64)counters->values[i] / (f64)n_insts);
+    fprintf(stream, "\n");
+  }
+  if (counters->fds[HW_CYCLES] != -1 && counters->fds[HW_INSTRUCTIONS] != -1 && counters->values[HW_CYCLES] != 0)
+    fprintf(stream, "%-16s %16.3f\n", "IPC",
+            (f64)counters->values[HW_INSTRUCTIONS] / (f64)counters->values[HW_CYCLES]);
+  if (!any)
+    fprintf(stream, "Hardware performance counters are unavailable, only the wall-clock time is measured\n");
+  else if (counters->scaled)
+    fprintf(stream, "Counters were multiplexed, the values are extrapolated\n");
+  if (n_insts == 0)
+    fprintf(stream, "Guest instructions are only counted with `--count-insts` or `--stats`, only the totals are reported\n");
+}
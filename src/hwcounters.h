@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+
+typedef enum HwCounter {
+  HW_CYCLES,
+  HW_INSTRUCTIONS,
+  HW_BRANCH_MISSES,
+  HW_L1I_MISSES,
+  HW_L1D_MISSES,
+  HW_COUNTER_COUNT,
+} HwCounter;
+
+/// Hardware performance counters of the calling thread, counted in one `perf_event_open` group on Linux.
+typedef struct HwCounters {
+  /// File descriptors of the counters, -1 for counters that are unavailable.
+  /// The first available one is the group leader.
+  int fds[HW_COUNTER_COUNT];
+  u64 values[HW_COUNTER_COUNT];
+  /// Whether `values` are extrapolated because the group was not always scheduled on the PMU.
+  bool scaled;
+  u64 start_ns;
+  u64 ns;
+} HwCounters;
+
+/// Open and start the counters, counting user-space events of the calling thread.
+/// Counters that cannot be opened (e.g. in a container, or with a restrictive `perf_event_paranoid`) are left out,
+/// leaving only the wall-clock time if none can be opened.
+void hw_counters_start(HwCounters *counters);
+
+/// Stop the counters, read their values and close them.
+void hw_counters_stop(HwCounters *counters);
+
+/// Print the counters, normalized per guest instruction if `n_insts` is not zero.
+void hw_counters_report(const HwCounters *counters, u64 n_insts, FILE *stream);
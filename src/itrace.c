@@ -0,0 +1,150 @@
+#include "common.h"
+#include "values.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct machine Machine;
+
+typedef struct Itrace {
+  struct ItraceHeader *header;
+  struct ItraceRecord *records;
+  /// `capacity - 1`.
+  u64 mask;
+} Itrace;
+
+/// Trace of the machine running on this thread.
+static _Thread_local Itrace itrace;
+
+static inline void itrace_record(Machine *machine, const u8 *inst);
+
+#define MACHINE_HOOK_INST(MACHINE, INST) itrace_record(MACHINE, INST)
+
+#include "itrace.h"
+
+/// 1 + the operand of the destination register of each opcode, 0 if the instruction has none.
+static const u8 DEST_OPERANDS[64] = {
+    [OPCODE_LOAD_IMM >> 2] = 1,
+    [OPCODE_LOAD_DIR >> 2] = 1,
+    [OPCODE_LOAD_IND >> 2] = 1,
+    [OPCODE_MOV >> 2] = 1,
+    [OPCODE_CSEL >> 2] = 1,
+    [OPCODE_ADD >> 2 ... OPCODE_MULADD >> 2] = 1,
+    [OPCODE_POP >> 2] = 1,
+    [OPCODE_VTOREAL >> 2] = 2,
+    [OPCODE_CVT >> 2] = 1,
+    [OPCODE_FMATH >> 2] = 1,
+    [OPCODE_ALUI >> 2] = 1,
+    [OPCODE_LOOP >> 2] = 1,
+    [OPCODE_LDSP >> 2] = 1,
+    [OPCODE_LOAD_IDX >> 2] = 1,
+    [OPCODE_BITOP >> 2] = 1,
+    [OPCODE_PERF >> 2] = 1,
+};
+
+/// Immediate of the big instruction on `pc`, 0 if it runs past the end of the text segment.
+static u64 itrace_imm(const Machine *machine, u8 flags) {
+  if (machine->pc + 4 + imm_len(flags) > VMEM_SEG_SIZE)
+    return 0;
+  return decode_imm(&machine->vmem_text[machine->pc + 4], flags);
+}
+
+/// Address accessed by the instruction, as computed by the instruction before it is executed.
+/// Returns the `ITRACE_*_ADDR` flags, 0 if the instruction doesn't access memory.
+attribute(noinline) static u8 itrace_addr(Machine *machine, const u8 *inst, u64 *addr) {
+  u8 flags = GET_FLAGS(inst);
+  u8 real = flags & MEMFLAG_VMEM ? ITRACE_REAL_ADDR : 0;
+  switch (inst[0] & 0b11111100) {
+  case OPCODE_LOAD_DIR:
+  case OPCODE_STORE_DIR:
+    *addr = *machine_reg(machine, GET_OPERAND1(inst));
+    return ITRACE_HAS_ADDR | real;
+  case OPCODE_LOAD_IND:
+    *addr = *machine_reg(machine, GET_OPERAND1(inst)) + itrace_imm(machine, flags);
+    return ITRACE_HAS_ADDR | real;
+  case OPCODE_STORE_IND:
+    // The interpreter takes the base address from operand 0.
+    *addr = *machine_reg(machine, GET_OPERAND0(inst)) + itrace_imm(machine, flags);
+    return ITRACE_HAS_ADDR | real;
+  case OPCODE_STORE_IMM:
+    *addr = itrace_imm(machine, flags);
+    return ITRACE_HAS_ADDR | real;
+  case OPCODE_LOAD_IDX:
+  case OPCODE_STORE_IDX:
+    *addr = *machine_reg(machine, GET_OPERAND1(inst)) +
+            (*machine_reg(machine, GET_OPERAND2(inst)) << MEMFLAG_SCALE(flags)) + itrace_imm(machine, flags);
+    return ITRACE_HAS_ADDR | real;
+  case OPCODE_LDSP:
+  case OPCODE_STSP:
+    *addr = machine->reg_sp - (u16)GET_IMM16(inst);
+    return ITRACE_HAS_ADDR;
+  case OPCODE_PUSH:
+    *addr = machine->reg_sp;
+    return ITRACE_HAS_ADDR;
+  case OPCODE_POP:
+    *addr = machine->reg_sp - oplen_to_size(inst[0] & 0b11);
+    return ITRACE_HAS_ADDR;
+  default:
+    return 0;
+  }
+}
+
+/// Fill in the value of the latest record.
+static inline void itrace_fill_value(Machine *machine, u64 head) {
+  ItraceRecord *prev = &itrace.records[(head - 1) & itrace.mask];
+  if (prev->flags & ITRACE_HAS_VALUE)
+    prev->value = *machine_reg(machine, prev->dest);
+}
+
+static inline void itrace_record(Machine *machine, const u8 *inst) {
+  u64 head = __atomic_load_n(&itrace.header->head, __ATOMIC_RELAXED);
+  if (head != 0)
+    itrace_fill_value(machine, head);
+  ItraceRecord *record = &itrace.records[head & itrace.mask];
+  record->pc = machine->pc;
+  record->inst0 = inst[0];
+  u8 dest = DEST_OPERANDS[inst[0] >> 2];
+  u8 flags = 0;
+  if (dest != 0) {
+    record->dest = dest == 1 ? GET_OPERAND0(inst) : GET_OPERAND1(inst);
+    flags = ITRACE_HAS_VALUE;
+  }
+  u8 opcode = inst[0] & 0b11111100;
+  if ((opcode >= OPCODE_LOAD_DIR && opcode <= OPCODE_STORE_IND) || opcode == OPCODE_PUSH || opcode == OPCODE_POP ||
+      (opcode >= OPCODE_LDSP && opcode <= OPCODE_STORE_IDX))
+    flags |= itrace_addr(machine, inst, &record->addr);
+  record->flags = flags;
+  __atomic_store_n(&itrace.header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void itrace_run(Machine *machine, const char *path, u64 capacity) {
+  u64 cap = 1;
+  while (cap < capacity)
+    cap *= 2;
+  usize size = sizeof(ItraceHeader) + sizeof(ItraceRecord) * cap;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t)size) != 0)
+    panic_printf("Cannot create trace file %s\n", path);
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    panic_printf("Cannot map trace file %s\n", path);
+  close(fd);
+
+  ItraceHeader *header = map;
+  memcpy(header->magic, ITRACE_MAGIC, sizeof(header->magic));
+  header->version = ITRACE_VERSION;
+  header->record_size = sizeof(ItraceRecord);
+  header->capacity = cap;
+  header->head = 0;
+  memcpy(header->text, machine->vmem_text, VMEM_SEG_SIZE);
+  itrace = (Itrace){header, (ItraceRecord *)(header + 1), cap - 1};
+
+  machine_run(machine);
+
+  u64 head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+  if (head != 0)
+    itrace_fill_value(machine, head);
+  itrace = (Itrace){0};
+  munmap(map, size);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "machine.h"
+
+/// Format of instruction trace files, written by `itrace_run` and read by `lbvm-trace`.
+/// A file is an `ItraceHeader` followed by a ring of `capacity` records.
+
+#define ITRACE_MAGIC "LBVMITRC"
+#define ITRACE_VERSION 1
+
+typedef struct ItraceHeader {
+  char magic[8];
+  u32 version;
+  u32 record_size;
+  /// Number of records in the ring, a power of two.
+  u64 capacity;
+  /// Number of records ever written, the latest `min(head, capacity)` of them are in the ring, record `i` being at
+  /// index `i % capacity`.
+  /// Stored with release ordering after each record is written, so that a reader can follow a live trace.
+  u64 head;
+  /// Text segment of the traced program, for disassembling the records.
+  u8 text[VMEM_SEG_SIZE];
+} ItraceHeader;
+
+/// `value` is the value of the register `dest` after the instruction.
+/// The value of the latest record is only filled in when the next instruction starts.
+#define ITRACE_HAS_VALUE 0b001
+/// `addr` is the address accessed by the instruction.
+#define ITRACE_HAS_ADDR 0b010
+/// `addr` is a real address rather than a vmem address.
+#define ITRACE_REAL_ADDR 0b100
+
+typedef struct ItraceRecord {
+  u64 value;
+  u64 addr;
+  u16 pc;
+  /// First byte of the instruction (opcode and oplen).
+  u8 inst0;
+  u8 flags;
+  u8 dest;
+  u8 reserved[3];
+} ItraceRecord;
+
+/// Run the machine with a separately compiled variant of the interpreter, which appends a record of every instruction
+/// into the ring buffer of `capacity` (rounded up to a power of two) records in the trace file at `path`.
+/// The file is memory-mapped, so the trace of the latest instructions survives a crash of the host process.
+void itrace_run(Machine *machine, const char *path, u64 capacity);
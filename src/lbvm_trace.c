@@ -0,0 +1,183 @@
+// `lbvm-trace`, decoder of the instruction trace files written by `lbvm --trace`.
+
+#include "common.h"
+#include "disasm.h"
+#include "itrace.h"
+#include "report.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct Filter {
+  /// Only the latest `last` records of the ring, before the other filters.
+  u64 last;
+  bool has_pc;
+  u16 pc;
+  /// Name of the instruction (e.g. `"add"`), `NULL` for any.
+  const char *inst;
+} Filter;
+
+static bool filter_accepts(const Filter *filter, const ItraceRecord *record) {
+  if (filter->has_pc && record->pc != filter->pc)
+    return false;
+  if (filter->inst != NULL) {
+    const char *name = disasm_name(record->inst0);
+    if (name == NULL || strcmp(name, filter->inst) != 0)
+      return false;
+  }
+  return true;
+}
+
+static void print_addr(FILE *output, const ItraceRecord *record) {
+  if (record->flags & ITRACE_REAL_ADDR)
+    fprintf(output, "  [real 0x%llX]", record->addr);
+  else
+    fprintf(output, "  [0x%05llX]", record->addr);
+}
+
+static void dump(const ItraceHeader *header, const ItraceRecord *records, u64 first, u64 head, const Filter *filter) {
+  char buf[128];
+  for (u64 i = first; i < head; ++i) {
+    const ItraceRecord *record = &records[i & (header->capacity - 1)];
+    if (!filter_accepts(filter, record))
+      continue;
+    // The text segment may have been modified by the program since, fall back to the traced first byte.
+    if (header->text[record->pc] == record->inst0)
+      disasm(header->text, record->pc, buf, sizeof(buf));
+    else
+      disasm_label(record->inst0, buf, sizeof(buf));
+    printf("%12llu  0x1%04X  %-36s", i, record->pc, buf);
+    if (record->flags & ITRACE_HAS_VALUE)
+      printf("  %s = 0x%llX", disasm_reg_name(record->dest), record->value);
+    if (record->flags & ITRACE_HAS_ADDR)
+      print_addr(stdout, record);
+    printf("\n");
+  }
+}
+
+/// Maximum number of rows in each section of the summary.
+#define SUMMARY_ROWS 20
+
+static void summarise(const ItraceHeader *header, const ItraceRecord *records, u64 first, u64 head,
+                      const Filter *filter) {
+  u64 inst_counts[256] = {0};
+  u64 *pc_counts = xalloc(u64, VMEM_SEG_SIZE);
+  memset(pc_counts, 0, sizeof(u64) * VMEM_SEG_SIZE);
+  // Memory accesses by segment (stack, text, data, other vmem, real).
+  u64 segment_counts[5] = {0};
+  u64 n = 0;
+  for (u64 i = first; i < head; ++i) {
+    const ItraceRecord *record = &records[i & (header->capacity - 1)];
+    if (!filter_accepts(filter, record))
+      continue;
+    ++n;
+    ++inst_counts[record->inst0];
+    ++pc_counts[record->pc];
+    if (record->flags & ITRACE_REAL_ADDR)
+      ++segment_counts[4];
+    else if (record->flags & ITRACE_HAS_ADDR)
+      ++segment_counts[record->addr < 0x30000 ? record->addr >> 16 : 3];
+  }
+  printf("=== %llu records (#%llu to #%llu), %llu instructions traced in total\n", n, first, head, head);
+
+  printf("\n--- by instruction\n");
+  u32 len;
+  u32 *indices = report_sorted_nonzero(inst_counts, 256, &len);
+  char buf[128];
+  for (u32 i = 0; i < len && i < SUMMARY_ROWS; ++i) {
+    disasm_label((u8)indices[i], buf, sizeof(buf));
+    printf("%-16s %14llu %7.2f%%\n", buf, inst_counts[indices[i]],
+           report_percentage(inst_counts[indices[i]], n));
+  }
+  xfree(indices);
+
+  printf("\n--- by address\n");
+  indices = report_sorted_nonzero(pc_counts, VMEM_SEG_SIZE, &len);
+  for (u32 i = 0; i < len && i < SUMMARY_ROWS; ++i) {
+    disasm(header->text, (u16)indices[i], buf, sizeof(buf));
+    printf("0x1%04X  %14llu %7.2f%%  %s\n", indices[i], pc_counts[indices[i]],
+           report_percentage(pc_counts[indices[i]], n), buf);
+  }
+  xfree(indices);
+  xfree(pc_counts);
+
+  printf("\n--- memory accesses\n");
+  static const char *const SEGMENT_NAMES[5] = {"stack", "text", "data", "other vmem", "real"};
+  for (u32 i = 0; i < 5; ++i)
+    printf("%-16s %14llu\n", SEGMENT_NAMES[i], segment_counts[i]);
+}
+
+static void print_usage(const char *arg0) {
+  fprintf(stderr, "usage: %s TRACE [--summary] [--last N] [--pc ADDRESS] [--inst NAME]\n", arg0);
+}
+
+i32 main(int argc, char **argv) {
+  const char *path = NULL;
+  bool summary = false;
+  Filter filter = {0};
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--summary") == 0) {
+      summary = true;
+    } else if (strcmp(arg, "--last") == 0) {
+      if (++i == argc || atoll(argv[i]) <= 0) {
+        panic_printf("Expect a positive number of records after `--last`\n");
+      }
+      filter.last = (u64)atoll(argv[i]);
+    } else if (strcmp(arg, "--pc") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect an address after `--pc`\n");
+      }
+      filter.has_pc = true;
+      filter.pc = (u16)strtoull(argv[i], NULL, 0);
+    } else if (strcmp(arg, "--inst") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect an instruction name after `--inst`\n");
+      }
+      filter.inst = argv[i];
+    } else if (path == NULL) {
+      path = arg;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (path == NULL) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    panic_printf("Path %s doesn't exist\n", path);
+  if ((usize)st.st_size < sizeof(ItraceHeader))
+    panic_printf("%s is not an instruction trace\n", path);
+  const ItraceHeader *header = mmap(NULL, (usize)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED)
+    panic_printf("Cannot map %s\n", path);
+  close(fd);
+  if (memcmp(header->magic, ITRACE_MAGIC, sizeof(header->magic)) != 0)
+    panic_printf("%s is not an instruction trace\n", path);
+  if (header->version != ITRACE_VERSION || header->record_size != sizeof(ItraceRecord))
+    panic_printf("Unsupported instruction trace version %u in %s\n", header->version, path);
+  // Records are indexed by masking with `capacity - 1`.
+  if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0)
+    panic_printf("Invalid capacity %llu of instruction trace %s, expect a power of two\n", header->capacity, path);
+  if (header->capacity > ((usize)st.st_size - sizeof(ItraceHeader)) / sizeof(ItraceRecord))
+    panic_printf("Truncated instruction trace %s\n", path);
+
+  const ItraceRecord *records = (const ItraceRecord *)(header + 1);
+  u64 head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  u64 first = head > header->capacity ? head - header->capacity : 0;
+  if (filter.last != 0 && head - first > filter.last)
+    first = head - filter.last;
+  if (summary)
+    summarise(header, records, first, head, &filter);
+  else
+    dump(header, records, first, head, &filter);
+  munmap((void *)header, (usize)st.st_size);
+  return 0;
+}
@@ -0,0 +1,43 @@
+#include "libc_stats.h"
+#include "disasm.h"
+
+void libc_stats_report(const LibcStats *stats, u64 run_ns, FILE *stream) {
+  u8 callcodes[256];
+  u32 len = 0;
+  u64 calls = 0;
+  u64 total_ns = 0;
+  for (u32 i = 0; i < 256; ++i) {
+    const LibcCallStats *call = stats->calls[i];
+    if (call == NULL)
+      continue;
+    // Insertion sort by total time in descending order.
+    u32 j = len++;
+    for (; j > 0 && stats->calls[callcodes[j - 1]]->total_ns < call->total_ns; --j)
+      callcodes[j] = callcodes[j - 1];
+    callcodes[j] = (u8)i;
+    calls += call->calls;
+    total_ns += call->total_ns;
+  }
+
+  fprintf(stream, "=== %llu libc calls in %llu ns", calls, total_ns);
+  if (run_ns != 0)
+    fprintf(stream, " (%.2f%% of the run, %.2f%% interpreting)", (f64)total_ns * 100 / (f64)run_ns,
+            total_ns < run_ns ? (f64)(run_ns - total_ns) * 100 / (f64)run_ns : 0.0);
+  fprintf(stream, "\n");
+  if (len == 0)
+    return;
+  fprintf(stream, "%-12s %10s %14s %10s %10s %10s %10s %10s %10s %14s\n", "callcode", "calls", "total ns", "avg ns",
+          "min ns", "p50 ns", "p90 ns", "p99 ns", "max ns", "bytes");
+  for (u32 i = 0; i < len; ++i) {
+    const LibcCallStats *call = stats->calls[callcodes[i]];
+    char name[16];
+    const char *libc_name = disasm_libc_name(callcodes[i]);
+    if (libc_name != NULL)
+      snprintf(name, sizeof(name), "%s", libc_name);
+    else
+      snprintf(name, sizeof(name), "%u", callcodes[i]);
+    fprintf(stream, "%-12s %10llu %14llu %10llu %10llu %10llu %10llu %10llu %10llu %14llu\n", name, call->calls,
+            call->total_ns, call->total_ns / call->calls, call->min_ns, libc_call_stats_percentile(call, 50),
+            libc_call_stats_percentile(call, 90), libc_call_stats_percentile(call, 99), call->max_ns, call->bytes);
+  }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+#include "perf.h"
+
+/// Statistics of the libc calls of one callcode.
+typedef struct LibcCallStats {
+  u64 calls;
+  /// Bytes written or read by the call, only counted for `fwrite`, `fread`, `printf`, `fprintf`, `puts` and `fputs`.
+  u64 bytes;
+  u64 total_ns;
+  u64 min_ns;
+  u64 max_ns;
+  /// Log-scaled histogram of the latencies (see `latency_hist_bucket`).
+  u64 hist[LATENCY_HIST_BUCKETS];
+} LibcCallStats;
+
+/// Per-callcode statistics of libc calls, recorded by a machine whose `libc_stats` is set by the embedder.
+typedef struct LibcStats {
+  /// Allocated on the first call of each callcode, `NULL` for callcodes never called.
+  LibcCallStats *calls[256];
+} LibcStats;
+
+static inline LibcStats *libc_stats_new() {
+  LibcStats *stats = xalloc(LibcStats, 1);
+  memset(stats, 0, sizeof(LibcStats));
+  return stats;
+}
+
+static inline void libc_stats_free(LibcStats *stats) {
+  for (u32 i = 0; i < 256; ++i)
+    xfree(stats->calls[i]);
+  xfree(stats);
+}
+
+/// Latency of the call at `percentile` (in `[0, 100]`), see `latency_hist_percentile`.
+static inline u64 libc_call_stats_percentile(const LibcCallStats *stats, f64 percentile) {
+  return latency_hist_percentile(stats->hist, stats->calls, stats->max_ns, percentile);
+}
+
+/// Record a call of `callcode` that took `ns` and transferred `bytes`.
+attribute(noinline) static inline void libc_stats_record(LibcStats *stats, u8 callcode, u64 ns, u64 bytes) {
+  LibcCallStats *call = stats->calls[callcode];
+  if (call == NULL) {
+    call = xalloc(LibcCallStats, 1);
+    memset(call, 0, sizeof(LibcCallStats));
+    call->min_ns = UINT64_MAX;
+    stats->calls[callcode] = call;
+  }
+  ++call->calls;
+  call->bytes += bytes;
+  call->total_ns += ns;
+  if (ns < call->min_ns)
+    call->min_ns = ns;
+  if (ns > call->max_ns)
+    call->max_ns = ns;
+  ++call->hist[latency_hist_bucket(ns)];
+}
+
+/// Print a row per callcode called, sorted by total time, with the share of `run_ns` (the time of the whole run, 0 if
+/// unknown) spent in libc calls.
+void libc_stats_report(const LibcStats *stats, u64 run_ns, FILE *stream);
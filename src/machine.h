@@ -1,10 +1,22 @@
 #pragma once
 
+#include "channel.h"
 #include "common.h"
 #include "debug_utils.h"
+#include "format_cache.h"
+#include "libc_stats.h"
+#include "native.h"
+#include "perf.h"
 #include "values.h"
 
 #include <math.h>
+#include <sched.h>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 static inline void lbvm_check_platform_compatibility() {
   if (sizeof(void *) != 8) {
@@ -17,12 +29,58 @@ static inline void lbvm_check_platform_compatibility() {
   }
 }
 
+/// Count retired instructions in `Machine::n_insts`.
+/// Counting slows down every instruction, so it is only enabled in a separately compiled variant of the interpreter
+/// (see `machine_counted.h`).
+#ifndef MACHINE_COUNT_INSTS
+#define MACHINE_COUNT_INSTS 0
+#endif
+
+// Helpers of large or rarely executed instructions, and of instrumentation, are marked `attribute(noinline)`: inlined,
+// they would grow `machine_next` and slow down the dispatch of every instruction.
+
+/// Hooks for instrumented variants of the interpreter (see `stats.c`), defined before including this header.
+/// Called on every instruction before it is executed, with `machine->pc` still on the instruction.
+#ifndef MACHINE_HOOK_INST
+#define MACHINE_HOOK_INST(MACHINE, INST)
+#endif
+/// Called on the conditional branch (`b`, `ccall`, `loop`) at `PC`.
+#ifndef MACHINE_HOOK_BRANCH
+#define MACHINE_HOOK_BRANCH(MACHINE, PC, TAKEN)
+#endif
+/// Called after a call (`call`, `ccall`, `callr`, `tcall`) has jumped to its target.
+#ifndef MACHINE_HOOK_CALL
+#define MACHINE_HOOK_CALL(MACHINE)
+#endif
+/// Called after `ret` has returned to the caller.
+#ifndef MACHINE_HOOK_RET
+#define MACHINE_HOOK_RET(MACHINE)
+#endif
+/// Called before and after the libc function of `libc_call` is performed.
+#ifndef MACHINE_HOOK_LIBC_ENTER
+#define MACHINE_HOOK_LIBC_ENTER(MACHINE, CALLCODE)
+#endif
+#ifndef MACHINE_HOOK_LIBC_EXIT
+#define MACHINE_HOOK_LIBC_EXIT(MACHINE, CALLCODE)
+#endif
+
 typedef struct machine Machine;
 
 typedef void (*breakpoint_callback_t)(struct machine *);
 
+/// Called in place of libc `fopen` if not `NULL`.
+typedef FILE *(*fopen_callback_t)(struct machine *, const char *path, const char *mode);
+
 struct machine {
   bool config_silent;
+  /// Instead of calling libc functions that may block on I/O, stop the machine and leave the call pending, so that the
+  /// embedder can perform the call on another thread with `machine_resume_libc_call`.
+  bool config_defer_blocking_io;
+  bool has_pending_libc_call;
+  u8 pending_libc_call;
+  /// Set when the machine stopped because an instruction cannot complete yet (e.g. sending to a full channel).
+  /// The instruction is retried when the machine is run again.
+  bool yielded;
   union machine_status_reg {
     u64 numeric;
     struct __attribute__((packed)) {
@@ -56,11 +114,43 @@ struct machine {
   u8 *restrict vmem_data;
   void *breakpoint_callback_cx;
   breakpoint_callback_t breakpoint_callback;
+  fopen_callback_t fopen_callback;
+  /// Native functions callable by `native_call`, may be `NULL` if the embedder doesn't provide any.
+  const NativeRegistry *native_registry;
+  /// Parsed format strings of `printf`, `fprintf` and `snprintf` calls, allocated on the first call.
+  FormatCache *format_cache;
+  /// Exit code passed to libc `exit` by the program, `MACHINE_EXIT_FAULT` if the machine stopped on a fault.
+  i32 exit_code;
+  /// Set when the machine stopped on `exit`, `brk` or `cbrk`, as opposed to a fault (see `machine_record_stop`).
+  bool halted;
+  /// Streams used by libc calls that implicitly use stdin/stdout (e.g. `printf`, `scanf`) and for diagnostics.
+  /// Defaults to the host's stdin/stdout/stderr, an embedder may redirect them to capture the output of a machine.
+  FILE *io_stdin;
+  FILE *io_stdout;
+  FILE *io_stderr;
+  /// Channels created by the embedder, guests refer to them by index in `chan_send`/`chan_recv`/`chan_close` calls.
+  Channel **channels;
+  u32 channels_len;
+  /// Number of instructions retired, read by `perf instret`.
+  /// Only counted if `MACHINE_COUNT_INSTS` is enabled (see `machine_run_counted`).
+  u64 n_insts;
+  /// Set when `perf instret` ran in an interpreter that doesn't count instructions, so it read 0.
+  bool read_uncounted_instret;
+  /// Timestamps recorded by `perf mark`.
+  PerfMarks perf_marks;
+  /// Per-callcode statistics of the libc calls, only recorded if set by the embedder, who owns it.
+  LibcStats *libc_stats;
+  /// Zones delimited by `perf zone_begin` and `perf zone_end`, only recorded if set by the embedder, who owns it.
+  ZoneProfile *zones;
 };
 
 #define MACHINE_SILENT 1
 #define MACHINE_NOT_SILENT 0
 
+/// Exit code of a machine that stopped on a fault, e.g. an illegal instruction, a division by zero or an out-of-bounds
+/// memory access. Programs can't exit with it, as libc `exit` takes an 8-bit code.
+#define MACHINE_EXIT_FAULT (-1)
+
 static inline Machine machine_new(bool config_silent, breakpoint_callback_t breakpoint_callback,
                                   void *breakpoint_callback_cx) {
   Machine machine = {0};
@@ -70,9 +160,51 @@ static inline Machine machine_new(bool config_silent, breakpoint_callback_t brea
   machine.config_silent = config_silent;
   machine.breakpoint_callback = breakpoint_callback;
   machine.breakpoint_callback_cx = breakpoint_callback_cx;
+  machine.io_stdin = stdin;
+  machine.io_stdout = stdout;
+  machine.io_stderr = stderr;
   return machine;
 }
 
+static inline void machine_free(Machine *machine) {
+  free(machine->vmem_text);
+  free(machine->vmem_data);
+  free(machine->vmem_stack);
+  if (machine->format_cache != NULL)
+    format_cache_free(machine->format_cache);
+  perf_marks_free(&machine->perf_marks);
+}
+
+/// Reset registers and exit code, keeps the memory and configs.
+static inline void machine_reset(Machine *machine) {
+  machine->reg_status.numeric = 0;
+  machine->pc = 0;
+  machine->reg_0 = 0;
+  machine->reg_1 = 0;
+  machine->reg_2 = 0;
+  machine->reg_3 = 0;
+  machine->reg_4 = 0;
+  machine->reg_5 = 0;
+  machine->reg_6 = 0;
+  machine->reg_7 = 0;
+  machine->reg_8 = 0;
+  machine->reg_9 = 0;
+  machine->reg_10 = 0;
+  machine->reg_11 = 0;
+  machine->reg_12 = 0;
+  machine->reg_13 = 0;
+  machine->reg_sp = 0;
+  machine->exit_code = 0;
+  machine->halted = false;
+  machine->has_pending_libc_call = false;
+  machine->yielded = false;
+  machine->n_insts = 0;
+  machine->read_uncounted_instret = false;
+  machine->perf_marks.len = 0;
+  if (machine->zones != NULL)
+    machine->zones->depth = 0;
+}
+
 static inline void machine_load_program(Machine *machine, const u8 *text_segment, usize text_segment_size,
                                         const u8 *data_segment, usize data_segment_size) {
   memcpy(machine->vmem_text, text_segment, text_segment_size);
@@ -121,25 +253,62 @@ static inline u64 *machine_reg(Machine *machine, u8 reg_code) {
 #define MACHINE_CHECK_PC_OVERFLOW(MACHINE, LEN)                                                                        \
   if (MACHINE->pc + LEN > VMEM_SEG_SIZE) {                                                                             \
     if (!MACHINE->config_silent)                                                                                       \
-      fprintf(stderr, "PC overflowed\n");                                                                              \
+      fprintf(MACHINE->io_stderr, "PC overflowed\n");                                                                  \
     return false;                                                                                                      \
   }
 
-/// Fetch the 8 data bytes on pc for big instructions.
-/// Make sure to do `MACHINE_CHECK_PC_OVERFLOW(machine, 8)` before this!
-static inline u64 machine_fetch_data_qword(Machine *machine) {
-  u64 value;
-  memcpy(&value, &machine->vmem_text[machine->pc], 8);
-  machine->pc += 8;
-  return value;
+/// Length in bytes of the immediate of a big instruction with `flags`.
+static inline u8 imm_len(u8 flags) {
+  switch (flags & IMMFLAG_WIDTH) {
+  case IMMFLAG_16:
+    return 2;
+  case IMMFLAG_32:
+    return 4;
+  case IMMFLAG_8:
+    return 1;
+  default:
+    return 8;
+  }
 }
 
-static inline bool machine_jump_offset(Machine *machine, i8 offset) {
-  MACHINE_CHECK_PC_OVERFLOW(machine, offset);
-  machine->pc += offset;
+/// Decode the immediate of a big instruction with `flags` from `bytes`, zero- or sign-extending it to 64 bits.
+static inline u64 decode_imm(const u8 *bytes, u8 flags) {
+  bool sign = flags & IMMFLAG_SIGNED;
+  switch (flags & IMMFLAG_WIDTH) {
+  case IMMFLAG_16: {
+    u16 value;
+    memcpy(&value, bytes, 2);
+    return sign ? (u64)(i64)(i16)value : value;
+  }
+  case IMMFLAG_32: {
+    u32 value;
+    memcpy(&value, bytes, 4);
+    return sign ? (u64)(i64)(i32)value : value;
+  }
+  case IMMFLAG_8:
+    return sign ? (u64)(i64)(i8)bytes[0] : bytes[0];
+  default: {
+    u64 value;
+    memcpy(&value, bytes, 8);
+    return value;
+  }
+  }
+}
+
+/// Fetch the immediate on pc for big instructions, whose width is encoded in their `flags`.
+static inline bool machine_fetch_imm(Machine *machine, u8 flags, u64 *imm) {
+  u8 len = imm_len(flags);
+  MACHINE_CHECK_PC_OVERFLOW(machine, len);
+  *imm = decode_imm(&machine->vmem_text[machine->pc], flags);
+  machine->pc += len;
   return true;
 }
 
+/// Offsets wrap around within the text segment, so that a 16-bit offset can reach any address.
+static inline void machine_jump_offset(Machine *machine, i16 offset) {
+  machine->pc += offset;
+}
+
 static inline size_t oplen_to_size(const u8 oplen) {
   switch (oplen) {
   case OPLEN_8:
@@ -171,12 +340,23 @@ static inline void *solve_addr(Machine *machine, u8 vmem_flag, u64 addr) {
     } break;
     default:
       if (!machine->config_silent)
-        fprintf(stderr, "Out of bound vmem access @ 0x1%04X (address: 0x%016llX)\n", machine->pc - 4, addr);
+        fprintf(machine->io_stderr, "Out of bound vmem access @ 0x1%04X (address: 0x%016llX)\n", machine->pc - 4, addr);
       return NULL;
     }
   }
 }
 
+/// Returns the address of `size` bytes at `sp - offset` on the stack, or `NULL` if out of bound.
+static inline void *machine_stack_slot(Machine *machine, u16 offset, size_t size) {
+  if (offset > machine->reg_sp || machine->reg_sp - offset + size > VMEM_SEG_SIZE) {
+    if (!machine->config_silent)
+      fprintf(machine->io_stderr, "Out of bound vmem access @ 0x1%04X (address: 0x%016llX)\n", machine->pc - 4,
+              machine->reg_sp - offset);
+    return NULL;
+  }
+  return &machine->vmem_stack[machine->reg_sp - offset];
+}
+
 static inline u64 mask_val(u64 value, u8 oplen) {
   switch (oplen) {
   case OPLEN_8:
@@ -192,6 +372,22 @@ static inline u64 mask_val(u64 value, u8 oplen) {
   }
 }
 
+/// Sign-extend the lower `oplen` bytes of `value` to 64 bits.
+static inline u64 sign_extend(u64 value, u8 oplen) {
+  switch (oplen) {
+  case OPLEN_8:
+    return value;
+  case OPLEN_4:
+    return (u64)(i64)(i32)value;
+  case OPLEN_2:
+    return (u64)(i64)(i16)value;
+  case OPLEN_1:
+    return (u64)(i64)(i8)value;
+  default:
+    panic_printf("Called `%s` with illegal oplen %u\n", __FUNCTION__, oplen);
+  }
+}
+
 static inline u64 mask_val_and_set_flag_n(Machine *machine, u64 value, u8 oplen) {
   switch (oplen) {
   case OPLEN_8:
@@ -216,16 +412,52 @@ static inline u64 mask_val_and_set_flag_n(Machine *machine, u64 value, u8 oplen)
 #define GET_OPERAND2(INST) ((INST)[2] & 0b00001111)
 #define GET_OPERAND3(INST) (((INST)[2] & 0b11110000) >> 4)
 #define GET_FLAGS(INST) ((INST)[3])
-#define GET_JUMP_OFFSET(INST) (((i8)((INST)[1])) | (i8)((INST)[2] << 8))
+#define GET_JUMP_OFFSET(INST) ((i16)((INST)[1] | ((INST)[2] << 8)))
+/// 16-bit immediate in the last two bytes of `alui` and `loop`.
+#define GET_IMM16(INST) ((i16)((INST)[2] | ((INST)[3] << 8)))
+/// Register mask of `pushm` and `popm`, with bit `N` for reg code `N`.
+#define GET_REG_MASK(INST) ((u16)((INST)[1] | ((INST)[2] << 8)))
+
+static inline Channel *machine_channel(Machine *machine, u64 index) {
+  if (index >= machine->channels_len || machine->channels[index] == NULL) {
+    if (!machine->config_silent)
+      fprintf(machine->io_stderr, "Machine used invalid channel %llu @ 0x1%04X\n", index, machine->pc - 4);
+    return NULL;
+  }
+  return machine->channels[index];
+}
+
+/// Stop the machine and rewind to the current instruction, so it is retried when the machine is run again.
+static inline bool machine_yield(Machine *machine) {
+  machine->pc -= 4;
+  machine->yielded = true;
+  return false;
+}
+
+/// Format with the format cache, with the arguments in registers starting from `first_arg_reg`.
+/// Returns `false` if the format has to be handled by libc, otherwise the output is in `machine->format_cache->out`.
+static inline bool machine_format(Machine *machine, const char *format, u8 first_arg_reg, usize *len) {
+  if (machine->format_cache == NULL)
+    machine->format_cache = format_cache_new();
+  const FormatEntry *entry = format_cache_get(machine->format_cache, format);
+  if (entry == NULL || first_arg_reg + entry->n_args > REG_13 + 1)
+    return false;
+  u64 args[REG_13 + 1];
+  for (u32 i = 0; i < entry->n_args; ++i)
+    args[i] = *machine_reg(machine, first_arg_reg + i);
+  *len = format_cache_run(machine->format_cache, entry, args);
+  return true;
+}
 
 static inline bool machine_libc_call(Machine *machine, u8 callcode) {
   switch (callcode) {
   case LIBC_exit: {
     u8 arg0 = (*(u8 *)&(machine->reg_0));
     if (!machine->config_silent)
-      printf("Machine called libc function `exit` with code %u\n", arg0);
-    else
-      exit(arg0);
+      fprintf(machine->io_stderr, "Machine called libc function `exit` with code %u\n", arg0);
+    machine->exit_code = arg0;
+    machine->halted = true;
+    fflush(machine->io_stdout);
     return false;
   } break;
   case LIBC_malloc: {
@@ -257,6 +489,11 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
   } break;
   case LIBC_printf: {
     const char *restrict arg0 = (*(const char *restrict *)&(machine->reg_0));
+    usize len;
+    if (machine_format(machine, arg0, REG_1, &len)) {
+      machine->reg_0 = fwrite(machine->format_cache->out, 1, len, machine->io_stdout);
+      break;
+    }
     u64 arg1 = (*(u64 *)&(machine->reg_1));
     u64 arg2 = (*(u64 *)&(machine->reg_2));
     u64 arg3 = (*(u64 *)&(machine->reg_3));
@@ -270,12 +507,17 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
     u64 arg11 = (*(u64 *)&(machine->reg_11));
     u64 arg12 = (*(u64 *)&(machine->reg_12));
     u64 arg13 = (*(u64 *)&(machine->reg_13));
-    machine->reg_0 =
-        (u64)printf(arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10, arg11, arg12, arg13);
+    machine->reg_0 = (u64)fprintf(machine->io_stdout, arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10,
+                                  arg11, arg12, arg13);
   } break;
   case LIBC_fprintf: {
     FILE *arg0 = (*(FILE **)&(machine->reg_0));
     const char *restrict arg1 = (*(const char *restrict *)&(machine->reg_1));
+    usize len;
+    if (machine_format(machine, arg1, REG_2, &len)) {
+      machine->reg_0 = fwrite(machine->format_cache->out, 1, len, arg0);
+      break;
+    }
     u64 arg2 = (*(u64 *)&(machine->reg_2));
     u64 arg3 = (*(u64 *)&(machine->reg_3));
     u64 arg4 = (*(u64 *)&(machine->reg_4));
@@ -306,7 +548,9 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
     u64 arg11 = (*(u64 *)&(machine->reg_11));
     u64 arg12 = (*(u64 *)&(machine->reg_12));
     u64 arg13 = (*(u64 *)&(machine->reg_13));
-    machine->reg_0 = (u64)scanf(arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10, arg11, arg12, arg13);
+    machine->reg_0 =
+        (u64)fscanf(machine->io_stdin, arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, arg10, arg11, arg12,
+                    arg13);
   } break;
   case LIBC_fscanf: {
     FILE *arg0 = (*(FILE **)&(machine->reg_0));
@@ -328,7 +572,9 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
   } break;
   case LIBC_puts: {
     const char *arg0 = (*(const char **)&(machine->reg_0));
-    int result = puts(arg0);
+    int result = fputs(arg0, machine->io_stdout);
+    if (result >= 0)
+      result = fputc('\n', machine->io_stdout);
     machine->reg_0 = (u64)result;
   } break;
   case LIBC_fputs: {
@@ -340,6 +586,16 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
     char *restrict arg0 = (*(char *restrict *)&(machine->reg_0));
     usize arg1 = (*(usize *)&(machine->reg_1));
     const char *restrict arg2 = (*(const char *restrict *)&(machine->reg_2));
+    usize len;
+    if (machine_format(machine, arg2, REG_3, &len)) {
+      if (arg1 != 0) {
+        usize n = len < arg1 - 1 ? len : arg1 - 1;
+        memcpy(arg0, machine->format_cache->out, n);
+        arg0[n] = '\0';
+      }
+      machine->reg_0 = len;
+      break;
+    }
     u64 arg3 = (*(u64 *)&(machine->reg_3));
     u64 arg4 = (*(u64 *)&(machine->reg_4));
     u64 arg5 = (*(u64 *)&(machine->reg_5));
@@ -357,7 +613,10 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
   case LIBC_fopen: {
     const char *restrict arg0 = (*(const char *restrict *)&(machine->reg_0));
     const char *restrict arg1 = (*(const char *restrict *)&(machine->reg_1));
-    machine->reg_0 = (u64)fopen(arg0, arg1);
+    if (machine->fopen_callback != NULL)
+      machine->reg_0 = (u64)(machine->fopen_callback)(machine, arg0, arg1);
+    else
+      machine->reg_0 = (u64)fopen(arg0, arg1);
   } break;
   case LIBC_fclose: {
     FILE *arg0 = (*(FILE **)&(machine->reg_0));
@@ -405,10 +664,306 @@ static inline bool machine_libc_call(Machine *machine, u8 callcode) {
     const char *arg1 = (*(const char **)&(machine->reg_1));
     machine->reg_0 = (u64)strcmp(arg0, arg1);
   } break;
+  case LIBC_chan_send: {
+    Channel *channel = machine_channel(machine, machine->reg_0);
+    if (channel == NULL)
+      return false;
+    if (channel_is_closed(channel)) {
+      machine->reg_0 = 1;
+      break;
+    }
+    ChannelMessage message = {.ptr = machine->reg_1, .len = machine->reg_2};
+    if (!channel_try_send(channel, message))
+      return machine_yield(machine);
+    machine->reg_0 = 0;
+  } break;
+  case LIBC_chan_recv: {
+    Channel *channel = machine_channel(machine, machine->reg_0);
+    if (channel == NULL)
+      return false;
+    // Check for closing before receiving, so messages sent before closing are never missed.
+    bool closed = channel_is_closed(channel);
+    ChannelMessage message;
+    if (channel_try_recv(channel, &message)) {
+      machine->reg_0 = 0;
+      machine->reg_1 = message.ptr;
+      machine->reg_2 = message.len;
+    } else if (closed) {
+      machine->reg_0 = 1;
+      machine->reg_1 = 0;
+      machine->reg_2 = 0;
+    } else {
+      return machine_yield(machine);
+    }
+  } break;
+  case LIBC_chan_close: {
+    Channel *channel = machine_channel(machine, machine->reg_0);
+    if (channel == NULL)
+      return false;
+    channel_close(channel);
+  } break;
+  }
+  return true;
+}
+
+/// Libc calls that may block on reading input.
+static inline bool libc_call_may_block(u8 callcode) {
+  switch (callcode) {
+  case LIBC_fread:
+  case LIBC_scanf:
+  case LIBC_fscanf:
+  case LIBC_fopen:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/// One step of CRC-32C (Castagnoli) over the lower `size` bytes of `data`, without pre- or post-inversion.
+static inline u32 crc32c_step(u32 crc, u64 data, size_t size) {
+#if defined(__SSE4_2__)
+  switch (size) {
+  case 8:
+    return (u32)_mm_crc32_u64(crc, data);
+  case 4:
+    return _mm_crc32_u32(crc, (u32)data);
+  case 2:
+    return _mm_crc32_u16(crc, (u16)data);
+  default:
+    return _mm_crc32_u8(crc, (u8)data);
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  switch (size) {
+  case 8:
+    return __crc32cd(crc, data);
+  case 4:
+    return __crc32cw(crc, (u32)data);
+  case 2:
+    return __crc32ch(crc, (u16)data);
+  default:
+    return __crc32cb(crc, (u8)data);
+  }
+#else
+  for (size_t i = 0; i < size; ++i) {
+    crc ^= (u8)(data >> (i * 8));
+    for (u8 bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+  }
+  return crc;
+#endif
+}
+
+/// Perform the `bitop` operation `op` on `lhs_` and `rhs_` of the size of `oplen` into `dest`.
+/// Returns `false` if `op` is not a valid `bitop` operation.
+attribute(noinline) static inline bool machine_bitop(u8 op, u64 lhs_, u64 rhs_, u8 oplen, u64 *dest) {
+  u32 bits = oplen_to_size(oplen) * 8;
+  u64 lhs = mask_val(lhs_, oplen);
+  u64 rhs = mask_val(rhs_, oplen);
+  u64 result;
+  switch (op) {
+  case BITOP_POPCNT:
+    result = __builtin_popcountll(lhs);
+    break;
+  case BITOP_CLZ:
+    result = lhs == 0 ? bits : (u32)__builtin_clzll(lhs) - (64 - bits);
+    break;
+  case BITOP_CTZ:
+    result = lhs == 0 ? bits : (u32)__builtin_ctzll(lhs);
+    break;
+  case BITOP_BSWAP:
+    result = __builtin_bswap64(lhs) >> (64 - bits);
+    break;
+  case BITOP_ROL: {
+    u32 n = rhs % bits;
+    result = n == 0 ? lhs : (lhs << n) | (lhs >> (bits - n));
+  } break;
+  case BITOP_ROR: {
+    u32 n = rhs % bits;
+    result = n == 0 ? lhs : (lhs >> n) | (lhs << (bits - n));
+  } break;
+  case BITOP_MULHI:
+    if (oplen == OPLEN_8)
+      result = (u64)(((unsigned __int128)lhs * rhs) >> 64);
+    else
+      result = (lhs * rhs) >> bits;
+    break;
+  case BITOP_IMULHI:
+    if (oplen == OPLEN_8)
+      result = (u64)(((__int128)(i64)lhs * (i64)rhs) >> 64);
+    else
+      result = (u64)(((i64)sign_extend(lhs, oplen) * (i64)sign_extend(rhs, oplen)) >> bits);
+    break;
+  case BITOP_CRC32C:
+    result = crc32c_step((u32)lhs_, rhs, bits / 8);
+    break;
+  default:
+    return false;
+  }
+  *dest = result;
+  return true;
+}
+
+/// Bytes written or read by a libc call that has returned, given the values of `reg_0` and `reg_1` before the call.
+static inline u64 machine_libc_call_bytes(Machine *machine, u8 callcode, u64 arg0, u64 arg1) {
+  switch (callcode) {
+  case LIBC_fwrite:
+  case LIBC_fread:
+    return machine->reg_0 * arg1;
+  case LIBC_printf:
+  case LIBC_fprintf:
+    return (i64)machine->reg_0 > 0 ? machine->reg_0 : 0;
+  case LIBC_puts:
+    return (i32)machine->reg_0 >= 0 ? strlen((const char *)arg0) + 1 : 0;
+  case LIBC_fputs:
+    return (i32)machine->reg_0 >= 0 ? strlen((const char *)arg0) : 0;
+  default:
+    return 0;
+  }
+}
+
+/// `machine_libc_call` recording the latency and the bytes transferred into `machine->libc_stats`.
+attribute(noinline) static inline bool machine_libc_call_recorded(Machine *machine, u8 callcode) {
+  u64 arg0 = machine->reg_0;
+  u64 arg1 = machine->reg_1;
+  u64 start = monotonic_ns();
+  bool ok = machine_libc_call(machine, callcode);
+  u64 ns = monotonic_ns() - start;
+  libc_stats_record(machine->libc_stats, callcode, ns, machine_libc_call_bytes(machine, callcode, arg0, arg1));
+  return ok;
+}
+
+/// Perform the libc call left pending by a machine with `config_defer_blocking_io`.
+/// Returns `true` if should continue, `false` if should stop.
+static inline bool machine_resume_libc_call(Machine *machine) {
+  debug_assert(machine->has_pending_libc_call);
+  machine->has_pending_libc_call = false;
+  if (machine->libc_stats != NULL)
+    return machine_libc_call_recorded(machine, machine->pending_libc_call);
+  return machine_libc_call(machine, machine->pending_libc_call);
+}
+
+/// Float to integer conversions truncate toward zero and saturate, NaN is converted to `0`.
+static inline u64 f64_to_u64_saturating(f64 x) {
+  if (!(x > 0))
+    return 0;
+  if (x >= 18446744073709551616.0)
+    return UINT64_MAX;
+  return (u64)x;
+}
+
+static inline i64 f64_to_i64_saturating(f64 x) {
+  if (x != x)
+    return 0;
+  if (x <= -9223372036854775808.0)
+    return INT64_MIN;
+  if (x >= 9223372036854775808.0)
+    return INT64_MAX;
+  return (i64)x;
+}
+
+/// `f32` values are stored in the lower 4 bytes of registers.
+static inline f32 reg_to_f32(u64 value) {
+  return transmute(f32, (u32)value);
+}
+
+static inline u64 f32_to_reg(f32 value) {
+  return (u64)transmute(u32, value);
+}
+
+/// Convert `src` by the conversion `conv` into `dest`.
+/// Returns `false` if `conv` is not a valid conversion.
+attribute(noinline) static inline bool machine_cvt(u64 src, u8 conv, u64 *dest) {
+  switch (conv) {
+  case CVT(CVT_U64, CVT_U64):
+  case CVT(CVT_U64, CVT_I64):
+  case CVT(CVT_I64, CVT_U64):
+  case CVT(CVT_I64, CVT_I64):
+  case CVT(CVT_F32, CVT_F32):
+  case CVT(CVT_F64, CVT_F64):
+    *dest = src;
+    break;
+  case CVT(CVT_U64, CVT_F32):
+    *dest = f32_to_reg((f32)src);
+    break;
+  case CVT(CVT_U64, CVT_F64):
+    *dest = transmute(u64, (f64)src);
+    break;
+  case CVT(CVT_I64, CVT_F32):
+    *dest = f32_to_reg((f32)(i64)src);
+    break;
+  case CVT(CVT_I64, CVT_F64):
+    *dest = transmute(u64, (f64)(i64)src);
+    break;
+  case CVT(CVT_F32, CVT_U64):
+    *dest = f64_to_u64_saturating((f64)reg_to_f32(src));
+    break;
+  case CVT(CVT_F32, CVT_I64):
+    *dest = (u64)f64_to_i64_saturating((f64)reg_to_f32(src));
+    break;
+  case CVT(CVT_F32, CVT_F64):
+    *dest = transmute(u64, (f64)reg_to_f32(src));
+    break;
+  case CVT(CVT_F64, CVT_U64):
+    *dest = f64_to_u64_saturating(transmute(f64, src));
+    break;
+  case CVT(CVT_F64, CVT_I64):
+    *dest = (u64)f64_to_i64_saturating(transmute(f64, src));
+    break;
+  case CVT(CVT_F64, CVT_F32):
+    *dest = f32_to_reg((f32)transmute(f64, src));
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+/// Push the registers in `mask` as qwords in ascending order of their reg codes, then allocate `frame_size` bytes.
+attribute(noinline) static inline bool machine_pushm(Machine *machine, u16 mask, u16 frame_size) {
+  u64 values[16];
+  u32 len = 0;
+  for (u8 reg_code = 0; reg_code < 15; ++reg_code) {
+    if (mask & (1 << reg_code))
+      values[len++] = *machine_reg(machine, reg_code);
+  }
+  if (machine->reg_sp + len * 8 + frame_size > VMEM_SEG_SIZE) {
+    if (!machine->config_silent)
+      fprintf(machine->io_stderr, "Stack overflowed @ %104X\n", machine->pc - 4);
+    return false;
+  }
+  memcpy(&machine->vmem_stack[machine->reg_sp], values, len * 8);
+  machine->reg_sp += len * 8 + frame_size;
+  return true;
+}
+
+/// Free `frame_size` bytes, then pop the registers in `mask` pushed by `machine_pushm`.
+attribute(noinline) static inline bool machine_popm(Machine *machine, u16 mask, u16 frame_size) {
+  u32 len = __builtin_popcount(mask);
+  if (machine->reg_sp < len * 8 + frame_size) {
+    if (!machine->config_silent)
+      fprintf(machine->io_stderr, "Stack underflowed @ %104X\n", machine->pc - 4);
+    return false;
+  }
+  machine->reg_sp -= len * 8 + frame_size;
+  u64 values[16];
+  memcpy(values, &machine->vmem_stack[machine->reg_sp], len * 8);
+  u32 i = 0;
+  for (u8 reg_code = 0; reg_code < 15; ++reg_code) {
+    if (mask & (1 << reg_code))
+      *machine_reg(machine, reg_code) = values[i++];
   }
   return true;
 }
 
+/// Warn that `perf instret` reads 0, once per machine.
+attribute(cold, noinline) static inline void machine_warn_uncounted_instret(Machine *machine) {
+  machine->read_uncounted_instret = true;
+  if (!machine->config_silent)
+    fprintf(machine->io_stderr,
+            "`perf instret` @ 0x1%04X reads 0, as this interpreter doesn't count instructions (see `--count-insts`)\n",
+            machine->pc - 4);
+}
+
 /// Returns `true` if should continue, `false` if should stop.
 static inline bool machine_next(Machine *machine) {
   MACHINE_CHECK_PC_OVERFLOW(machine, 4);
@@ -418,13 +973,18 @@ static inline bool machine_next(Machine *machine) {
       machine->vmem_text[machine->pc + 2],
       machine->vmem_text[machine->pc + 3],
   };
+  MACHINE_HOOK_INST(machine, inst);
   machine->pc += 4;
+#if MACHINE_COUNT_INSTS
+  ++machine->n_insts;
+#endif
   const u8 opcode = inst[0] & 0b11111100;
   const u8 oplen = inst[0] & 0b00000011;
   switch (opcode) {
   case OPCODE_BRK:
     if (!machine->config_silent)
-      printf("BRK Interrupt @ 0x1%04X\n", machine->pc - 4);
+      fprintf(machine->io_stderr, "BRK Interrupt @ 0x1%04X\n", machine->pc - 4);
+    machine->halted = true;
     return false;
   case OPCODE_CBRK: {
     u8 cond_flag = GET_FLAGS(inst);
@@ -434,7 +994,8 @@ static inline bool machine_next(Machine *machine) {
       cond = !cond;
     if (cond) {
       if (!machine->config_silent)
-        printf("CBRK Interrupt @ 0x1%04X\n", machine->pc - 4);
+        fprintf(machine->io_stderr, "CBRK Interrupt @ 0x1%04X\n", machine->pc - 4);
+      machine->halted = true;
       return false;
     }
   } break;
@@ -443,8 +1004,8 @@ static inline bool machine_next(Machine *machine) {
   case OPCODE_LOAD_IMM: {
     machine->reg_status.numeric = 0;
     u64 *dest_reg = machine_reg(machine, GET_OPERAND0(inst));
-    MACHINE_CHECK_PC_OVERFLOW(machine, 8);
-    u64 imm = machine_fetch_data_qword(machine);
+    u64 imm;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &imm));
     u64 imm_masked = mask_val_and_set_flag_n(machine, imm, oplen);
     machine->reg_status.flag_z = imm_masked == 0;
     *dest_reg = imm_masked;
@@ -457,27 +1018,31 @@ static inline bool machine_next(Machine *machine) {
     TRY(src);
     *dest_reg = 0;
     memcpy(dest_reg, src, oplen_to_size(oplen)); // use memcpy because address may be unaligned
+    if (GET_FLAGS(inst) & MEMFLAG_SIGNED)
+      *dest_reg = sign_extend(*dest_reg, oplen);
     mask_val_and_set_flag_n(machine, *dest_reg, oplen);
     machine->reg_status.flag_z = src == 0;
   } break;
   case OPCODE_LOAD_IND: {
     u64 src_addr_base = *machine_reg(machine, GET_OPERAND1(inst));
     machine->reg_status.numeric = 0;
-    MACHINE_CHECK_PC_OVERFLOW(machine, 8);
-    u64 src_addr_offset = machine_fetch_data_qword(machine);
+    u64 src_addr_offset;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &src_addr_offset));
     u64 src_addr = src_addr_base + src_addr_offset;
     void *src = solve_addr(machine, GET_FLAGS(inst) & 0b00000001, src_addr);
     TRY(src);
     u64 *dest_reg = machine_reg(machine, GET_OPERAND0(inst));
     *dest_reg = 0;
     memcpy(dest_reg, src, oplen_to_size(oplen)); // use memcpy because address may be unaligned
+    if (GET_FLAGS(inst) & MEMFLAG_SIGNED)
+      *dest_reg = sign_extend(*dest_reg, oplen);
     mask_val_and_set_flag_n(machine, *dest_reg, oplen);
     machine->reg_status.flag_z = src == 0;
   } break;
   case OPCODE_STORE_IMM: {
     machine->reg_status.numeric = 0;
-    MACHINE_CHECK_PC_OVERFLOW(machine, 8);
-    u64 dest_addr = machine_fetch_data_qword(machine);
+    u64 dest_addr;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &dest_addr));
     void *dest = solve_addr(machine, GET_FLAGS(inst) & 0b00000001, dest_addr);
     TRY(dest);
     u64 src = mask_val_and_set_flag_n(machine, *machine_reg(machine, GET_OPERAND0(inst)), oplen);
@@ -496,12 +1061,63 @@ static inline bool machine_next(Machine *machine) {
     mask_val_and_set_flag_n(machine, src, oplen);
     machine->reg_status.flag_z = src == 0;
   } break;
+  case OPCODE_LOAD_IDX: {
+    u8 flags = GET_FLAGS(inst);
+    u64 base = *machine_reg(machine, GET_OPERAND1(inst));
+    u64 index = *machine_reg(machine, GET_OPERAND2(inst));
+    machine->reg_status.numeric = 0;
+    u64 disp;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &disp));
+    void *src = solve_addr(machine, flags & MEMFLAG_VMEM, base + (index << MEMFLAG_SCALE(flags)) + disp);
+    TRY(src);
+    u64 *dest_reg = machine_reg(machine, GET_OPERAND0(inst));
+    *dest_reg = 0;
+    memcpy(dest_reg, src, oplen_to_size(oplen)); // use memcpy because address may be unaligned
+    if (flags & MEMFLAG_SIGNED)
+      *dest_reg = sign_extend(*dest_reg, oplen);
+    mask_val_and_set_flag_n(machine, *dest_reg, oplen);
+    machine->reg_status.flag_z = *dest_reg == 0;
+  } break;
+  case OPCODE_STORE_IDX: {
+    u8 flags = GET_FLAGS(inst);
+    u64 src_ = *machine_reg(machine, GET_OPERAND0(inst));
+    u64 base = *machine_reg(machine, GET_OPERAND1(inst));
+    u64 index = *machine_reg(machine, GET_OPERAND2(inst));
+    machine->reg_status.numeric = 0;
+    u64 disp;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &disp));
+    void *dest = solve_addr(machine, flags & MEMFLAG_VMEM, base + (index << MEMFLAG_SCALE(flags)) + disp);
+    TRY(dest);
+    u64 src = mask_val_and_set_flag_n(machine, src_, oplen);
+    memcpy(dest, &src, oplen_to_size(oplen));
+    machine->reg_status.flag_z = src == 0;
+  } break;
+  case OPCODE_LDSP: {
+    size_t size = oplen_to_size(oplen);
+    void *src = machine_stack_slot(machine, GET_IMM16(inst), size);
+    TRY(src);
+    u64 value = 0;
+    memcpy(&value, src, size);
+    *machine_reg(machine, GET_OPERAND0(inst)) = value;
+    machine->reg_status.numeric = 0;
+    mask_val_and_set_flag_n(machine, value, oplen);
+    machine->reg_status.flag_z = value == 0;
+  } break;
+  case OPCODE_STSP: {
+    size_t size = oplen_to_size(oplen);
+    void *dest = machine_stack_slot(machine, GET_IMM16(inst), size);
+    TRY(dest);
+    machine->reg_status.numeric = 0;
+    u64 src = mask_val_and_set_flag_n(machine, *machine_reg(machine, GET_OPERAND0(inst)), oplen);
+    memcpy(dest, &src, size);
+    machine->reg_status.flag_z = src == 0;
+  } break;
   case OPCODE_STORE_IND: {
     u64 dest_addr_base = *machine_reg(machine, GET_OPERAND0(inst));
     u64 src_ = *machine_reg(machine, GET_OPERAND0(inst));
     machine->reg_status.numeric = 0;
-    MACHINE_CHECK_PC_OVERFLOW(machine, 8);
-    u64 dest_addr_offset = machine_fetch_data_qword(machine);
+    u64 dest_addr_offset;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &dest_addr_offset));
     u64 dest_addr = dest_addr_base + dest_addr_offset;
     void *dest = solve_addr(machine, GET_FLAGS(inst) & 0b00000001, dest_addr);
     TRY(dest);
@@ -554,12 +1170,13 @@ static inline bool machine_next(Machine *machine) {
     bool cond = (u64)(cond_flag & 0b011111111) & machine->reg_status.numeric;
     if (rev)
       cond = !cond;
+    MACHINE_HOOK_BRANCH(machine, machine->pc - 4, cond);
     if (cond) {
-      TRY(machine_jump_offset(machine, GET_JUMP_OFFSET(inst)));
+      machine_jump_offset(machine, GET_JUMP_OFFSET(inst));
     }
   } break;
   case OPCODE_J: {
-    TRY(machine_jump_offset(machine, GET_JUMP_OFFSET(inst)));
+    machine_jump_offset(machine, GET_JUMP_OFFSET(inst));
   } break;
   case OPCODE_ADD: {
     u64 *dest = machine_reg(machine, GET_OPERAND0(inst));
@@ -677,7 +1294,7 @@ static inline bool machine_next(Machine *machine) {
     TY RESULT_ = LHS_ / RHS_;                                                                                          \
     if (RHS_ == 0) {                                                                                                   \
       if (!machine->config_silent)                                                                                     \
-        fprintf(stderr, "Division by zero @ 0x1%04X\n", machine->pc - 4);                                              \
+        fprintf(machine->io_stderr, "Division by zero @ 0x1%04X\n", machine->pc - 4);                                  \
       return false;                                                                                                    \
     }                                                                                                                  \
     machine->reg_status.numeric = 0;                                                                                   \
@@ -715,7 +1332,7 @@ static inline bool machine_next(Machine *machine) {
     TY RESULT_ = LHS_ % RHS_;                                                                                          \
     if (RHS_ == 0) {                                                                                                   \
       if (!machine->config_silent)                                                                                     \
-        fprintf(stderr, "Mod by zero @ 0x1%04X\n", machine->pc - 4);                                                   \
+        fprintf(machine->io_stderr, "Mod by zero @ 0x1%04X\n", machine->pc - 4);                                       \
       return false;                                                                                                    \
     }                                                                                                                  \
     machine->reg_status.numeric = 0;                                                                                   \
@@ -857,7 +1474,7 @@ static inline bool machine_next(Machine *machine) {
     TY RESULT_ = LHS_ / RHS_;                                                                                          \
     if (RHS_ == 0) {                                                                                                   \
       if (!machine->config_silent)                                                                                     \
-        fprintf(stderr, "Division by zero @ %104X\n", machine->pc - 4);                                                \
+        fprintf(machine->io_stderr, "Division by zero @ %104X\n", machine->pc - 4);                                    \
       return false;                                                                                                    \
     }                                                                                                                  \
     machine->reg_status.numeric = 0;                                                                                   \
@@ -894,7 +1511,7 @@ static inline bool machine_next(Machine *machine) {
     TY RHS_ = (TY)rhs;                                                                                                 \
     TY RESULT_ = LHS_ % RHS_;                                                                                          \
     if (RHS_ == 0) {                                                                                                   \
-      fprintf(stderr, "Mod by zero @ %104X\n", machine->pc - 4);                                                       \
+      fprintf(machine->io_stderr, "Mod by zero @ %104X\n", machine->pc - 4);                                           \
       return false;                                                                                                    \
     }                                                                                                                  \
     machine->reg_status.numeric = 0;                                                                                   \
@@ -945,7 +1562,8 @@ static inline bool machine_next(Machine *machine) {
     case OPLEN_2:
     case OPLEN_1: {
       if (!machine->config_silent)
-        fprintf(stderr, "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
                 machine->pc - 4);
       return false;
     } break;
@@ -979,7 +1597,8 @@ static inline bool machine_next(Machine *machine) {
     case OPLEN_2:
     case OPLEN_1: {
       if (!machine->config_silent)
-        fprintf(stderr, "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
                 machine->pc - 4);
       return false;
     } break;
@@ -1013,7 +1632,8 @@ static inline bool machine_next(Machine *machine) {
     case OPLEN_2:
     case OPLEN_1: {
       if (!machine->config_silent)
-        fprintf(stderr, "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
                 machine->pc - 4);
       return false;
     } break;
@@ -1047,7 +1667,8 @@ static inline bool machine_next(Machine *machine) {
     case OPLEN_2:
     case OPLEN_1: {
       if (!machine->config_silent)
-        fprintf(stderr, "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
                 machine->pc - 4);
       return false;
     } break;
@@ -1083,7 +1704,8 @@ static inline bool machine_next(Machine *machine) {
     case OPLEN_2:
     case OPLEN_1: {
       if (!machine->config_silent)
-        fprintf(stderr, "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
                 machine->pc - 4);
       return false;
     } break;
@@ -1135,7 +1757,8 @@ static inline bool machine_next(Machine *machine) {
     case OPLEN_2:
     case OPLEN_1: {
       if (!machine->config_silent)
-        fprintf(stderr, "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
                 machine->pc - 4);
       return false;
     } break;
@@ -1151,7 +1774,7 @@ static inline bool machine_next(Machine *machine) {
       result = lhs << (rhs % 64);
     } break;
     case OPLEN_4: {
-      result = (lhs << (rhs % 32)) & 0x10000000FFFFFFFF;
+      result = (lhs << (rhs % 32)) & 0x00000000FFFFFFFF;
     } break;
     case OPLEN_2: {
       result = (lhs << (rhs % 16)) & 0x000000000000FFFF;
@@ -1174,7 +1797,7 @@ static inline bool machine_next(Machine *machine) {
       result = lhs >> (rhs % 64);
     } break;
     case OPLEN_4: {
-      result = (lhs >> (rhs % 32)) & 0x10000000FFFFFFFF;
+      result = (lhs >> (rhs % 32)) & 0x00000000FFFFFFFF;
     } break;
     case OPLEN_2: {
       result = (lhs >> (rhs % 16)) & 0x000000000000FFFF;
@@ -1268,12 +1891,13 @@ static inline bool machine_next(Machine *machine) {
   case OPCODE_CALL: {
     if (machine->reg_sp + 1 >= VMEM_SEG_SIZE) {
       if (!machine->config_silent)
-        fprintf(stderr, "Stack overflowed @ %104X\n", machine->pc - 4);
+        fprintf(machine->io_stderr, "Stack overflowed @ %104X\n", machine->pc - 4);
       return false;
     }
     memcpy(&machine->vmem_stack[machine->reg_sp], &machine->pc, 2);
     machine->reg_sp += 2;
-    TRY(machine_jump_offset(machine, GET_JUMP_OFFSET(inst)));
+    machine_jump_offset(machine, GET_JUMP_OFFSET(inst));
+    MACHINE_HOOK_CALL(machine);
   } break;
   case OPCODE_CCALL: {
     u8 cond_flag = GET_FLAGS(inst);
@@ -1281,31 +1905,34 @@ static inline bool machine_next(Machine *machine) {
     bool cond = (u64)(cond_flag & 0b011111111) & machine->reg_status.numeric;
     if (rev)
       cond = !cond;
+    MACHINE_HOOK_BRANCH(machine, machine->pc - 4, cond);
     if (cond) {
       if (machine->reg_sp + 1 >= VMEM_SEG_SIZE) {
         if (!machine->config_silent)
-          fprintf(stderr, "Stack overflowed @ %104X\n", machine->pc - 4);
+          fprintf(machine->io_stderr, "Stack overflowed @ %104X\n", machine->pc - 4);
         return false;
       }
       memcpy(&machine->vmem_stack[machine->reg_sp], &machine->pc, 2);
       machine->reg_sp += 2;
-      TRY(machine_jump_offset(machine, GET_JUMP_OFFSET(inst)));
+      machine_jump_offset(machine, GET_JUMP_OFFSET(inst));
+      MACHINE_HOOK_CALL(machine);
     }
   } break;
   case OPCODE_RET: {
     if (machine->reg_sp < 2) {
       if (!machine->config_silent)
-        fprintf(stderr, "Stack underflowed @ %104X\n", machine->pc - 4);
+        fprintf(machine->io_stderr, "Stack underflowed @ %104X\n", machine->pc - 4);
       return false;
     }
     machine->reg_sp -= 2;
     memcpy(&machine->pc, &machine->vmem_stack[machine->reg_sp], 2);
+    MACHINE_HOOK_RET(machine);
   } break;
 #define machine_next_PUSH(SIZE)                                                                                        \
   {                                                                                                                    \
     if (machine->reg_sp + SIZE - 1 >= VMEM_SEG_SIZE) {                                                                 \
       if (!machine->config_silent)                                                                                     \
-        fprintf(stderr, "Stack overflowed @ %104X\n", machine->pc - 4);                                                \
+        fprintf(machine->io_stderr, "Stack overflowed @ %104X\n", machine->pc - 4);                                    \
       return false;                                                                                                    \
     }                                                                                                                  \
     memcpy(&machine->vmem_stack[machine->reg_sp], machine_reg(machine, GET_OPERAND0(inst)), SIZE);                     \
@@ -1331,7 +1958,7 @@ static inline bool machine_next(Machine *machine) {
   {                                                                                                                    \
     if (machine->reg_sp < sizeof(TY)) {                                                                                \
       if (!machine->config_silent)                                                                                     \
-        fprintf(stderr, "Stack underflowed @ %104X\n", machine->pc - 4);                                               \
+        fprintf(machine->io_stderr, "Stack underflowed @ %104X\n", machine->pc - 4);                                   \
       return false;                                                                                                    \
     }                                                                                                                  \
     machine->reg_sp -= sizeof(TY);                                                                                     \
@@ -1359,16 +1986,315 @@ static inline bool machine_next(Machine *machine) {
     }
   } break;
   case OPCODE_LIBC_CALL: {
-    return machine_libc_call(machine, GET_FLAGS(inst));
+    u8 callcode = GET_FLAGS(inst);
+    if (machine->config_defer_blocking_io && libc_call_may_block(callcode)) {
+      machine->has_pending_libc_call = true;
+      machine->pending_libc_call = callcode;
+      return false;
+    }
+    MACHINE_HOOK_LIBC_ENTER(machine, callcode);
+    bool ok = machine->libc_stats != NULL ? machine_libc_call_recorded(machine, callcode)
+                                          : machine_libc_call(machine, callcode);
+    MACHINE_HOOK_LIBC_EXIT(machine, callcode);
+    return ok;
   } break;
   case OPCODE_NATIVE_CALL: {
-    panic_printf("TODO");
+    u64 id;
+    TRY(machine_fetch_imm(machine, GET_FLAGS(inst), &id));
+    const NativeFunction *function = native_registry_get(machine->native_registry, id);
+    if (function == NULL) {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Machine called unregistered native function %llu @ 0x1%04X\n", id,
+                machine->pc - 4 - imm_len(GET_FLAGS(inst)));
+      return false;
+    }
+    const u64 args[NATIVE_MAX_ARGS] = {
+        machine->reg_0, machine->reg_1, machine->reg_2, machine->reg_3, machine->reg_4, machine->reg_5,
+    };
+    machine->reg_0 = function->trampoline(function, args);
   } break;
   case OPCODE_VTOREAL: {
     u64 src = *machine_reg(machine, GET_OPERAND0(inst));
     u64 *dest = machine_reg(machine, GET_OPERAND1(inst));
     *dest = (u64)solve_addr(machine, 0, src);
   } break;
+  case OPCODE_CVT: {
+    u64 src = *machine_reg(machine, GET_OPERAND1(inst));
+    u64 *dest = machine_reg(machine, GET_OPERAND0(inst));
+    if (!machine_cvt(src, GET_FLAGS(inst), dest)) {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: invalid conversion 0x%02X)\n",
+                machine->pc - 4, GET_FLAGS(inst));
+      return false;
+    }
+  } break;
+  case OPCODE_BITOP: {
+    u64 *dest = machine_reg(machine, GET_OPERAND0(inst));
+    u64 lhs = *machine_reg(machine, GET_OPERAND1(inst));
+    u64 rhs = *machine_reg(machine, GET_OPERAND2(inst));
+    u64 result;
+    if (!machine_bitop(GET_FLAGS(inst), lhs, rhs, oplen, &result)) {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: invalid bitop operation %u)\n",
+                machine->pc - 4, GET_FLAGS(inst));
+      return false;
+    }
+    // The oplen of `crc32c` is the size of its data, while the CRC itself is always 32 bits.
+    u8 result_oplen = GET_FLAGS(inst) == BITOP_CRC32C ? OPLEN_4 : oplen;
+    machine->reg_status.numeric = 0;
+    result = mask_val_and_set_flag_n(machine, result, result_oplen);
+    machine->reg_status.flag_z = result == 0;
+    *dest = result;
+  } break;
+  case OPCODE_PERF: {
+    u64 *reg = machine_reg(machine, GET_OPERAND0(inst));
+    switch (GET_FLAGS(inst)) {
+    case PERF_INSTRET:
+      if (!MACHINE_COUNT_INSTS && !machine->read_uncounted_instret)
+        machine_warn_uncounted_instret(machine);
+      *reg = machine->n_insts;
+      break;
+    case PERF_CLOCK:
+      *reg = monotonic_ns();
+      break;
+    case PERF_MARK:
+      perf_marks_push(&machine->perf_marks,
+                      (PerfMark){.label = *reg, .ns = monotonic_ns(), .n_insts = machine->n_insts});
+      break;
+    case PERF_ZONE_BEGIN:
+      if (machine->zones != NULL)
+        zone_profile_begin(machine->zones, *reg);
+      break;
+    case PERF_ZONE_END:
+      if (machine->zones != NULL)
+        zone_profile_end(machine->zones, *reg);
+      break;
+    default:
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: invalid perf operation %u)\n",
+                machine->pc - 4, GET_FLAGS(inst));
+      return false;
+    }
+  } break;
+  case OPCODE_FMATH: {
+    u64 *dest = machine_reg(machine, GET_OPERAND0(inst));
+    u64 lhs = *machine_reg(machine, GET_OPERAND1(inst));
+    u64 rhs = *machine_reg(machine, GET_OPERAND2(inst));
+    u64 acc = *machine_reg(machine, GET_OPERAND3(inst));
+    u8 op = GET_FLAGS(inst);
+#define FMATH_WITH_TY(TY, FROM_REG, TO_REG, SUFFIX)                                                                    \
+  {                                                                                                                    \
+    TY LHS_ = FROM_REG(lhs);                                                                                           \
+    TY RHS_ = FROM_REG(rhs);                                                                                           \
+    TY RESULT_;                                                                                                        \
+    switch (op) {                                                                                                      \
+    case FMATH_SQRT:                                                                                                   \
+      RESULT_ = sqrt##SUFFIX(LHS_);                                                                                    \
+      break;                                                                                                           \
+    case FMATH_ABS:                                                                                                    \
+      RESULT_ = fabs##SUFFIX(LHS_);                                                                                    \
+      break;                                                                                                           \
+    case FMATH_FLOOR:                                                                                                  \
+      RESULT_ = floor##SUFFIX(LHS_);                                                                                   \
+      break;                                                                                                           \
+    case FMATH_CEIL:                                                                                                   \
+      RESULT_ = ceil##SUFFIX(LHS_);                                                                                    \
+      break;                                                                                                           \
+    case FMATH_TRUNC:                                                                                                  \
+      RESULT_ = trunc##SUFFIX(LHS_);                                                                                   \
+      break;                                                                                                           \
+    case FMATH_ROUND:                                                                                                  \
+      RESULT_ = round##SUFFIX(LHS_);                                                                                   \
+      break;                                                                                                           \
+    case FMATH_MIN:                                                                                                    \
+      RESULT_ = fmin##SUFFIX(LHS_, RHS_);                                                                              \
+      break;                                                                                                           \
+    case FMATH_MAX:                                                                                                    \
+      RESULT_ = fmax##SUFFIX(LHS_, RHS_);                                                                              \
+      break;                                                                                                           \
+    case FMATH_FMA:                                                                                                    \
+      RESULT_ = fma##SUFFIX(LHS_, RHS_, FROM_REG(acc));                                                                \
+      break;                                                                                                           \
+    default:                                                                                                           \
+      if (!machine->config_silent)                                                                                     \
+        fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: invalid fmath operation %u)\n",              \
+                machine->pc - 4, op);                                                                                  \
+      return false;                                                                                                    \
+    }                                                                                                                  \
+    machine->reg_status.numeric = 0;                                                                                   \
+    machine->reg_status.flag_z = RESULT_ == 0;                                                                         \
+    machine->reg_status.flag_n = RESULT_ < 0;                                                                          \
+    *dest = TO_REG(RESULT_);                                                                                           \
+  }
+#define FMATH_F64_FROM_REG(X) transmute(f64, X)
+#define FMATH_F64_TO_REG(X) transmute(u64, X)
+    switch (oplen) {
+    case OPLEN_8: {
+      FMATH_WITH_TY(f64, FMATH_F64_FROM_REG, FMATH_F64_TO_REG, );
+    } break;
+    case OPLEN_4: {
+      FMATH_WITH_TY(f32, reg_to_f32, f32_to_reg, f);
+    } break;
+    case OPLEN_2:
+    case OPLEN_1: {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr,
+                "Illegal instruction @ 01x%04X (note: floating point operations must only be qword or dword)\n",
+                machine->pc - 4);
+      return false;
+    } break;
+    }
+  } break;
+  case OPCODE_ALUI: {
+    u64 *dest = machine_reg(machine, GET_OPERAND0(inst));
+    u64 lhs = *dest;
+    u64 rhs = (u64)(i64)GET_IMM16(inst);
+    u64 result;
+    switch (GET_OPERAND1(inst)) {
+    case ALUI_ADD: {
+      switch (oplen) {
+      case OPLEN_8: {
+        ADD_WITH_TY(u64, i64);
+      } break;
+      case OPLEN_4: {
+        ADD_WITH_TY(u32, i32);
+      } break;
+      case OPLEN_2: {
+        ADD_WITH_TY(u16, i16);
+      } break;
+      case OPLEN_1: {
+        ADD_WITH_TY(u8, i8);
+      } break;
+      default:
+        panic();
+      }
+    } break;
+    case ALUI_SUB: {
+      switch (oplen) {
+      case OPLEN_8: {
+        SUB_WITH_TY(u64, i64);
+      } break;
+      case OPLEN_4: {
+        SUB_WITH_TY(u32, i32);
+      } break;
+      case OPLEN_2: {
+        SUB_WITH_TY(u16, i16);
+      } break;
+      case OPLEN_1: {
+        SUB_WITH_TY(u8, i8);
+      } break;
+      default:
+        panic();
+      }
+    } break;
+    case ALUI_AND: {
+      machine->reg_status.numeric = 0;
+      result = mask_val_and_set_flag_n(machine, lhs & rhs, oplen);
+      machine->reg_status.flag_z = result == 0;
+    } break;
+    case ALUI_OR: {
+      machine->reg_status.numeric = 0;
+      result = mask_val_and_set_flag_n(machine, lhs | rhs, oplen);
+    } break;
+    case ALUI_XOR: {
+      machine->reg_status.numeric = 0;
+      result = mask_val_and_set_flag_n(machine, lhs ^ rhs, oplen);
+      machine->reg_status.flag_z = result == 0;
+    } break;
+    case ALUI_SHL: {
+      result = mask_val(lhs << (rhs % (oplen_to_size(oplen) * 8)), oplen);
+    } break;
+    case ALUI_SHR: {
+      result = mask_val(lhs >> (rhs % (oplen_to_size(oplen) * 8)), oplen);
+    } break;
+    case ALUI_CMP: {
+      lhs = mask_val(lhs, oplen);
+      rhs = mask_val(rhs, oplen);
+      machine->reg_status.numeric = 0;
+      machine->reg_status.flag_z = lhs == 0;
+      machine->reg_status.flag_e = lhs == rhs;
+      machine->reg_status.flag_g = lhs > rhs;
+      machine->reg_status.flag_l = lhs < rhs;
+      return true;
+    } break;
+    default:
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: illegal alui operation %u)\n",
+                machine->pc - 4, GET_OPERAND1(inst));
+      return false;
+    }
+    *dest = result;
+  } break;
+  case OPCODE_LOOP: {
+    u64 *counter = machine_reg(machine, GET_OPERAND0(inst));
+    u64 count = mask_val(*counter - 1, oplen);
+    *counter = count;
+    MACHINE_HOOK_BRANCH(machine, machine->pc - 4, count != 0);
+    if (count != 0) {
+      machine_jump_offset(machine, GET_IMM16(inst));
+    }
+  } break;
+  case OPCODE_JR: {
+    u64 target = *machine_reg(machine, GET_OPERAND0(inst));
+    if ((target & ~(u64)0xFFFF) != 0x10000) {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Jump to address outside of text segment @ 0x1%04X (address: 0x%016llX)\n",
+                machine->pc - 4, target);
+      return false;
+    }
+    if (GET_FLAGS(inst) & JR_CALL) {
+      if (machine->reg_sp + 1 >= VMEM_SEG_SIZE) {
+        if (!machine->config_silent)
+          fprintf(machine->io_stderr, "Stack overflowed @ %104X\n", machine->pc - 4);
+        return false;
+      }
+      memcpy(&machine->vmem_stack[machine->reg_sp], &machine->pc, 2);
+      machine->reg_sp += 2;
+    }
+    machine->pc = target & 0xFFFF;
+    if (GET_FLAGS(inst) & JR_CALL) {
+      MACHINE_HOOK_CALL(machine);
+    }
+  } break;
+  case OPCODE_JTAB: {
+    u64 index = *machine_reg(machine, GET_OPERAND0(inst));
+    u16 len = GET_IMM16(inst);
+    MACHINE_CHECK_PC_OVERFLOW(machine, 2 * (u32)len);
+    u16 table = machine->pc;
+    machine->pc += 2 * len;
+    if (index < len) {
+      i16 offset;
+      memcpy(&offset, &machine->vmem_text[table + 2 * index], 2);
+      machine_jump_offset(machine, offset);
+    }
+  } break;
+  case OPCODE_TCALL: {
+    u16 frame_size = GET_FLAGS(inst) * 8;
+    if (machine->reg_sp < frame_size) {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Stack underflowed @ %104X\n", machine->pc - 4);
+      return false;
+    }
+    machine->reg_sp -= frame_size;
+    machine_jump_offset(machine, GET_JUMP_OFFSET(inst));
+    MACHINE_HOOK_CALL(machine);
+  } break;
+  case OPCODE_PUSHM:
+  case OPCODE_POPM: {
+    u16 mask = GET_REG_MASK(inst);
+    if (mask & (1 << REG_SP)) {
+      if (!machine->config_silent)
+        fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: sp cannot be pushed or popped)\n",
+                machine->pc - 4);
+      return false;
+    }
+    u16 frame_size = GET_FLAGS(inst) * 8;
+    if (opcode == OPCODE_PUSHM) {
+      TRY(machine_pushm(machine, mask, frame_size));
+    } else {
+      TRY(machine_popm(machine, mask, frame_size));
+    }
+  } break;
   case OPCODE_BREAKPOINT: {
     if (machine->breakpoint_callback != NULL) {
       (machine->breakpoint_callback)(machine);
@@ -1376,8 +2302,92 @@ static inline bool machine_next(Machine *machine) {
   } break;
   default:
     if (!machine->config_silent)
-      fprintf(stderr, "Illegal instruction @ 01x%04X (note: illegal opcode 0x%02X)\n", machine->pc - 4, inst[1]);
+      fprintf(machine->io_stderr, "Illegal instruction @ 01x%04X (note: illegal opcode 0x%02X)\n", machine->pc - 4,
+              inst[1]);
     return false;
   }
   return true;
 }
+
+/// Label of `perf mark` or zone, being the string at the `vmem` address `addr` if it is in the data segment.
+static inline void machine_perf_label(Machine *machine, u64 addr, char *buf, usize buf_len) {
+  if ((addr & ~(u64)0xFFFF) == 0x20000) {
+    const char *str = (const char *)&machine->vmem_data[addr & 0xFFFF];
+    snprintf(buf, buf_len, "%.*s", (int)strnlen(str, VMEM_SEG_SIZE - (addr & 0xFFFF)), str);
+  } else {
+    snprintf(buf, buf_len, "0x%llX", addr);
+  }
+}
+
+/// Print the timestamps recorded by `perf mark`, each with the time and instructions elapsed since the previous one.
+static inline void machine_dump_perf_marks(Machine *machine, FILE *stream) {
+  const PerfMarks *marks = &machine->perf_marks;
+  if (marks->len == 0)
+    return;
+  fprintf(stream, "%-24s %16s %16s %16s\n", "perf mark", "time (ns)", "delta (ns)", "delta (insts)");
+  for (u32 i = 0; i < marks->len; ++i) {
+    const PerfMark *mark = &marks->marks[i];
+    const PerfMark *prev = i == 0 ? mark : &marks->marks[i - 1];
+    char label[64];
+    machine_perf_label(machine, mark->label, label, sizeof(label));
+    fprintf(stream, "%-24s %16llu %16llu %16llu\n", label, mark->ns - marks->marks[0].ns, mark->ns - prev->ns,
+            mark->n_insts - prev->n_insts);
+  }
+}
+
+/// Print the timings of the zones recorded into `machine->zones`, sorted by total time.
+static inline void machine_dump_zones(Machine *machine, FILE *stream) {
+  const ZoneProfile *profile = machine->zones;
+  if (profile == NULL || (profile->len == 0 && profile->unmatched == 0))
+    return;
+  u32 *order = xalloc(u32, profile->len);
+  for (u32 i = 0; i < profile->len; ++i) {
+    u32 j = i;
+    for (; j > 0 && profile->zones[order[j - 1]].total_ns < profile->zones[i].total_ns; --j)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  fprintf(stream, "%-24s %10s %14s %14s %12s %12s %12s %12s\n", "zone", "count", "total ns", "self ns", "min ns",
+          "p99 ns", "max ns", "avg ns");
+  for (u32 i = 0; i < profile->len; ++i) {
+    const ZoneStats *stats = &profile->zones[order[i]];
+    char label[64];
+    machine_perf_label(machine, stats->id, label, sizeof(label));
+    if (stats->count == 0) {
+      fprintf(stream, "%-24s %10s\n", label, "never ended");
+      continue;
+    }
+    fprintf(stream, "%-24s %10llu %14llu %14llu %12llu %12llu %12llu %12llu\n", label, stats->count, stats->total_ns,
+            stats->self_ns, stats->min_ns, latency_hist_percentile(stats->hist, stats->count, stats->max_ns, 99),
+            stats->max_ns, stats->total_ns / stats->count);
+  }
+  xfree(order);
+  if (profile->depth != 0)
+    fprintf(stream, "%u zone(s) still open when the machine stopped are not counted\n", profile->depth);
+  if (profile->unmatched != 0)
+    fprintf(stream, "%llu `zone_end` without an open zone of the same id are ignored\n", profile->unmatched);
+}
+
+/// Record why `machine_next` or `machine_resume_libc_call` returned `false`: unless the machine halted, yielded or left
+/// a libc call pending, it stopped on a fault, which sets `exit_code` to `MACHINE_EXIT_FAULT`.
+static inline void machine_record_stop(Machine *machine) {
+  if (!machine->halted && !machine->yielded && !machine->has_pending_libc_call)
+    machine->exit_code = MACHINE_EXIT_FAULT;
+}
+
+/// Run the machine until it stops.
+/// A yielded machine is resumed after giving up the host thread for other threads to run.
+static inline void machine_run(Machine *machine) {
+  for (;;) {
+    while (machine_next(machine))
+      ;
+    if (machine->yielded) {
+      machine->yielded = false;
+      sched_yield();
+      continue;
+    }
+    if (!machine->has_pending_libc_call || !machine_resume_libc_call(machine))
+      break;
+  }
+  machine_record_stop(machine);
+}
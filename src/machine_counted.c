@@ -0,0 +1,7 @@
+#define MACHINE_COUNT_INSTS 1
+
+#include "machine_counted.h"
+
+void machine_run_counted(Machine *machine) {
+  machine_run(machine);
+}
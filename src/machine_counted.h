@@ -0,0 +1,6 @@
+#pragma once
+
+#include "machine.h"
+
+/// `machine_run` with `MACHINE_COUNT_INSTS` enabled, so that `perf instret` reads the number of retired instructions.
+void machine_run_counted(Machine *machine);
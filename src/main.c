@@ -1,7 +1,22 @@
+#include "async_output.h"
+#include "batch.h"
 #include "common.h"
 #include "debug_utils.h"
 #include "fileformat.h"
+#include "hwcounters.h"
+#include "libc_stats.h"
+#include "itrace.h"
 #include "machine.h"
+#include "machine_counted.h"
+#include "native_math.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "spmd.h"
+#include "stats.h"
+#include "ngram.h"
+#include "sampler.h"
+#include "symbols.h"
+#include "tracer.h"
 #include "values.h"
 
 void print_char_with_escape(char c) {
@@ -110,16 +125,148 @@ void breakpoint_callback(Machine *machine) {
   getchar();
 }
 
+FILE *prefetch_fopen_callback(Machine *machine, const char *path, const char *mode) {
+  (void)machine;
+  return prefetch_fopen(path, mode);
+}
+
+FILE *create_output(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    panic_printf("Cannot open %s for writing\n", path);
+  }
+  return file;
+}
+
 i32 main(int argc, char **argv) {
   lbvm_check_platform_compatibility();
 
   bool dbg = false;
+  bool async_output = false;
+  bool prefetch = false;
+  bool count_insts = false;
+  bool stats = false;
+  bool perf_counters = false;
+  bool libc_stats = false;
+  bool zones = false;
+  const char *ngram_profile_path = NULL;
+  const char *sample_path = NULL;
+  const char *symbols_path = NULL;
+  u32 sample_hz = 1000;
+  const char *trace_calls_path = NULL;
+  u32 trace_capacity = 1 << 22;
+  const char *itrace_path = NULL;
+  u64 itrace_capacity = 1 << 22;
   const char *path = NULL;
+  const char *batch_path = NULL;
+  u32 n_threads = 1;
+  u32 n_io_threads = 4;
+  u64 quantum = 0;
 
   for (int i = 1; i < argc; ++i) {
     const char *arg = argv[i];
     if (strcmp(arg, "--dbg") == 0) {
       dbg = true;
+    } else if (strcmp(arg, "--async-output") == 0) {
+      async_output = true;
+    } else if (strcmp(arg, "--count-insts") == 0) {
+      count_insts = true;
+    } else if (strcmp(arg, "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(arg, "--perf-counters") == 0) {
+      perf_counters = true;
+    } else if (strcmp(arg, "--libc-stats") == 0) {
+      libc_stats = true;
+    } else if (strcmp(arg, "--zones") == 0) {
+      zones = true;
+    } else if (strcmp(arg, "--ngram-profile") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect a profile file after `--ngram-profile`\n");
+      }
+      ngram_profile_path = argv[i];
+    } else if (strcmp(arg, "--sample") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect an output file after `--sample`\n");
+      }
+      sample_path = argv[i];
+    } else if (strcmp(arg, "--sample-hz") == 0) {
+      if (++i == argc || atoi(argv[i]) <= 0) {
+        panic_printf("Expect a positive frequency after `--sample-hz`\n");
+      }
+      sample_hz = (u32)atoi(argv[i]);
+    } else if (strcmp(arg, "--symbols") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect a symbol map after `--symbols`\n");
+      }
+      symbols_path = argv[i];
+    } else if (strcmp(arg, "--trace-calls") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect an output file after `--trace-calls`\n");
+      }
+      trace_calls_path = argv[i];
+    } else if (strcmp(arg, "--trace-capacity") == 0) {
+      if (++i == argc || atoi(argv[i]) <= 0) {
+        panic_printf("Expect a positive number of events after `--trace-capacity`\n");
+      }
+      trace_capacity = (u32)atoi(argv[i]);
+    } else if (strcmp(arg, "--trace") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect a trace file after `--trace`\n");
+      }
+      itrace_path = argv[i];
+    } else if (strcmp(arg, "--trace-records") == 0) {
+      if (++i == argc || atoll(argv[i]) <= 0) {
+        panic_printf("Expect a positive number of records after `--trace-records`\n");
+      }
+      itrace_capacity = (u64)atoll(argv[i]);
+    } else if (strcmp(arg, "--prefetch") == 0) {
+      prefetch = true;
+    } else if (strcmp(arg, "--prefetch-file") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect a file after `--prefetch-file`\n");
+      }
+      if (!prefetch_declare(argv[i])) {
+        panic_printf("Path %s doesn't exist\n", argv[i]);
+      }
+      prefetch = true;
+    } else if (strcmp(arg, "--batch") == 0) {
+      if (++i == argc) {
+        panic_printf("Expect a jobs file after `--batch`\n");
+      }
+      batch_path = argv[i];
+    } else if (strcmp(arg, "-j") == 0) {
+      if (++i == argc || atoi(argv[i]) <= 0) {
+        panic_printf("Expect a positive number of threads after `-j`\n");
+      }
+      n_threads = (u32)atoi(argv[i]);
+    } else if (strcmp(arg, "--spmd") == 0) {
+      // All arguments after the program path are input files.
+      if (i + 1 == argc) {
+        panic_printf("Expect a program file after `--spmd`\n");
+      }
+      if (perf_counters) {
+        panic_printf("Cannot measure `--spmd` with `--perf-counters`\n");
+      }
+      return spmd_main(argv[i + 1], &argv[i + 2], (u32)(argc - i - 2));
+    } else if (strcmp(arg, "--pipeline") == 0) {
+      // All arguments after `--pipeline` are the program files of the stages.
+      if (i + 1 == argc) {
+        panic_printf("Expect program files after `--pipeline`\n");
+      }
+      if (perf_counters) {
+        panic_printf("Cannot measure `--pipeline` with `--perf-counters`\n");
+      }
+      return pipeline_main(&argv[i + 1], (u32)(argc - i - 1), async_output);
+    } else if (strcmp(arg, "--quantum") == 0) {
+      if (++i == argc || atoll(argv[i]) <= 0) {
+        panic_printf("Expect a positive number of instructions after `--quantum`\n");
+      }
+      quantum = (u64)atoll(argv[i]);
+    } else if (strcmp(arg, "--io-threads") == 0) {
+      if (++i == argc || atoi(argv[i]) <= 0) {
+        panic_printf("Expect a positive number of threads after `--io-threads`\n");
+      }
+      n_io_threads = (u32)atoi(argv[i]);
     } else {
       if (path != NULL) {
         panic_printf("Cannot have more than input files\n");
@@ -128,11 +275,29 @@ i32 main(int argc, char **argv) {
     }
   }
 
+  // Each profiling mode runs the machine in its own interpreter.
+  if ((sample_path != NULL) + (trace_calls_path != NULL) + (itrace_path != NULL) + (ngram_profile_path != NULL) +
+          stats >
+      1) {
+    panic_printf("Cannot combine `--sample`, `--trace-calls`, `--trace`, `--ngram-profile` and `--stats`\n");
+  }
+
+  if (batch_path != NULL) {
+    if (path != NULL) {
+      panic_printf("Cannot have an input file in batch mode\n");
+    }
+    if (perf_counters) {
+      panic_printf("Cannot measure `--batch` with `--perf-counters`\n");
+    }
+    return batch_main(batch_path, n_threads, n_io_threads, quantum);
+  }
+
   if (path == NULL) {
     panic_printf("Expect an input file\n");
   }
 
   Machine machine = machine_new(!dbg, breakpoint_callback, NULL);
+  machine.native_registry = native_math_registry();
   FILE *file = fopen(path, "rb");
   if (file == NULL) {
     panic_printf("Path %s doesn't exist\n", path);
@@ -149,9 +314,91 @@ i32 main(int argc, char **argv) {
   if (dbg)
     dbg_printf("Program loaded\n");
 
-  while (machine_next(&machine))
-    ;
+  AsyncWriter *writer = NULL;
+  if (async_output) {
+    writer = async_writer_new();
+    machine.io_stdout = async_writer_open(writer, stdout);
+  }
+
+  if (prefetch) {
+    machine.io_stdin = prefetch_open(stdin);
+    machine.fopen_callback = prefetch_fopen_callback;
+  }
+
+  Symbols symbols = {0};
+  if (symbols_path != NULL)
+    symbols = symbols_load(symbols_path);
+  FILE *sample_file = sample_path == NULL ? NULL : create_output(sample_path);
+  FILE *trace_file = trace_calls_path == NULL ? NULL : create_output(trace_calls_path);
+
+  if (libc_stats)
+    machine.libc_stats = libc_stats_new();
+  if (zones)
+    machine.zones = zone_profile_new();
+
+  // Started after the program is loaded and the streams are opened, so that only the run is counted.
+  HwCounters counters;
+  if (perf_counters)
+    hw_counters_start(&counters);
+  u64 run_start_ns = monotonic_ns();
+
+  if (sample_file != NULL)
+    sampler_run(&machine, sample_hz, &symbols, sample_file);
+  else if (trace_file != NULL)
+    tracer_run(&machine, trace_capacity, &symbols, trace_file, stderr);
+  else if (itrace_path != NULL)
+    itrace_run(&machine, itrace_path, itrace_capacity);
+  else if (ngram_profile_path != NULL)
+    ngram_run(&machine, ngram_profile_path, stderr);
+  else if (stats)
+    stats_run(&machine, stderr);
+  else if (count_insts)
+    machine_run_counted(&machine);
+  else
+    machine_run(&machine);
+
+  u64 run_ns = monotonic_ns() - run_start_ns;
+  if (perf_counters)
+    hw_counters_stop(&counters);
+
+  if (prefetch) {
+    fclose(machine.io_stdin);
+    machine.io_stdin = stdin;
+  }
+  if (writer != NULL) {
+    fclose(machine.io_stdout);
+    machine.io_stdout = stdout;
+    async_writer_free(writer);
+  }
+
+  if (sample_file != NULL)
+    fclose(sample_file);
+  if (trace_file != NULL)
+    fclose(trace_file);
+  symbols_free(&symbols);
+
+  // The interpreter only warns when not silent.
+  if (machine.read_uncounted_instret && machine.config_silent)
+    fprintf(stderr, "`perf instret` read 0, as instructions are only counted with `--count-insts` or `--stats`\n");
+  machine_dump_perf_marks(&machine, stderr);
+  if (machine.zones != NULL) {
+    machine_dump_zones(&machine, stderr);
+    zone_profile_free(machine.zones);
+    machine.zones = NULL;
+  }
+  if (perf_counters)
+    hw_counters_report(&counters, machine.n_insts, stderr);
+  if (machine.libc_stats != NULL) {
+    libc_stats_report(machine.libc_stats, run_ns, stderr);
+    libc_stats_free(machine.libc_stats);
+    machine.libc_stats = NULL;
+  }
+
+  if (machine.exit_code == MACHINE_EXIT_FAULT)
+    fprintf(stderr, "Machine stopped on a fault\n");
 
   if (dbg)
     breakpoint_callback(&machine);
+
+  return machine.exit_code;
 }
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "common.h"
+
+/// Maximum number of arguments of a native function, passed in `r0` to `r5`.
+#define NATIVE_MAX_ARGS 6
+
+/// Integer and pointer arguments are passed to native functions as `u64`, relying on an ABI where narrower integers
+/// and pointers are passed and returned in the same 64-bit registers.
+#if (defined(__x86_64__) && !defined(_WIN32)) || defined(__aarch64__)
+#define NATIVE_CALL_SUPPORTED
+#endif
+
+typedef struct NativeFunction NativeFunction;
+
+/// Call the native function with arguments `args[0..n_args]`, returns the new value of `r0`.
+typedef u64 (*native_trampoline_t)(const NativeFunction *function, const u64 *args);
+
+struct NativeFunction {
+  void *fn;
+  native_trampoline_t trampoline;
+  u8 n_args;
+  /// Bit `i` is set if argument `i` is a `f64`.
+  u8 float_args_mask;
+};
+
+/// Table of native functions callable by `native_call`, indexed by function ID.
+/// A registry can be shared by many machines (see `Machine::native_registry`).
+typedef struct NativeRegistry {
+  NativeFunction *functions;
+  u32 len;
+} NativeRegistry;
+
+// There is a trampoline for every shape of signature, each calling the function through its exact type.
+// A shape is a return kind followed by up to `NATIVE_MAX_ARGS` argument kinds, where a kind is `I` (integer or
+// pointer), `F` (`f64`) or `V` (`void`, return only).
+
+/// Bit casts between registers and `f64`s, through `memcpy` as `transmute` in the trampolines trips GCC's
+/// `-Wuninitialized`.
+static inline f64 native_reg_to_f64(u64 value) {
+  f64 result;
+  memcpy(&result, &value, sizeof(f64));
+  return result;
+}
+
+static inline u64 native_f64_to_reg(f64 value) {
+  u64 result;
+  memcpy(&result, &value, sizeof(u64));
+  return result;
+}
+
+#define NATIVE_TYPE_I u64
+#define NATIVE_TYPE_F f64
+#define NATIVE_TYPE_V void
+
+#define NATIVE_ARG_I(I) args[I]
+#define NATIVE_ARG_F(I) native_reg_to_f64(args[I])
+
+#define NATIVE_RETURN_I(CALL) return CALL
+#define NATIVE_RETURN_F(CALL) return native_f64_to_reg(CALL)
+#define NATIVE_RETURN_V(CALL)                                                                                          \
+  CALL;                                                                                                                \
+  return args[0]
+
+#define NATIVE_BIT_I 0
+#define NATIVE_BIT_F 1
+
+#define NATIVE_RET_INDEX_I 0
+#define NATIVE_RET_INDEX_F 1
+#define NATIVE_RET_INDEX_V 2
+
+#define NATIVE_PARAMS_0() void
+#define NATIVE_PARAMS_1(A) NATIVE_TYPE_##A
+#define NATIVE_PARAMS_2(A, B) NATIVE_TYPE_##A, NATIVE_TYPE_##B
+#define NATIVE_PARAMS_3(A, B, C) NATIVE_TYPE_##A, NATIVE_TYPE_##B, NATIVE_TYPE_##C
+#define NATIVE_PARAMS_4(A, B, C, D) NATIVE_TYPE_##A, NATIVE_TYPE_##B, NATIVE_TYPE_##C, NATIVE_TYPE_##D
+#define NATIVE_PARAMS_5(A, B, C, D, E)                                                                                 \
+  NATIVE_TYPE_##A, NATIVE_TYPE_##B, NATIVE_TYPE_##C, NATIVE_TYPE_##D, NATIVE_TYPE_##E
+#define NATIVE_PARAMS_6(A, B, C, D, E, F)                                                                              \
+  NATIVE_TYPE_##A, NATIVE_TYPE_##B, NATIVE_TYPE_##C, NATIVE_TYPE_##D, NATIVE_TYPE_##E, NATIVE_TYPE_##F
+
+#define NATIVE_ARGS_0()
+#define NATIVE_ARGS_1(A) NATIVE_ARG_##A(0)
+#define NATIVE_ARGS_2(A, B) NATIVE_ARG_##A(0), NATIVE_ARG_##B(1)
+#define NATIVE_ARGS_3(A, B, C) NATIVE_ARG_##A(0), NATIVE_ARG_##B(1), NATIVE_ARG_##C(2)
+#define NATIVE_ARGS_4(A, B, C, D) NATIVE_ARG_##A(0), NATIVE_ARG_##B(1), NATIVE_ARG_##C(2), NATIVE_ARG_##D(3)
+#define NATIVE_ARGS_5(A, B, C, D, E)                                                                                   \
+  NATIVE_ARG_##A(0), NATIVE_ARG_##B(1), NATIVE_ARG_##C(2), NATIVE_ARG_##D(3), NATIVE_ARG_##E(4)
+#define NATIVE_ARGS_6(A, B, C, D, E, F)                                                                                \
+  NATIVE_ARG_##A(0), NATIVE_ARG_##B(1), NATIVE_ARG_##C(2), NATIVE_ARG_##D(3), NATIVE_ARG_##E(4), NATIVE_ARG_##F(5)
+
+#define NATIVE_MASK_0() 0
+#define NATIVE_MASK_1(A) (NATIVE_BIT_##A)
+#define NATIVE_MASK_2(A, B) (NATIVE_BIT_##A | NATIVE_BIT_##B << 1)
+#define NATIVE_MASK_3(A, B, C) (NATIVE_BIT_##A | NATIVE_BIT_##B << 1 | NATIVE_BIT_##C << 2)
+#define NATIVE_MASK_4(A, B, C, D) (NATIVE_BIT_##A | NATIVE_BIT_##B << 1 | NATIVE_BIT_##C << 2 | NATIVE_BIT_##D << 3)
+#define NATIVE_MASK_5(A, B, C, D, E)                                                                                   \
+  (NATIVE_BIT_##A | NATIVE_BIT_##B << 1 | NATIVE_BIT_##C << 2 | NATIVE_BIT_##D << 3 | NATIVE_BIT_##E << 4)
+#define NATIVE_MASK_6(A, B, C, D, E, F)                                                                                \
+  (NATIVE_BIT_##A | NATIVE_BIT_##B << 1 | NATIVE_BIT_##C << 2 | NATIVE_BIT_##D << 3 | NATIVE_BIT_##E << 4 |            \
+   NATIVE_BIT_##F << 5)
+
+#define NATIVE_NAME_0(R, NONE) native_trampoline_##R##_
+#define NATIVE_NAME_1(R, A) native_trampoline_##R##_##A
+#define NATIVE_NAME_2(R, A, B) native_trampoline_##R##_##A##B
+#define NATIVE_NAME_3(R, A, B, C) native_trampoline_##R##_##A##B##C
+#define NATIVE_NAME_4(R, A, B, C, D) native_trampoline_##R##_##A##B##C##D
+#define NATIVE_NAME_5(R, A, B, C, D, E) native_trampoline_##R##_##A##B##C##D##E
+#define NATIVE_NAME_6(R, A, B, C, D, E, F) native_trampoline_##R##_##A##B##C##D##E##F
+
+/// Calls `X(R, N, KINDS...)` for every shape of `N` arguments returning `R`, `KINDS` is empty if `N` is `0`.
+#define NATIVE_SHAPES_0(X, R) X(R, 0, )
+#define NATIVE_SHAPES_1(X, R) X(R, 1, I) X(R, 1, F)
+#define NATIVE_SHAPES_2(X, R) NATIVE_KINDS_1(X, R, 2, I) NATIVE_KINDS_1(X, R, 2, F)
+#define NATIVE_SHAPES_3(X, R) NATIVE_KINDS_2(X, R, 3, I) NATIVE_KINDS_2(X, R, 3, F)
+#define NATIVE_SHAPES_4(X, R) NATIVE_KINDS_3(X, R, 4, I) NATIVE_KINDS_3(X, R, 4, F)
+#define NATIVE_SHAPES_5(X, R) NATIVE_KINDS_4(X, R, 5, I) NATIVE_KINDS_4(X, R, 5, F)
+#define NATIVE_SHAPES_6(X, R) NATIVE_KINDS_5(X, R, 6, I) NATIVE_KINDS_5(X, R, 6, F)
+
+/// Appends the remaining `K` argument kinds to `KINDS`, one macro per level as macros can't expand recursively.
+#define NATIVE_KINDS_1(X, R, N, ...) X(R, N, __VA_ARGS__, I) X(R, N, __VA_ARGS__, F)
+#define NATIVE_KINDS_2(X, R, N, ...) NATIVE_KINDS_1(X, R, N, __VA_ARGS__, I) NATIVE_KINDS_1(X, R, N, __VA_ARGS__, F)
+#define NATIVE_KINDS_3(X, R, N, ...) NATIVE_KINDS_2(X, R, N, __VA_ARGS__, I) NATIVE_KINDS_2(X, R, N, __VA_ARGS__, F)
+#define NATIVE_KINDS_4(X, R, N, ...) NATIVE_KINDS_3(X, R, N, __VA_ARGS__, I) NATIVE_KINDS_3(X, R, N, __VA_ARGS__, F)
+#define NATIVE_KINDS_5(X, R, N, ...) NATIVE_KINDS_4(X, R, N, __VA_ARGS__, I) NATIVE_KINDS_4(X, R, N, __VA_ARGS__, F)
+
+#define NATIVE_SHAPES_OF_RET(X, R)                                                                                     \
+  NATIVE_SHAPES_0(X, R)                                                                                                \
+  NATIVE_SHAPES_1(X, R)                                                                                                \
+  NATIVE_SHAPES_2(X, R)                                                                                                \
+  NATIVE_SHAPES_3(X, R)                                                                                                \
+  NATIVE_SHAPES_4(X, R)                                                                                                \
+  NATIVE_SHAPES_5(X, R)                                                                                                \
+  NATIVE_SHAPES_6(X, R)
+
+#define NATIVE_SHAPES(X) NATIVE_SHAPES_OF_RET(X, I) NATIVE_SHAPES_OF_RET(X, F) NATIVE_SHAPES_OF_RET(X, V)
+
+/// Index of the shape of `n_args` arguments in the trampoline table, shapes of fewer arguments come first.
+#define NATIVE_SHAPE_INDEX(N_ARGS, FLOAT_ARGS_MASK) ((1 << (N_ARGS)) - 1 + (FLOAT_ARGS_MASK))
+#define NATIVE_N_SHAPES NATIVE_SHAPE_INDEX(NATIVE_MAX_ARGS + 1, 0)
+
+#define NATIVE_DEFINE_TRAMPOLINE(R, N, ...)                                                                            \
+  static inline u64 NATIVE_NAME_##N(R, __VA_ARGS__)(const NativeFunction *function, const u64 *args) {                 \
+    (void)args;                                                                                                        \
+    typedef NATIVE_TYPE_##R (*fn_t)(NATIVE_PARAMS_##N(__VA_ARGS__));                                                   \
+    NATIVE_RETURN_##R(((fn_t)function->fn)(NATIVE_ARGS_##N(__VA_ARGS__)));                                             \
+  }
+
+NATIVE_SHAPES(NATIVE_DEFINE_TRAMPOLINE)
+
+#define NATIVE_TRAMPOLINE_ENTRY(R, N, ...)                                                                             \
+  [NATIVE_RET_INDEX_##R][NATIVE_SHAPE_INDEX(N, NATIVE_MASK_##N(__VA_ARGS__))] = NATIVE_NAME_##N(R, __VA_ARGS__),
+
+/// Trampoline of the function returning `ret` (one of `i`, `p`, `f` or `v`), with `n_args` arguments of which those
+/// in `float_args_mask` are `f64`. Returns `NULL` if `ret` is invalid.
+static inline native_trampoline_t native_trampoline(char ret, u8 n_args, u8 float_args_mask) {
+  static const native_trampoline_t trampolines[3][NATIVE_N_SHAPES] = {NATIVE_SHAPES(NATIVE_TRAMPOLINE_ENTRY)};
+  switch (ret) {
+  case 'i':
+  case 'p':
+    return trampolines[NATIVE_RET_INDEX_I][NATIVE_SHAPE_INDEX(n_args, float_args_mask)];
+  case 'f':
+    return trampolines[NATIVE_RET_INDEX_F][NATIVE_SHAPE_INDEX(n_args, float_args_mask)];
+  case 'v':
+    return trampolines[NATIVE_RET_INDEX_V][NATIVE_SHAPE_INDEX(n_args, float_args_mask)];
+  default:
+    return NULL;
+  }
+}
+
+/// Register a native function under `id`, replacing the function previously registered under the same ID.
+///
+/// `signature` describes the arguments and the return type in the form of `ARGS:RET`, e.g. `"ipf:f"` for
+/// `f64 fn(i64, void *, f64)`, where:
+/// - `i` is an integer of up to 64 bits
+/// - `p` is a pointer (in real memory)
+/// - `f` is a `f64`
+/// - `v` is `void` (return type only)
+///
+/// Integer arguments narrower than 64 bits receive the lower bits of the register, integer return values narrower
+/// than 64 bits leave the upper bits of `r0` unspecified.
+static inline void native_registry_add(NativeRegistry *registry, u32 id, void *fn, const char *signature) {
+#ifndef NATIVE_CALL_SUPPORTED
+  panic_printf("Native calls are not supported on this host platform\n");
+#endif
+  NativeFunction function = {.fn = fn};
+  const char *c = signature;
+  for (; *c != ':'; ++c) {
+    if (*c == '\0') {
+      panic_printf("Invalid native function signature `%s`\n", signature);
+    }
+    if (function.n_args == NATIVE_MAX_ARGS) {
+      panic_printf("Native function signature `%s` has more than %d arguments\n", signature, NATIVE_MAX_ARGS);
+    }
+    switch (*c) {
+    case 'i':
+    case 'p':
+      break;
+    case 'f':
+      function.float_args_mask |= 1 << function.n_args;
+      break;
+    default:
+      panic_printf("Invalid native function signature `%s`\n", signature);
+    }
+    ++function.n_args;
+  }
+  if (c[1] == '\0' || c[2] != '\0') {
+    panic_printf("Invalid native function signature `%s`\n", signature);
+  }
+  function.trampoline = native_trampoline(c[1], function.n_args, function.float_args_mask);
+  if (function.trampoline == NULL) {
+    panic_printf("Invalid native function signature `%s`\n", signature);
+  }
+  if (id >= registry->len) {
+    registry->functions = xrealloc(registry->functions, NativeFunction, id + 1);
+    memset(&registry->functions[registry->len], 0, sizeof(NativeFunction) * (id + 1 - registry->len));
+    registry->len = id + 1;
+  }
+  registry->functions[id] = function;
+}
+
+/// Returns `NULL` if there is no function registered under `id`.
+static inline const NativeFunction *native_registry_get(const NativeRegistry *registry, u64 id) {
+  if (registry == NULL || id >= registry->len || registry->functions[id].fn == NULL)
+    return NULL;
+  return &registry->functions[id];
+}
+
+static inline void native_registry_free(NativeRegistry *registry) {
+  xfree(registry->functions);
+  registry->functions = NULL;
+  registry->len = 0;
+}
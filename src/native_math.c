@@ -0,0 +1,30 @@
+#include "native_math.h"
+
+#include <math.h>
+#include <pthread.h>
+
+static NativeRegistry registry;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static void native_math_registry_init(void) {
+  native_registry_add(&registry, NATIVE_MATH_sqrt, sqrt, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_cbrt, cbrt, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_exp, exp, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_log, log, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_pow, pow, "ff:f");
+  native_registry_add(&registry, NATIVE_MATH_sin, sin, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_cos, cos, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_atan2, atan2, "ff:f");
+  native_registry_add(&registry, NATIVE_MATH_floor, floor, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_ceil, ceil, "f:f");
+  native_registry_add(&registry, NATIVE_MATH_fmod, fmod, "ff:f");
+  native_registry_add(&registry, NATIVE_MATH_hypot, hypot, "ff:f");
+  native_registry_add(&registry, NATIVE_MATH_fma, fma, "fff:f");
+  native_registry_add(&registry, NATIVE_MATH_ldexp, ldexp, "fi:f");
+  native_registry_add(&registry, NATIVE_MATH_llround, llround, "f:i");
+}
+
+const NativeRegistry *native_math_registry(void) {
+  pthread_once(&registry_once, native_math_registry_init);
+  return &registry;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "native.h"
+
+/// IDs of the `libm` functions registered as native functions, with `f64` arguments and return values unless noted
+/// (see manual.md).
+#define NATIVE_MATH_sqrt    0
+#define NATIVE_MATH_cbrt    1
+#define NATIVE_MATH_exp     2
+#define NATIVE_MATH_log     3
+#define NATIVE_MATH_pow     4
+#define NATIVE_MATH_sin     5
+#define NATIVE_MATH_cos     6
+#define NATIVE_MATH_atan2   7
+#define NATIVE_MATH_floor   8
+#define NATIVE_MATH_ceil    9
+#define NATIVE_MATH_fmod    10
+#define NATIVE_MATH_hypot   11
+#define NATIVE_MATH_fma     12
+/// `f64 ldexp(f64, int)`
+#define NATIVE_MATH_ldexp   13
+/// `long long llround(f64)`
+#define NATIVE_MATH_llround 14
+
+/// Registry of the `libm` functions above, built on the first call and shared by all machines.
+const NativeRegistry *native_math_registry(void);
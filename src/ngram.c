@@ -0,0 +1,342 @@
+#include "common.h"
+#include "values.h"
+
+/// Operand patterns between adjacent instructions (or within one instruction).
+typedef enum Pattern {
+  /// `load_imm` into a register, which is then used as the address of a load or store.
+  PATTERN_LOAD_IMM_ADDR,
+  /// `load_imm` into a register, which is then used as an operand of an arithmetic instruction.
+  PATTERN_LOAD_IMM_OPERAND,
+  /// An arithmetic instruction, whose destination is an operand of the next arithmetic instruction.
+  PATTERN_ALU_CHAIN,
+  /// `cmp` or `fcmp` followed by `b`.
+  PATTERN_CMP_B,
+  /// An arithmetic instruction whose destination is the same register as its first operand.
+  PATTERN_DEST_IS_SRC,
+  PATTERN_COUNT,
+} Pattern;
+
+typedef struct PatternInfo {
+  /// Name in the profile.
+  const char *name;
+  const char *description;
+  /// Whether the pattern spans two instructions, so that fusing them saves a dispatch.
+  bool fusable;
+} PatternInfo;
+
+static const PatternInfo PATTERN_INFOS[PATTERN_COUNT] = {
+    [PATTERN_LOAD_IMM_ADDR] = {"load_imm_addr", "load_imm used as address", true},
+    [PATTERN_LOAD_IMM_OPERAND] = {"load_imm_operand", "load_imm used as arithmetic operand", true},
+    [PATTERN_ALU_CHAIN] = {"alu_chain", "arithmetic result used by next arithmetic", true},
+    [PATTERN_CMP_B] = {"cmp_b", "compare followed by branch", true},
+    [PATTERN_DEST_IS_SRC] = {"dest_is_src", "arithmetic with dest == first operand", false},
+};
+
+/// Open-addressing hash map from trigrams to counts.
+/// The keys are the first bytes of the three instructions (`inst0 << 16 | inst1 << 8 | inst2`) plus one, so that zero
+/// marks an empty slot.
+typedef struct Trigrams {
+  u32 *keys;
+  u64 *counts;
+  u32 len;
+  /// Power of two.
+  u32 cap;
+} Trigrams;
+
+typedef struct Profile {
+  u64 runs;
+  u64 n_insts;
+  /// Indexed by `inst0 << 8 | inst1` of the first bytes of two adjacent instructions.
+  u64 bigrams[256 * 256];
+  Trigrams trigrams;
+  u64 patterns[PATTERN_COUNT];
+  /// The previous instruction.
+  u8 prev[4];
+  /// First byte of the instruction before the previous instruction.
+  u8 prev_prev0;
+  /// Number of the instructions in `prev` and `prev_prev0`, up to 2.
+  u8 history_len;
+} Profile;
+
+/// Profile of the machine running on this thread.
+static _Thread_local Profile *profile;
+
+static void ngram_record(const u8 inst[4]);
+
+#define MACHINE_HOOK_INST(MACHINE, INST) ngram_record(INST)
+
+#include "disasm.h"
+#include "ngram.h"
+#include "report.h"
+
+#define PROFILE_MAGIC "lbvm-ngram-profile"
+#define PROFILE_VERSION 1
+
+static u32 trigram_hash(u32 key) {
+  return key * 0x9E3779B1u;
+}
+
+static void trigrams_add(Trigrams *trigrams, u32 trigram, u64 count);
+
+static void trigrams_grow(Trigrams *trigrams) {
+  Trigrams old = *trigrams;
+  trigrams->cap = old.cap == 0 ? 1024 : old.cap * 2;
+  trigrams->len = 0;
+  trigrams->keys = xalloc(u32, trigrams->cap);
+  trigrams->counts = xalloc(u64, trigrams->cap);
+  memset(trigrams->keys, 0, sizeof(u32) * trigrams->cap);
+  for (u32 i = 0; i < old.cap; ++i) {
+    if (old.keys[i] != 0)
+      trigrams_add(trigrams, old.keys[i] - 1, old.counts[i]);
+  }
+  xfree(old.keys);
+  xfree(old.counts);
+}
+
+static void trigrams_add(Trigrams *trigrams, u32 trigram, u64 count) {
+  if (trigrams->len * 2 >= trigrams->cap)
+    trigrams_grow(trigrams);
+  u32 key = trigram + 1;
+  u32 mask = trigrams->cap - 1;
+  for (u32 i = trigram_hash(key) & mask;; i = (i + 1) & mask) {
+    if (trigrams->keys[i] == key) {
+      trigrams->counts[i] += count;
+      return;
+    }
+    if (trigrams->keys[i] == 0) {
+      trigrams->keys[i] = key;
+      trigrams->counts[i] = count;
+      ++trigrams->len;
+      return;
+    }
+  }
+}
+
+static void trigrams_free(Trigrams *trigrams) {
+  xfree(trigrams->keys);
+  xfree(trigrams->counts);
+  *trigrams = (Trigrams){0};
+}
+
+/// Whether the instruction is an arithmetic instruction of the form `[dest][lhs][rhs]`.
+static bool is_alu3(const u8 *inst) {
+  u8 opcode = inst[0] & 0b11111100;
+  return (opcode >= OPCODE_ADD && opcode <= OPCODE_FMOD) || (opcode >= OPCODE_SHL && opcode <= OPCODE_XOR);
+}
+
+/// Register used as the address by the load or store, -1 if the instruction isn't a load or store through a register.
+static i32 address_reg(const u8 *inst) {
+  switch (inst[0] & 0b11111100) {
+  case OPCODE_LOAD_DIR:
+  case OPCODE_LOAD_IND:
+  case OPCODE_STORE_DIR:
+  case OPCODE_STORE_IND:
+  case OPCODE_LOAD_IDX:
+  case OPCODE_STORE_IDX:
+    return GET_OPERAND1(inst);
+  default:
+    return -1;
+  }
+}
+
+static void record_patterns(Profile *profile, const u8 *prev, const u8 *inst) {
+  u8 prev_opcode = prev[0] & 0b11111100;
+  u8 opcode = inst[0] & 0b11111100;
+  if (is_alu3(inst) && GET_OPERAND0(inst) == GET_OPERAND1(inst))
+    ++profile->patterns[PATTERN_DEST_IS_SRC];
+  if (prev_opcode == OPCODE_LOAD_IMM) {
+    u8 reg = GET_OPERAND0(prev);
+    if (address_reg(inst) == reg)
+      ++profile->patterns[PATTERN_LOAD_IMM_ADDR];
+    else if (is_alu3(inst) && (GET_OPERAND1(inst) == reg || GET_OPERAND2(inst) == reg))
+      ++profile->patterns[PATTERN_LOAD_IMM_OPERAND];
+  } else if (is_alu3(prev) && is_alu3(inst)) {
+    u8 reg = GET_OPERAND0(prev);
+    if (GET_OPERAND1(inst) == reg || GET_OPERAND2(inst) == reg)
+      ++profile->patterns[PATTERN_ALU_CHAIN];
+  } else if ((prev_opcode == OPCODE_CMP || prev_opcode == OPCODE_FCMP) && opcode == OPCODE_B) {
+    ++profile->patterns[PATTERN_CMP_B];
+  }
+}
+
+static void ngram_record(const u8 inst[4]) {
+  Profile *p = profile;
+  ++p->n_insts;
+  if (p->history_len >= 1) {
+    ++p->bigrams[p->prev[0] << 8 | inst[0]];
+    record_patterns(p, p->prev, inst);
+  }
+  if (p->history_len >= 2)
+    trigrams_add(&p->trigrams, (u32)p->prev_prev0 << 16 | (u32)p->prev[0] << 8 | inst[0], 1);
+  else
+    ++p->history_len;
+  p->prev_prev0 = p->prev[0];
+  memcpy(p->prev, inst, 4);
+}
+
+/// Merge the profile at `path` into `profile`, does nothing if the file doesn't exist.
+static void load_profile(Profile *profile, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return;
+  char word[32];
+  u32 version;
+  if (fscanf(file, "%31s %u", word, &version) != 2 || strcmp(word, PROFILE_MAGIC) != 0)
+    panic_printf("%s is not an n-gram profile\n", path);
+  if (version != PROFILE_VERSION)
+    panic_printf("Unsupported n-gram profile version %u in %s\n", version, path);
+  while (fscanf(file, "%31s", word) == 1) {
+    u32 a, b, c;
+    u64 count;
+    bool ok;
+    if (strcmp(word, "runs") == 0) {
+      ok = fscanf(file, "%llu", &count) == 1;
+      profile->runs += count;
+    } else if (strcmp(word, "insts") == 0) {
+      ok = fscanf(file, "%llu", &count) == 1;
+      profile->n_insts += count;
+    } else if (strcmp(word, "bigram") == 0) {
+      ok = fscanf(file, "%x %x %llu", &a, &b, &count) == 3 && a < 256 && b < 256;
+      if (ok)
+        profile->bigrams[a << 8 | b] += count;
+    } else if (strcmp(word, "trigram") == 0) {
+      ok = fscanf(file, "%x %x %x %llu", &a, &b, &c, &count) == 4 && a < 256 && b < 256 && c < 256;
+      if (ok)
+        trigrams_add(&profile->trigrams, a << 16 | b << 8 | c, count);
+    } else if (strcmp(word, "pattern") == 0) {
+      ok = fscanf(file, "%31s %llu", word, &count) == 2;
+      // Patterns unknown to this version are dropped.
+      for (u32 i = 0; ok && i < PATTERN_COUNT; ++i) {
+        if (strcmp(word, PATTERN_INFOS[i].name) == 0)
+          profile->patterns[i] += count;
+      }
+    } else {
+      ok = false;
+    }
+    if (!ok)
+      panic_printf("Malformed n-gram profile %s\n", path);
+  }
+  fclose(file);
+}
+
+/// Write the profile to a temporary file and rename it to `path`, so that an interrupted write doesn't leave a
+/// truncated profile.
+static void save_profile(const Profile *profile, const char *path) {
+  usize tmp_path_len = strlen(path) + 5;
+  char *tmp_path = xalloc(char, tmp_path_len);
+  snprintf(tmp_path, tmp_path_len, "%s.tmp", path);
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL)
+    panic_printf("Cannot write n-gram profile to %s\n", tmp_path);
+  fprintf(file, "%s %u\n", PROFILE_MAGIC, PROFILE_VERSION);
+  fprintf(file, "runs %llu\n", profile->runs);
+  fprintf(file, "insts %llu\n", profile->n_insts);
+  for (u32 i = 0; i < PATTERN_COUNT; ++i)
+    fprintf(file, "pattern %s %llu\n", PATTERN_INFOS[i].name, profile->patterns[i]);
+  for (u32 i = 0; i < 256 * 256; ++i) {
+    if (profile->bigrams[i] != 0)
+      fprintf(file, "bigram %02X %02X %llu\n", i >> 8, i & 0xFF, profile->bigrams[i]);
+  }
+  const Trigrams *trigrams = &profile->trigrams;
+  for (u32 i = 0; i < trigrams->cap; ++i) {
+    u32 key = trigrams->keys[i];
+    if (key-- != 0)
+      fprintf(file, "trigram %02X %02X %02X %llu\n", key >> 16, (key >> 8) & 0xFF, key & 0xFF, trigrams->counts[i]);
+  }
+  if (fclose(file) != 0 || rename(tmp_path, path) != 0)
+    panic_printf("Cannot write n-gram profile to %s\n", path);
+  xfree(tmp_path);
+}
+
+typedef struct Candidate {
+  char label[96];
+  u64 count;
+  /// Estimated number of dispatches saved if the candidate is fused into one instruction.
+  u64 saved;
+} Candidate;
+
+static int compare_candidates(const void *lhs, const void *rhs) {
+  u64 a = ((const Candidate *)lhs)->saved;
+  u64 b = ((const Candidate *)rhs)->saved;
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+/// Label of the sequence of instructions with the first bytes `insts[0..len]` (e.g. `"cmp q; b"`).
+static void sequence_label(const u8 *insts, u32 len, char *buf, usize buf_len) {
+  usize n = 0;
+  for (u32 i = 0; i < len && n < buf_len; ++i) {
+    if (i != 0)
+      n += snprintf(buf + n, buf_len - n, "; ");
+    if (n < buf_len)
+      disasm_label(insts[i], buf + n, buf_len - n);
+    n += strlen(buf + n);
+  }
+}
+
+/// Maximum number of candidates in the report.
+#define REPORT_CANDIDATES 40
+
+static void print_report(const Profile *profile, FILE *report) {
+  fprintf(report, "=== n-gram profile of %llu run(s), %llu instructions executed\n", profile->runs, profile->n_insts);
+
+  u32 cap = 256 * 256 + profile->trigrams.len + PATTERN_COUNT;
+  Candidate *candidates = xalloc(Candidate, cap);
+  u32 len = 0;
+  for (u32 i = 0; i < 256 * 256; ++i) {
+    if (profile->bigrams[i] == 0)
+      continue;
+    Candidate *candidate = &candidates[len++];
+    sequence_label((u8[]){i >> 8, i & 0xFF}, 2, candidate->label, sizeof(candidate->label));
+    candidate->count = profile->bigrams[i];
+    candidate->saved = candidate->count;
+  }
+  for (u32 i = 0; i < profile->trigrams.cap; ++i) {
+    u32 key = profile->trigrams.keys[i];
+    if (key-- == 0)
+      continue;
+    Candidate *candidate = &candidates[len++];
+    sequence_label((u8[]){key >> 16, (key >> 8) & 0xFF, key & 0xFF}, 3, candidate->label, sizeof(candidate->label));
+    candidate->count = profile->trigrams.counts[i];
+    candidate->saved = candidate->count * 2;
+  }
+  for (u32 i = 0; i < PATTERN_COUNT; ++i) {
+    if (!PATTERN_INFOS[i].fusable || profile->patterns[i] == 0)
+      continue;
+    Candidate *candidate = &candidates[len++];
+    snprintf(candidate->label, sizeof(candidate->label), "[%s]", PATTERN_INFOS[i].description);
+    candidate->count = profile->patterns[i];
+    candidate->saved = candidate->count;
+  }
+  qsort(candidates, len, sizeof(Candidate), compare_candidates);
+
+  // Overlapping candidates share the same dispatches, so the savings are not additive.
+  fprintf(report, "\n--- superinstruction candidates (savings overlap)\n");
+  fprintf(report, "%-48s %14s %14s %8s\n", "sequence", "count", "saved", "share");
+  for (u32 i = 0; i < len && i < REPORT_CANDIDATES; ++i) {
+    const Candidate *candidate = &candidates[i];
+    fprintf(report, "%-48s %14llu %14llu %7.2f%%\n", candidate->label, candidate->count, candidate->saved,
+            report_percentage(candidate->saved, profile->n_insts));
+  }
+  xfree(candidates);
+
+  fprintf(report, "\n--- operand patterns\n");
+  fprintf(report, "%-48s %14s %8s\n", "pattern", "count", "share");
+  for (u32 i = 0; i < PATTERN_COUNT; ++i) {
+    u64 count = profile->patterns[i];
+    fprintf(report, "%-48s %14llu %7.2f%%\n", PATTERN_INFOS[i].description, count,
+            report_percentage(count, profile->n_insts));
+  }
+}
+
+void ngram_run(Machine *machine, const char *profile_path, FILE *report) {
+  profile = xalloc(Profile, 1);
+  memset(profile, 0, sizeof(Profile));
+  load_profile(profile, profile_path);
+  ++profile->runs;
+  machine_run(machine);
+  save_profile(profile, profile_path);
+  print_report(profile, report);
+  trigrams_free(&profile->trigrams);
+  xfree(profile);
+  profile = NULL;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "machine.h"
+
+/// Run the machine with a separately compiled variant of the interpreter, which counts the dynamic bigrams and trigrams
+/// of instructions (by opcode and oplen) and a few operand patterns between adjacent instructions.
+/// The counts are merged into the profile at `profile_path` (created if it doesn't exist), so that a profile can be
+/// aggregated across many runs, then a report of the merged profile is printed to `report`, ranking the candidates
+/// for superinstructions by the number of dispatches that fusing them would save.
+void ngram_run(Machine *machine, const char *profile_path, FILE *report);
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "common.h"
+
+#include <time.h>
+
+/// Nanoseconds on the host's monotonic clock.
+static inline u64 monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+/// A timestamp recorded by `perf_mark`.
+typedef struct PerfMark {
+  /// `vmem` address of the label string.
+  u64 label;
+  u64 ns;
+  /// Number of instructions retired by the machine when the mark was recorded.
+  u64 n_insts;
+} PerfMark;
+
+typedef struct PerfMarks {
+  PerfMark *marks;
+  u32 len;
+  u32 cap;
+} PerfMarks;
+
+attribute(noinline) static inline void perf_marks_push(PerfMarks *marks, PerfMark mark) {
+  if (marks->len == marks->cap) {
+    marks->cap = marks->cap == 0 ? 64 : marks->cap * 2;
+    marks->marks = xrealloc(marks->marks, PerfMark, marks->cap);
+  }
+  marks->marks[marks->len++] = mark;
+}
+
+static inline void perf_marks_free(PerfMarks *marks) {
+  xfree(marks->marks);
+  marks->marks = NULL;
+  marks->len = 0;
+  marks->cap = 0;
+}
+
+/// Sub-buckets of each power of two in latency histograms, as a power of two.
+/// With 8 sub-buckets, a latency read from a histogram is at most 1/8 above the recorded one.
+#define LATENCY_HIST_SUB_BITS 3
+#define LATENCY_HIST_SUB_COUNT (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((64 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_COUNT)
+
+/// Bucket of `ns` in a latency histogram, in the manner of HDR histograms: values below `LATENCY_HIST_SUB_COUNT` have a
+/// bucket each, every following power of two is split into `LATENCY_HIST_SUB_COUNT` buckets of equal width.
+static inline u32 latency_hist_bucket(u64 ns) {
+  if (ns < LATENCY_HIST_SUB_COUNT)
+    return (u32)ns;
+  u32 shift = (u32)(63 - __builtin_clzll(ns)) - LATENCY_HIST_SUB_BITS;
+  return (shift + 1) * LATENCY_HIST_SUB_COUNT + (u32)((ns >> shift) & (LATENCY_HIST_SUB_COUNT - 1));
+}
+
+/// Largest latency in `bucket`.
+static inline u64 latency_hist_bucket_max(u32 bucket) {
+  if (bucket < LATENCY_HIST_SUB_COUNT)
+    return bucket;
+  u32 shift = bucket / LATENCY_HIST_SUB_COUNT - 1;
+  u64 low = (u64)(LATENCY_HIST_SUB_COUNT + bucket % LATENCY_HIST_SUB_COUNT) << shift;
+  return low + (((u64)1 << shift) - 1);
+}
+
+/// Latency at `percentile` (in `[0, 100]`) of the `count` latencies in `hist`, as the upper bound of its bucket capped
+/// by the maximum latency `max_ns`.
+static inline u64 latency_hist_percentile(const u64 *hist, u64 count, u64 max_ns, f64 percentile) {
+  if (count == 0)
+    return 0;
+  u64 rank = (u64)(percentile / 100 * (f64)count + 0.5);
+  if (rank == 0)
+    rank = 1;
+  u64 seen = 0;
+  for (u32 i = 0; i < LATENCY_HIST_BUCKETS; ++i) {
+    seen += hist[i];
+    if (seen >= rank) {
+      u64 max = latency_hist_bucket_max(i);
+      return max < max_ns ? max : max_ns;
+    }
+  }
+  return max_ns;
+}
+
+/// Timings of a zone, delimited by `perf zone_begin` and `perf zone_end` with the same id.
+typedef struct ZoneStats {
+  /// `vmem` address of the name string.
+  u64 id;
+  u64 count;
+  u64 total_ns;
+  /// Time not spent in the zones nested in this one.
+  u64 self_ns;
+  u64 min_ns;
+  u64 max_ns;
+  /// Log-scaled histogram of the durations (see `latency_hist_bucket`).
+  u64 hist[LATENCY_HIST_BUCKETS];
+} ZoneStats;
+
+/// A zone that has begun but not ended yet.
+typedef struct OpenZone {
+  /// Index in `ZoneProfile::zones`.
+  u32 zone;
+  u64 start_ns;
+  /// Time spent in the zones nested in this one.
+  u64 child_ns;
+} OpenZone;
+
+/// Zones of a machine, only recorded if set by the embedder.
+typedef struct ZoneProfile {
+  ZoneStats *zones;
+  u32 len;
+  u32 cap;
+  /// Zones that have begun but not ended, innermost last.
+  OpenZone *stack;
+  u32 depth;
+  u32 stack_cap;
+  /// Number of `zone_end` without an open zone of the same id, which are ignored.
+  u64 unmatched;
+} ZoneProfile;
+
+static inline ZoneProfile *zone_profile_new() {
+  ZoneProfile *profile = xalloc(ZoneProfile, 1);
+  memset(profile, 0, sizeof(ZoneProfile));
+  return profile;
+}
+
+static inline void zone_profile_free(ZoneProfile *profile) {
+  xfree(profile->zones);
+  xfree(profile->stack);
+  xfree(profile);
+}
+
+/// Begin a zone of `id`, nested in the zones that are open.
+attribute(noinline) static inline void zone_profile_begin(ZoneProfile *profile, u64 id) {
+  u32 zone = 0;
+  while (zone < profile->len && profile->zones[zone].id != id)
+    ++zone;
+  if (zone == profile->len) {
+    if (profile->len == profile->cap) {
+      profile->cap = profile->cap == 0 ? 16 : profile->cap * 2;
+      profile->zones = xrealloc(profile->zones, ZoneStats, profile->cap);
+    }
+    ZoneStats *stats = &profile->zones[profile->len++];
+    memset(stats, 0, sizeof(ZoneStats));
+    stats->id = id;
+    stats->min_ns = UINT64_MAX;
+  }
+  if (profile->depth == profile->stack_cap) {
+    profile->stack_cap = profile->stack_cap == 0 ? 16 : profile->stack_cap * 2;
+    profile->stack = xrealloc(profile->stack, OpenZone, profile->stack_cap);
+  }
+  profile->stack[profile->depth++] = (OpenZone){zone, monotonic_ns(), 0};
+}
+
+/// End the innermost open zone of `id`, along with the zones nested in it that haven't ended.
+attribute(noinline) static inline void zone_profile_end(ZoneProfile *profile, u64 id) {
+  u64 ns = monotonic_ns();
+  u32 depth = profile->depth;
+  while (depth > 0 && profile->zones[profile->stack[depth - 1].zone].id != id)
+    --depth;
+  if (depth == 0) {
+    ++profile->unmatched;
+    return;
+  }
+  while (profile->depth >= depth) {
+    OpenZone *open = &profile->stack[--profile->depth];
+    ZoneStats *stats = &profile->zones[open->zone];
+    u64 duration = ns - open->start_ns;
+    if (profile->depth != 0)
+      profile->stack[profile->depth - 1].child_ns += duration;
+    ++stats->count;
+    stats->total_ns += duration;
+    stats->self_ns += duration - open->child_ns;
+    if (duration < stats->min_ns)
+      stats->min_ns = duration;
+    if (duration > stats->max_ns)
+      stats->max_ns = duration;
+    ++stats->hist[latency_hist_bucket(duration)];
+  }
+}
@@ -0,0 +1,90 @@
+#include "pipeline.h"
+#include "async_output.h"
+#include "fileformat.h"
+#include "machine.h"
+#include "native_math.h"
+
+#include <pthread.h>
+
+typedef struct PipelineStage {
+  Machine machine;
+  Channel *channels[2];
+  pthread_t thread;
+} PipelineStage;
+
+static void *pipeline_stage_main(void *stage_) {
+  PipelineStage *stage = stage_;
+  machine_run(&stage->machine);
+  if (stage->machine.io_stdout != stdout) {
+    fclose(stage->machine.io_stdout);
+    stage->machine.io_stdout = stdout;
+  }
+  for (usize i = 0; i < 2; ++i) {
+    if (stage->channels[i] != NULL)
+      channel_close(stage->channels[i]);
+  }
+  return NULL;
+}
+
+i32 pipeline_main(char **program_paths, u32 n_stages, bool async_output) {
+  if (n_stages == 0) {
+    panic_printf("Expect at least one program file for pipeline mode\n");
+  }
+  PipelineStage *stages = xalloc(PipelineStage, n_stages);
+  Channel **channels = xalloc(Channel *, n_stages);
+  for (u32 i = 0; i + 1 < n_stages; ++i)
+    channels[i] = channel_new(PIPELINE_CHANNEL_CAPACITY);
+  AsyncWriter *writer = async_output ? async_writer_new() : NULL;
+
+  for (u32 i = 0; i < n_stages; ++i) {
+    PipelineStage *stage = &stages[i];
+    FILE *file = fopen(program_paths[i], "rb");
+    if (file == NULL) {
+      panic_printf("Path %s doesn't exist\n", program_paths[i]);
+    }
+    ProgramImage image;
+    ProgramLoadResult load_result = load_program_image_from_file(&image, file);
+    fclose(file);
+    if (load_result != ProgramLoadOk) {
+      panic_printf("Program load error in %s: %s\n", program_paths[i], program_load_result_name(load_result));
+    }
+    stage->machine = machine_new(MACHINE_NOT_SILENT, NULL, NULL);
+    stage->machine.native_registry = native_math_registry();
+    machine_load_image(&stage->machine, &image);
+    program_image_free(&image);
+    stage->channels[0] = i == 0 ? NULL : channels[i - 1];
+    stage->channels[1] = i + 1 == n_stages ? NULL : channels[i];
+    stage->machine.channels = stage->channels;
+    stage->machine.channels_len = 2;
+    if (writer != NULL)
+      stage->machine.io_stdout = async_writer_open(writer, stdout);
+  }
+
+  for (u32 i = 0; i < n_stages; ++i) {
+    if (pthread_create(&stages[i].thread, NULL, pipeline_stage_main, &stages[i]) != 0) {
+      panic_printf("Failed to create thread\n");
+    }
+  }
+  for (u32 i = 0; i < n_stages; ++i)
+    pthread_join(stages[i].thread, NULL);
+
+  if (writer != NULL)
+    async_writer_free(writer);
+
+  // A stage that stopped on a fault fails the pipeline, even if the stages after it exit normally once its channel
+  // is closed.
+  i32 exit_code = stages[n_stages - 1].machine.exit_code;
+  for (u32 i = 0; i < n_stages; ++i) {
+    if (stages[i].machine.exit_code == MACHINE_EXIT_FAULT) {
+      fprintf(stderr, "Stage %u (%s) stopped on a fault\n", i, program_paths[i]);
+      exit_code = MACHINE_EXIT_FAULT;
+    }
+  }
+  for (u32 i = 0; i < n_stages; ++i)
+    machine_free(&stages[i].machine);
+  for (u32 i = 0; i + 1 < n_stages; ++i)
+    channel_free(channels[i]);
+  xfree(channels);
+  xfree(stages);
+  return exit_code;
+}
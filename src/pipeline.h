@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+
+/// Number of messages a channel between two stages can hold before the sender has to wait.
+#define PIPELINE_CHANNEL_CAPACITY 1024
+
+/// Run the programs as stages of a pipeline, each stage on its own thread.
+///
+/// Stages are connected by bounded channels, stage `k` receives from channel `0` (the output of stage `k - 1`) and
+/// sends to channel `1` (the input of stage `k + 1`).
+/// The first stage has no channel `0` and the last stage has no channel `1`, they read from stdin and write to stdout as
+/// usual.
+///
+/// When a stage stops, both of its channels are closed, so the next stage sees the end of its input after receiving all
+/// the messages, and the previous stage fails to send instead of waiting forever.
+///
+/// If `async_output` is true, the stdout of every stage is written by an `AsyncWriter` (see `async_output.h`).
+///
+/// Returns the exit code of the last stage.
+i32 pipeline_main(char **program_paths, u32 n_stages, bool async_output);
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE // for `fopencookie`
+
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct PrefetchStream {
+  FILE *src;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t data_available;
+  pthread_cond_t space_available;
+  /// Ring buffer of `PREFETCH_BUFFER_SIZE` bytes, `head` and `len` are guarded by `lock`.
+  /// Only the reader thread writes to the free part of the buffer, so it can do so without holding the lock.
+  char *buf;
+  usize head;
+  usize len;
+  /// Guarded by `lock`, set by the reader thread after reaching the end of `src`.
+  bool eof;
+  /// Guarded by `lock`, set when the stream is closed.
+  bool closed;
+} PrefetchStream;
+
+static void prefetch_stream_free(PrefetchStream *stream) {
+  fclose(stream->src);
+  pthread_mutex_destroy(&stream->lock);
+  pthread_cond_destroy(&stream->data_available);
+  pthread_cond_destroy(&stream->space_available);
+  xfree(stream->buf);
+  xfree(stream);
+}
+
+static void *prefetch_reader_main(void *stream_) {
+  PrefetchStream *stream = stream_;
+  int fd = fileno(stream->src);
+  pthread_mutex_lock(&stream->lock);
+  for (;;) {
+    while (stream->len == PREFETCH_BUFFER_SIZE && !stream->closed)
+      pthread_cond_wait(&stream->space_available, &stream->lock);
+    if (stream->closed)
+      break;
+    usize tail = (stream->head + stream->len) % PREFETCH_BUFFER_SIZE;
+    usize n = PREFETCH_BUFFER_SIZE - stream->len;
+    if (n > PREFETCH_BUFFER_SIZE - tail)
+      n = PREFETCH_BUFFER_SIZE - tail;
+    pthread_mutex_unlock(&stream->lock);
+
+    // `read` instead of `fread`, so reading from a terminal or a pipe returns whatever is available.
+    isize n_read = read(fd, &stream->buf[tail], n);
+
+    pthread_mutex_lock(&stream->lock);
+    if (n_read <= 0) {
+      stream->eof = true;
+      pthread_cond_signal(&stream->data_available);
+      if (stream->closed)
+        break;
+      // The stream is freed by `prefetch_stream_close` after joining.
+      pthread_mutex_unlock(&stream->lock);
+      return NULL;
+    }
+    stream->len += (usize)n_read;
+    pthread_cond_signal(&stream->data_available);
+  }
+  // The stream was closed while the thread was detached.
+  pthread_mutex_unlock(&stream->lock);
+  prefetch_stream_free(stream);
+  return NULL;
+}
+
+static usize prefetch_stream_read_(PrefetchStream *stream, char *buf, usize size) {
+  pthread_mutex_lock(&stream->lock);
+  while (stream->len == 0 && !stream->eof)
+    pthread_cond_wait(&stream->data_available, &stream->lock);
+  usize n = size < stream->len ? size : stream->len;
+  usize first = PREFETCH_BUFFER_SIZE - stream->head;
+  if (first > n)
+    first = n;
+  memcpy(buf, &stream->buf[stream->head], first);
+  memcpy(buf + first, stream->buf, n - first);
+  stream->head = (stream->head + n) % PREFETCH_BUFFER_SIZE;
+  stream->len -= n;
+  pthread_cond_signal(&stream->space_available);
+  pthread_mutex_unlock(&stream->lock);
+  return n;
+}
+
+#ifdef MODERN_APPLE
+static int prefetch_stream_read(void *stream, char *buf, int size) {
+  return (int)prefetch_stream_read_(stream, buf, (usize)size);
+}
+#else
+static ssize_t prefetch_stream_read(void *stream, char *buf, size_t size) {
+  return (ssize_t)prefetch_stream_read_(stream, buf, size);
+}
+#endif
+
+static int prefetch_stream_close(void *stream_) {
+  PrefetchStream *stream = stream_;
+  pthread_mutex_lock(&stream->lock);
+  stream->closed = true;
+  bool eof = stream->eof;
+  pthread_t thread = stream->thread;
+  pthread_cond_signal(&stream->space_available);
+  pthread_mutex_unlock(&stream->lock);
+  if (eof) {
+    pthread_join(thread, NULL);
+    prefetch_stream_free(stream);
+  } else {
+    // The reader thread may be blocked on `read` (e.g. on a terminal), let it free the stream when it wakes up.
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+FILE *prefetch_open(FILE *src) {
+  PrefetchStream *stream = xalloc(PrefetchStream, 1);
+  stream->src = src;
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->data_available, NULL);
+  pthread_cond_init(&stream->space_available, NULL);
+  stream->buf = xalloc(char, PREFETCH_BUFFER_SIZE);
+  stream->head = 0;
+  stream->len = 0;
+  stream->eof = false;
+  stream->closed = false;
+#ifdef MODERN_APPLE
+  FILE *file = funopen(stream, prefetch_stream_read, NULL, NULL, prefetch_stream_close);
+#else
+  cookie_io_functions_t io_functions = {
+      .read = prefetch_stream_read,
+      .write = NULL,
+      .seek = NULL,
+      .close = prefetch_stream_close,
+  };
+  FILE *file = fopencookie(stream, "r", io_functions);
+#endif
+  if (file == NULL)
+    alloc_fail_handler();
+  if (pthread_create(&stream->thread, NULL, prefetch_reader_main, stream) != 0) {
+    panic_printf("Failed to create thread\n");
+  }
+  return file;
+}
+
+typedef struct DeclaredFile {
+  struct DeclaredFile *next;
+  char *path;
+  FILE *stream;
+} DeclaredFile;
+
+static pthread_mutex_t declared_files_lock = PTHREAD_MUTEX_INITIALIZER;
+/// Declared files that haven't been opened yet, guarded by `declared_files_lock`.
+static DeclaredFile *declared_files = NULL;
+
+bool prefetch_declare(const char *path) {
+  FILE *src = fopen(path, "rb");
+  if (src == NULL)
+    return false;
+  DeclaredFile *file = xalloc(DeclaredFile, 1);
+  file->path = strdup(path);
+  if (file->path == NULL)
+    alloc_fail_handler();
+  file->stream = prefetch_open(src);
+  pthread_mutex_lock(&declared_files_lock);
+  file->next = declared_files;
+  declared_files = file;
+  pthread_mutex_unlock(&declared_files_lock);
+  return true;
+}
+
+FILE *prefetch_fopen(const char *path, const char *mode) {
+  if (mode[0] != 'r' || strchr(mode, '+') != NULL)
+    return fopen(path, mode);
+  FILE *stream = NULL;
+  pthread_mutex_lock(&declared_files_lock);
+  for (DeclaredFile **file = &declared_files; *file != NULL; file = &(*file)->next) {
+    if (strcmp((*file)->path, path) == 0) {
+      DeclaredFile *found = *file;
+      *file = found->next;
+      stream = found->stream;
+      xfree(found->path);
+      xfree(found);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&declared_files_lock);
+  if (stream != NULL)
+    return stream;
+  FILE *src = fopen(path, mode);
+  if (src == NULL)
+    return NULL;
+  return prefetch_open(src);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+
+/// Capacity of the ring buffer of a prefetched stream.
+#define PREFETCH_BUFFER_SIZE (1024 * 1024)
+
+/// Open a stream reading from `src` through a ring buffer, which is filled ahead of time by a reader thread in large
+/// `read`s, so that reading from the stream is mostly served from memory while the interpreter keeps running.
+///
+/// Takes the ownership of `src`, which is closed after the returned stream is closed.
+FILE *prefetch_open(FILE *src);
+
+/// Start prefetching the file at `path` ahead of time, the stream is handed out by the first `prefetch_fopen` of the
+/// same path for reading.
+/// Returns `false` if the file cannot be opened.
+bool prefetch_declare(const char *path);
+
+/// `fopen` prefetching files opened for reading only, other files are opened as usual.
+FILE *prefetch_fopen(const char *path, const char *mode);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+
+/// Share of `count` in `total` in percent, 0 if `total` is 0.
+static inline f64 report_percentage(u64 count, u64 total) {
+  return total == 0 ? 0 : (f64)count * 100 / (f64)total;
+}
+
+/// Indices of `counts[0..len]` with non-zero counts, sorted by count in descending order.
+/// The caller frees the returned array, of `*out_len` indices.
+static inline u32 *report_sorted_nonzero(const u64 *counts, u32 len, u32 *out_len) {
+  u32 *indices = xalloc(u32, len);
+  u32 n = 0;
+  for (u32 i = 0; i < len; ++i) {
+    if (counts[i] == 0)
+      continue;
+    u32 j = n++;
+    for (; j > 0 && counts[indices[j - 1]] < counts[i]; --j)
+      indices[j] = indices[j - 1];
+    indices[j] = i;
+  }
+  *out_len = n;
+  return indices;
+}
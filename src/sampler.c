@@ -0,0 +1,201 @@
+#include "common.h"
+#include "values.h"
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+typedef struct machine Machine;
+
+typedef struct ShadowFrame {
+  /// `sp` right after the return address was pushed.
+  u64 sp;
+  /// Entry of the called function.
+  u16 target;
+} ShadowFrame;
+
+/// Every call pushes a 2-byte return address, so the depth of the call stack never exceeds this.
+#define SHADOW_STACK_CAP (VMEM_SEG_SIZE / 2)
+/// Maximum number of frames in a sample, the outermost frames of deeper stacks are dropped.
+#define SAMPLE_DEPTH_MAX 256
+/// Set in the first word of a sample whose outermost frames are dropped.
+#define SAMPLE_TRUNCATED 0x8000
+/// Number of words of the sample with the first word `word0`.
+#define SAMPLE_LEN(WORD0) ((u32)((WORD0) & ~SAMPLE_TRUNCATED) + 2)
+
+/// Capacity of `StackCounts`, the signal handler cannot allocate, so samples of new stacks are dropped once full.
+#define STACK_COUNTS_CAP (1 << 16)
+#define STACK_WORDS_CAP (1 << 22)
+
+/// Hash map from distinct samples to the number of times they are sampled.
+/// A sample is `[n][pc][target ...]`, where the `n` targets of the shadow stack are ordered from the outermost call.
+typedef struct StackCounts {
+  /// The samples, stored back to back.
+  u16 words[STACK_WORDS_CAP];
+  u32 words_len;
+  /// Indices into `words` of the samples, `UINT32_MAX` marks an empty slot.
+  u32 offsets[STACK_COUNTS_CAP];
+  u64 counts[STACK_COUNTS_CAP];
+  u32 len;
+} StackCounts;
+
+typedef struct Sampler {
+  Machine *machine;
+  /// pc the machine started on, the root of every stack.
+  u16 entry;
+  ShadowFrame shadow[SHADOW_STACK_CAP];
+  u32 depth;
+  /// Filled by the signal handler.
+  StackCounts counts;
+  u64 n_samples;
+  /// Number of samples dropped because `counts` is full.
+  u64 n_dropped;
+} Sampler;
+
+/// Sampler of the machine running on this thread, `NULL` on other threads that the signal may be delivered to.
+static _Thread_local Sampler *sampler;
+
+static void sampler_on_call(Machine *machine);
+static void sampler_on_ret(Machine *machine);
+
+#define MACHINE_HOOK_CALL(MACHINE) sampler_on_call(MACHINE)
+#define MACHINE_HOOK_RET(MACHINE) sampler_on_ret(MACHINE)
+
+#include "sampler.h"
+
+static u32 stack_hash(const u16 *sample) {
+  u32 hash = 2166136261u;
+  for (u32 i = 0; i < SAMPLE_LEN(sample[0]); ++i)
+    hash = (hash ^ sample[i]) * 16777619u;
+  return hash;
+}
+
+/// Count the sample, returns `false` if it is of a new stack and `counts` is full.
+static bool stack_counts_add(StackCounts *counts, const u16 *sample) {
+  u32 len = SAMPLE_LEN(sample[0]);
+  u32 mask = STACK_COUNTS_CAP - 1;
+  u32 i = stack_hash(sample) & mask;
+  for (;; i = (i + 1) & mask) {
+    u32 offset = counts->offsets[i];
+    if (offset == UINT32_MAX)
+      break;
+    if (memcmp(&counts->words[offset], sample, len * 2) == 0) {
+      ++counts->counts[i];
+      return true;
+    }
+  }
+  if (counts->len * 2 >= STACK_COUNTS_CAP || counts->words_len + len > STACK_WORDS_CAP)
+    return false;
+  memcpy(&counts->words[counts->words_len], sample, len * 2);
+  counts->offsets[i] = counts->words_len;
+  counts->counts[i] = 1;
+  counts->words_len += len;
+  ++counts->len;
+  return true;
+}
+
+static void sampler_signal_handler(int signal) {
+  (void)signal;
+  Sampler *s = sampler;
+  if (s == NULL)
+    return;
+  atomic_signal_fence(memory_order_acquire);
+  u32 depth = s->depth;
+  u32 n = depth > SAMPLE_DEPTH_MAX ? SAMPLE_DEPTH_MAX : depth;
+  u16 sample[SAMPLE_DEPTH_MAX + 2];
+  sample[0] = (u16)n | (depth > n ? SAMPLE_TRUNCATED : 0);
+  sample[1] = s->machine->pc;
+  for (u32 i = 0; i < n; ++i)
+    sample[2 + i] = s->shadow[depth - n + i].target;
+  if (stack_counts_add(&s->counts, sample))
+    ++s->n_samples;
+  else
+    ++s->n_dropped;
+}
+
+/// Pop the frames that have returned, judging by `sp`.
+static inline u32 sampler_unwind(Sampler *s, u64 sp) {
+  u32 depth = s->depth;
+  while (depth != 0 && s->shadow[depth - 1].sp > sp)
+    --depth;
+  return depth;
+}
+
+static void sampler_on_call(Machine *machine) {
+  Sampler *s = sampler;
+  u32 depth = sampler_unwind(s, machine->reg_sp);
+  if (depth != 0 && s->shadow[depth - 1].sp == machine->reg_sp) {
+    // `tcall` pushes no return address and replaces the frame of the caller.
+    s->shadow[depth - 1].target = machine->pc;
+  } else if (depth < SHADOW_STACK_CAP) {
+    s->shadow[depth] = (ShadowFrame){machine->reg_sp, machine->pc};
+    ++depth;
+  }
+  atomic_signal_fence(memory_order_release);
+  s->depth = depth;
+}
+
+static void sampler_on_ret(Machine *machine) {
+  Sampler *s = sampler;
+  s->depth = sampler_unwind(s, machine->reg_sp);
+}
+
+/// Print the frame of a function (`is_pc == false`) or of the sampled instruction.
+static void print_frame(const Symbols *symbols, u16 addr, bool is_pc, FILE *output) {
+  char name[256];
+  symbols_name(symbols, addr, is_pc, name, sizeof(name));
+  fputs(name, output);
+}
+
+static void print_folded(const Sampler *s, const Symbols *symbols, FILE *output) {
+  const StackCounts *counts = &s->counts;
+  for (u32 i = 0; i < STACK_COUNTS_CAP; ++i) {
+    if (counts->offsets[i] == UINT32_MAX)
+      continue;
+    const u16 *sample = &counts->words[counts->offsets[i]];
+    print_frame(symbols, s->entry, false, output);
+    if (sample[0] & SAMPLE_TRUNCATED)
+      fprintf(output, ";[truncated]");
+    for (u32 j = 2; j < SAMPLE_LEN(sample[0]); ++j) {
+      fputc(';', output);
+      print_frame(symbols, sample[j], false, output);
+    }
+    fputc(';', output);
+    print_frame(symbols, sample[1], true, output);
+    fprintf(output, " %llu\n", counts->counts[i]);
+  }
+}
+
+void sampler_run(Machine *machine, u32 hz, const Symbols *symbols, FILE *output) {
+  Sampler *s = xalloc(Sampler, 1);
+  memset(s, 0, sizeof(Sampler));
+  memset(s->counts.offsets, 0xFF, sizeof(s->counts.offsets));
+  s->machine = machine;
+  s->entry = machine->pc;
+  sampler = s;
+
+  struct sigaction action = {0};
+  struct sigaction old_action;
+  action.sa_handler = sampler_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &old_action);
+  u64 interval_us = hz >= 1000000 ? 1 : 1000000 / hz;
+  struct itimerval timer = {
+      .it_interval = {.tv_sec = (time_t)(interval_us / 1000000), .tv_usec = (suseconds_t)(interval_us % 1000000)},
+  };
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  machine_run(machine);
+
+  setitimer(ITIMER_PROF, &(struct itimerval){0}, NULL);
+  sigaction(SIGPROF, &old_action, NULL);
+  sampler = NULL;
+
+  print_folded(s, symbols, output);
+  if (s->n_dropped != 0)
+    fprintf(stderr, "Sampler dropped %llu of %llu samples\n", s->n_dropped, s->n_samples + s->n_dropped);
+
+  xfree(s);
+}
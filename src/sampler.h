@@ -0,0 +1,10 @@
+#pragma once
+
+#include "machine.h"
+#include "symbols.h"
+
+/// Run the machine with a separately compiled variant of the interpreter, which keeps a shadow call stack, while a
+/// `SIGPROF` timer samples the pc and the call stack `hz` times per second of CPU time.
+/// After the machine stops, the samples are written to `output` in the folded-stack format of flame graphs (one
+/// `root;caller;callee;pc count` line per distinct stack), where functions are named by `symbols`.
+void sampler_run(Machine *machine, u32 hz, const Symbols *symbols, FILE *output);
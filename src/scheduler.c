@@ -0,0 +1,285 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct SchedulerTask {
+  Machine *machine;
+  scheduler_finish_callback_t finish_callback;
+  void *cx;
+} SchedulerTask;
+
+/// Growable ring buffer of tasks, guarded by its lock.
+typedef struct TaskQueue {
+  pthread_mutex_t lock;
+  SchedulerTask *buf;
+  /// Always a power of two.
+  usize cap;
+  usize head;
+  usize len;
+} TaskQueue;
+
+typedef struct SchedulerWorker {
+  Scheduler *scheduler;
+  u32 index;
+  pthread_t thread;
+  TaskQueue queue;
+} SchedulerWorker;
+
+struct Scheduler {
+  u64 quantum;
+  u32 n_workers;
+  SchedulerWorker *workers;
+  u32 n_io_workers;
+  pthread_t *io_threads;
+  TaskQueue io_queue;
+  pthread_cond_t io_available;
+  bool io_shutdown;
+  atomic_uint next_worker;
+  /// Number of tasks in the run queues of all workers.
+  atomic_size_t n_runnable;
+  atomic_size_t n_sleeping;
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+  pthread_cond_t all_finished;
+  /// Number of spawned machines that haven't stopped, guarded by `lock`.
+  usize n_live;
+  /// Guarded by `lock`.
+  bool shutdown;
+};
+
+static void task_queue_init(TaskQueue *queue) {
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->cap = 64;
+  queue->buf = xalloc(SchedulerTask, queue->cap);
+  queue->head = 0;
+  queue->len = 0;
+}
+
+static void task_queue_free(TaskQueue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  xfree(queue->buf);
+}
+
+/// Caller must be holding `queue->lock`.
+static void task_queue_push_back_locked(TaskQueue *queue, SchedulerTask task) {
+  if (queue->len == queue->cap) {
+    SchedulerTask *buf = xalloc(SchedulerTask, queue->cap * 2);
+    for (usize i = 0; i < queue->len; ++i)
+      buf[i] = queue->buf[(queue->head + i) & (queue->cap - 1)];
+    xfree(queue->buf);
+    queue->buf = buf;
+    queue->cap *= 2;
+    queue->head = 0;
+  }
+  queue->buf[(queue->head + queue->len) & (queue->cap - 1)] = task;
+  ++queue->len;
+}
+
+/// Caller must be holding `queue->lock`.
+static bool task_queue_pop_front_locked(TaskQueue *queue, SchedulerTask *task) {
+  if (queue->len == 0)
+    return false;
+  *task = queue->buf[queue->head];
+  queue->head = (queue->head + 1) & (queue->cap - 1);
+  --queue->len;
+  return true;
+}
+
+/// Caller must be holding `queue->lock`.
+static bool task_queue_pop_back_locked(TaskQueue *queue, SchedulerTask *task) {
+  if (queue->len == 0)
+    return false;
+  --queue->len;
+  *task = queue->buf[(queue->head + queue->len) & (queue->cap - 1)];
+  return true;
+}
+
+static void scheduler_enqueue(Scheduler *scheduler, u32 worker_index, SchedulerTask task) {
+  TaskQueue *queue = &scheduler->workers[worker_index].queue;
+  pthread_mutex_lock(&queue->lock);
+  task_queue_push_back_locked(queue, task);
+  pthread_mutex_unlock(&queue->lock);
+  // Sleeping workers increment `n_sleeping` before checking `n_runnable`, so one of the two sides always sees the
+  // other and no wakeup is lost.
+  atomic_fetch_add(&scheduler->n_runnable, 1);
+  if (atomic_load(&scheduler->n_sleeping) != 0) {
+    pthread_mutex_lock(&scheduler->lock);
+    pthread_cond_signal(&scheduler->work_available);
+    pthread_mutex_unlock(&scheduler->lock);
+  }
+}
+
+static void scheduler_finish(Scheduler *scheduler, SchedulerTask task) {
+  machine_record_stop(task.machine);
+  task.finish_callback(task.machine, task.cx);
+  pthread_mutex_lock(&scheduler->lock);
+  if (--scheduler->n_live == 0)
+    pthread_cond_broadcast(&scheduler->all_finished);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/// Pop from the front of the worker's own queue, or else steal from the back of another worker's queue.
+static bool worker_take_task(SchedulerWorker *worker, SchedulerTask *task) {
+  Scheduler *scheduler = worker->scheduler;
+  for (u32 i = 0; i < scheduler->n_workers; ++i) {
+    SchedulerWorker *victim = &scheduler->workers[(worker->index + i) % scheduler->n_workers];
+    pthread_mutex_lock(&victim->queue.lock);
+    bool found = victim == worker ? task_queue_pop_front_locked(&victim->queue, task)
+                                  : task_queue_pop_back_locked(&victim->queue, task);
+    pthread_mutex_unlock(&victim->queue.lock);
+    if (found) {
+      atomic_fetch_sub(&scheduler->n_runnable, 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void *worker_main(void *worker_) {
+  SchedulerWorker *worker = worker_;
+  Scheduler *scheduler = worker->scheduler;
+  for (;;) {
+    SchedulerTask task;
+    if (!worker_take_task(worker, &task)) {
+      pthread_mutex_lock(&scheduler->lock);
+      atomic_fetch_add(&scheduler->n_sleeping, 1);
+      while (atomic_load(&scheduler->n_runnable) == 0 && !scheduler->shutdown)
+        pthread_cond_wait(&scheduler->work_available, &scheduler->lock);
+      atomic_fetch_sub(&scheduler->n_sleeping, 1);
+      bool shutdown = scheduler->shutdown;
+      pthread_mutex_unlock(&scheduler->lock);
+      if (shutdown)
+        return NULL;
+      continue;
+    }
+    Machine *machine = task.machine;
+    bool running = true;
+    for (u64 i = 0; i < scheduler->quantum; ++i) {
+      if (!machine_next(machine)) {
+        running = false;
+        break;
+      }
+    }
+    if (running) {
+      scheduler_enqueue(scheduler, worker->index, task);
+    } else if (machine->yielded) {
+      machine->yielded = false;
+      scheduler_enqueue(scheduler, worker->index, task);
+    } else if (machine->has_pending_libc_call) {
+      pthread_mutex_lock(&scheduler->io_queue.lock);
+      task_queue_push_back_locked(&scheduler->io_queue, task);
+      pthread_cond_signal(&scheduler->io_available);
+      pthread_mutex_unlock(&scheduler->io_queue.lock);
+    } else {
+      scheduler_finish(scheduler, task);
+    }
+  }
+}
+
+static void *io_worker_main(void *scheduler_) {
+  Scheduler *scheduler = scheduler_;
+  for (;;) {
+    SchedulerTask task;
+    pthread_mutex_lock(&scheduler->io_queue.lock);
+    while (scheduler->io_queue.len == 0 && !scheduler->io_shutdown)
+      pthread_cond_wait(&scheduler->io_available, &scheduler->io_queue.lock);
+    bool found = task_queue_pop_front_locked(&scheduler->io_queue, &task);
+    pthread_mutex_unlock(&scheduler->io_queue.lock);
+    if (!found)
+      return NULL;
+    if (machine_resume_libc_call(task.machine)) {
+      u32 worker_index = atomic_fetch_add(&scheduler->next_worker, 1) % scheduler->n_workers;
+      scheduler_enqueue(scheduler, worker_index, task);
+    } else {
+      scheduler_finish(scheduler, task);
+    }
+  }
+}
+
+Scheduler *scheduler_new(u32 n_workers, u32 n_io_workers, u64 quantum) {
+  xassert(n_workers > 0);
+  xassert(n_io_workers > 0);
+  xassert(quantum > 0);
+  Scheduler *scheduler = xalloc(Scheduler, 1);
+  scheduler->quantum = quantum;
+  scheduler->n_workers = n_workers;
+  scheduler->workers = xalloc(SchedulerWorker, n_workers);
+  scheduler->n_io_workers = n_io_workers;
+  scheduler->io_threads = xalloc(pthread_t, n_io_workers);
+  task_queue_init(&scheduler->io_queue);
+  pthread_cond_init(&scheduler->io_available, NULL);
+  scheduler->io_shutdown = false;
+  atomic_init(&scheduler->next_worker, 0);
+  atomic_init(&scheduler->n_runnable, 0);
+  atomic_init(&scheduler->n_sleeping, 0);
+  pthread_mutex_init(&scheduler->lock, NULL);
+  pthread_cond_init(&scheduler->work_available, NULL);
+  pthread_cond_init(&scheduler->all_finished, NULL);
+  scheduler->n_live = 0;
+  scheduler->shutdown = false;
+  for (u32 i = 0; i < n_workers; ++i) {
+    SchedulerWorker *worker = &scheduler->workers[i];
+    worker->scheduler = scheduler;
+    worker->index = i;
+    task_queue_init(&worker->queue);
+  }
+  for (u32 i = 0; i < n_workers; ++i) {
+    if (pthread_create(&scheduler->workers[i].thread, NULL, worker_main, &scheduler->workers[i]) != 0) {
+      panic_printf("Unable to spawn worker thread\n");
+    }
+  }
+  for (u32 i = 0; i < n_io_workers; ++i) {
+    if (pthread_create(&scheduler->io_threads[i], NULL, io_worker_main, scheduler) != 0) {
+      panic_printf("Unable to spawn I/O thread\n");
+    }
+  }
+  return scheduler;
+}
+
+void scheduler_spawn(Scheduler *scheduler, Machine *machine, scheduler_finish_callback_t finish_callback, void *cx) {
+  machine->config_defer_blocking_io = true;
+  pthread_mutex_lock(&scheduler->lock);
+  ++scheduler->n_live;
+  pthread_mutex_unlock(&scheduler->lock);
+  SchedulerTask task = {
+      .machine = machine,
+      .finish_callback = finish_callback,
+      .cx = cx,
+  };
+  u32 worker_index = atomic_fetch_add(&scheduler->next_worker, 1) % scheduler->n_workers;
+  scheduler_enqueue(scheduler, worker_index, task);
+}
+
+void scheduler_wait(Scheduler *scheduler) {
+  pthread_mutex_lock(&scheduler->lock);
+  while (scheduler->n_live != 0)
+    pthread_cond_wait(&scheduler->all_finished, &scheduler->lock);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+void scheduler_free(Scheduler *scheduler) {
+  pthread_mutex_lock(&scheduler->lock);
+  xassert(scheduler->n_live == 0);
+  scheduler->shutdown = true;
+  pthread_cond_broadcast(&scheduler->work_available);
+  pthread_mutex_unlock(&scheduler->lock);
+  pthread_mutex_lock(&scheduler->io_queue.lock);
+  scheduler->io_shutdown = true;
+  pthread_cond_broadcast(&scheduler->io_available);
+  pthread_mutex_unlock(&scheduler->io_queue.lock);
+  for (u32 i = 0; i < scheduler->n_workers; ++i)
+    pthread_join(scheduler->workers[i].thread, NULL);
+  for (u32 i = 0; i < scheduler->n_io_workers; ++i)
+    pthread_join(scheduler->io_threads[i], NULL);
+  for (u32 i = 0; i < scheduler->n_workers; ++i)
+    task_queue_free(&scheduler->workers[i].queue);
+  task_queue_free(&scheduler->io_queue);
+  pthread_cond_destroy(&scheduler->io_available);
+  pthread_mutex_destroy(&scheduler->lock);
+  pthread_cond_destroy(&scheduler->work_available);
+  pthread_cond_destroy(&scheduler->all_finished);
+  xfree(scheduler->workers);
+  xfree(scheduler->io_threads);
+  xfree(scheduler);
+}
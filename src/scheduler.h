@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "machine.h"
+
+/// M:N scheduler running many machines on a fixed number of worker threads.
+///
+/// Each worker has its own run queue and steals from other workers when its own queue is empty.
+/// A machine is preempted after running `quantum` instructions and put back to the end of the run queue.
+/// Machines are run with `config_defer_blocking_io`, and the blocking libc calls are performed on a separate pool of
+/// I/O threads while the machine is parked, so the workers never block on I/O.
+typedef struct Scheduler Scheduler;
+
+/// Called on one of the scheduler threads when a machine stops.
+typedef void (*scheduler_finish_callback_t)(Machine *machine, void *cx);
+
+Scheduler *scheduler_new(u32 n_workers, u32 n_io_workers, u64 quantum);
+
+/// Schedule a machine to be run, `finish_callback` is called after the machine stops.
+/// The machine must not be touched by the caller until then.
+void scheduler_spawn(Scheduler *scheduler, Machine *machine, scheduler_finish_callback_t finish_callback, void *cx);
+
+/// Block until all spawned machines have stopped.
+void scheduler_wait(Scheduler *scheduler);
+
+/// Stop the threads and free the scheduler, all spawned machines must have stopped.
+void scheduler_free(Scheduler *scheduler);
@@ -0,0 +1,362 @@
+#include "spmd.h"
+#include "machine.h"
+#include "native_math.h"
+
+#include <time.h>
+
+struct SpmdMachine {
+  u32 n_lanes;
+  bool config_silent;
+  u8 *vmem_text;
+  /// `regs[reg_code * n_lanes + lane]`, the status register is `REG_STATUS`.
+  u64 *regs;
+  u16 *pc;
+  /// All ones for lanes executing the current step, zero otherwise.
+  u64 *mask;
+  bool *halted;
+  i32 *exit_code;
+  u8 **vmem_stack;
+  u8 **vmem_data;
+  FILE **io_stdin;
+  FILE **io_stdout;
+  FILE **io_stderr;
+  /// Used for instructions that have no vectorized handler.
+  Machine scalar;
+};
+
+SpmdMachine *spmd_new(const ProgramImage *image, u32 n_lanes, bool config_silent) {
+  xassert(n_lanes > 0);
+  SpmdMachine *spmd = xalloc(SpmdMachine, 1);
+  spmd->n_lanes = n_lanes;
+  spmd->config_silent = config_silent;
+  spmd->vmem_text = xalloc(u8, VMEM_SEG_SIZE);
+  memcpy(spmd->vmem_text, image->vmem_text, VMEM_SEG_SIZE);
+  spmd->regs = calloc(16 * (usize)n_lanes, sizeof(u64));
+  spmd->pc = calloc(n_lanes, sizeof(u16));
+  spmd->mask = calloc(n_lanes, sizeof(u64));
+  spmd->halted = calloc(n_lanes, sizeof(bool));
+  spmd->exit_code = calloc(n_lanes, sizeof(i32));
+  if (spmd->regs == NULL || spmd->pc == NULL || spmd->mask == NULL || spmd->halted == NULL || spmd->exit_code == NULL)
+    alloc_fail_handler();
+  spmd->vmem_stack = xalloc(u8 *, n_lanes);
+  spmd->vmem_data = xalloc(u8 *, n_lanes);
+  spmd->io_stdin = xalloc(FILE *, n_lanes);
+  spmd->io_stdout = xalloc(FILE *, n_lanes);
+  spmd->io_stderr = xalloc(FILE *, n_lanes);
+  for (u32 lane = 0; lane < n_lanes; ++lane) {
+    spmd->vmem_stack[lane] = xalloc(u8, VMEM_SEG_SIZE);
+    spmd->vmem_data[lane] = xalloc(u8, VMEM_SEG_SIZE);
+    memcpy(spmd->vmem_stack[lane], image->vmem_stack, VMEM_SEG_SIZE);
+    memcpy(spmd->vmem_data[lane], image->vmem_data, VMEM_SEG_SIZE);
+    spmd->io_stdin[lane] = stdin;
+    spmd->io_stdout[lane] = stdout;
+    spmd->io_stderr[lane] = stderr;
+  }
+  spmd->scalar = (Machine){0};
+  spmd->scalar.config_silent = config_silent;
+  spmd->scalar.native_registry = native_math_registry();
+  spmd->scalar.vmem_text = spmd->vmem_text;
+  return spmd;
+}
+
+void spmd_free(SpmdMachine *spmd) {
+  for (u32 lane = 0; lane < spmd->n_lanes; ++lane) {
+    xfree(spmd->vmem_stack[lane]);
+    xfree(spmd->vmem_data[lane]);
+  }
+  xfree(spmd->vmem_text);
+  xfree(spmd->regs);
+  xfree(spmd->pc);
+  xfree(spmd->mask);
+  xfree(spmd->halted);
+  xfree(spmd->exit_code);
+  xfree(spmd->vmem_stack);
+  xfree(spmd->vmem_data);
+  xfree(spmd->io_stdin);
+  xfree(spmd->io_stdout);
+  xfree(spmd->io_stderr);
+  xfree(spmd);
+}
+
+u64 *spmd_lane_reg(SpmdMachine *spmd, u32 lane, u8 reg_code) {
+  xassert(lane < spmd->n_lanes && reg_code < 16);
+  return &spmd->regs[reg_code * spmd->n_lanes + lane];
+}
+
+void spmd_set_lane_io(SpmdMachine *spmd, u32 lane, FILE *io_stdin, FILE *io_stdout, FILE *io_stderr) {
+  xassert(lane < spmd->n_lanes);
+  spmd->io_stdin[lane] = io_stdin;
+  spmd->io_stdout[lane] = io_stdout;
+  spmd->io_stderr[lane] = io_stderr;
+}
+
+i32 spmd_lane_exit_code(const SpmdMachine *spmd, u32 lane) {
+  xassert(lane < spmd->n_lanes);
+  return spmd->exit_code[lane];
+}
+
+/// Execute the instruction at `pc` for every lane in the mask, one lane at a time on the scalar machine.
+static void spmd_step_scalar(SpmdMachine *spmd, u16 pc) {
+  Machine *machine = &spmd->scalar;
+  u32 n = spmd->n_lanes;
+  for (u32 lane = 0; lane < n; ++lane) {
+    if (!spmd->mask[lane])
+      continue;
+    machine->pc = pc;
+    for (u8 reg_code = 0; reg_code < 16; ++reg_code)
+      *machine_reg(machine, reg_code) = spmd->regs[reg_code * n + lane];
+    machine->vmem_stack = spmd->vmem_stack[lane];
+    machine->vmem_data = spmd->vmem_data[lane];
+    machine->io_stdin = spmd->io_stdin[lane];
+    machine->io_stdout = spmd->io_stdout[lane];
+    machine->io_stderr = spmd->io_stderr[lane];
+    machine->exit_code = spmd->exit_code[lane];
+    machine->halted = false;
+    bool running = machine_next(machine);
+    if (!running)
+      machine_record_stop(machine);
+    for (u8 reg_code = 0; reg_code < 16; ++reg_code)
+      spmd->regs[reg_code * n + lane] = *machine_reg(machine, reg_code);
+    spmd->pc[lane] = machine->pc;
+    spmd->exit_code[lane] = machine->exit_code;
+    // A yielded lane is retried on a later step.
+    spmd->halted[lane] = !running && !machine->yielded;
+    machine->yielded = false;
+  }
+}
+
+/// Vectorized handler of a qword ALU instruction `dest = lhs OP rhs`.
+/// `RESULT_EXPR` and `FLAGS_EXPR` are evaluated with `lhs`, `rhs` and `result` in scope.
+#define SPMD_BINARY_OP(RESULT_EXPR, FLAGS_EXPR)                                                                        \
+  {                                                                                                                    \
+    u64 *dest = &spmd->regs[GET_OPERAND0(inst) * n];                                                                   \
+    const u64 *lhs_ = &spmd->regs[GET_OPERAND1(inst) * n];                                                             \
+    const u64 *rhs_ = &spmd->regs[GET_OPERAND2(inst) * n];                                                             \
+    u64 *status = &spmd->regs[REG_STATUS * n];                                                                         \
+    for (u32 lane = 0; lane < n; ++lane) {                                                                             \
+      u64 lhs = lhs_[lane];                                                                                            \
+      u64 rhs = rhs_[lane];                                                                                            \
+      u64 result = (RESULT_EXPR);                                                                                      \
+      u64 flags = (FLAGS_EXPR);                                                                                        \
+      u64 m = spmd->mask[lane];                                                                                        \
+      status[lane] = (flags & m) | (status[lane] & ~m);                                                                \
+      dest[lane] = (result & m) | (dest[lane] & ~m);                                                                   \
+    }                                                                                                                  \
+  }
+
+/// Vectorized handler of a qword instruction `dest = OP lhs`, like `SPMD_BINARY_OP` without `rhs`.
+#define SPMD_UNARY_OP(RESULT_EXPR, FLAGS_EXPR)                                                                         \
+  {                                                                                                                    \
+    u64 *dest = &spmd->regs[GET_OPERAND0(inst) * n];                                                                   \
+    const u64 *lhs_ = &spmd->regs[GET_OPERAND1(inst) * n];                                                             \
+    u64 *status = &spmd->regs[REG_STATUS * n];                                                                         \
+    for (u32 lane = 0; lane < n; ++lane) {                                                                             \
+      u64 lhs = lhs_[lane];                                                                                            \
+      u64 result = (RESULT_EXPR);                                                                                      \
+      u64 flags = (FLAGS_EXPR);                                                                                        \
+      u64 m = spmd->mask[lane];                                                                                        \
+      status[lane] = (flags & m) | (status[lane] & ~m);                                                                \
+      dest[lane] = (result & m) | (dest[lane] & ~m);                                                                   \
+    }                                                                                                                  \
+  }
+
+#define FLAG_IF(COND, FLAG) ((u64)(COND) * (FLAG))
+
+/// Flags N and Z of a qword result.
+#define FLAGS_NZ(RESULT) (FLAG_IF((i64)(RESULT) < 0, CONDFLAG_N) | FLAG_IF((RESULT) == 0, CONDFLAG_Z))
+
+static inline void spmd_advance_pc(SpmdMachine *spmd, u16 new_pc) {
+  for (u32 lane = 0; lane < spmd->n_lanes; ++lane)
+    spmd->pc[lane] = spmd->mask[lane] ? new_pc : spmd->pc[lane];
+}
+
+/// Returns `false` if all lanes have stopped.
+static bool spmd_step(SpmdMachine *spmd) {
+  u32 n = spmd->n_lanes;
+  // Lowest pc first, so that lanes left behind by a branch catch up with the others.
+  bool any_running = false;
+  u16 pc = UINT16_MAX;
+  for (u32 lane = 0; lane < n; ++lane) {
+    if (!spmd->halted[lane] && spmd->pc[lane] <= pc) {
+      pc = spmd->pc[lane];
+      any_running = true;
+    }
+  }
+  if (!any_running)
+    return false;
+  for (u32 lane = 0; lane < n; ++lane)
+    spmd->mask[lane] = (!spmd->halted[lane] && spmd->pc[lane] == pc) ? UINT64_MAX : 0;
+  if (pc + 12 > VMEM_SEG_SIZE) {
+    spmd_step_scalar(spmd, pc);
+    return true;
+  }
+  const u8 *inst = &spmd->vmem_text[pc];
+  const u8 opcode = inst[0] & 0b11111100;
+  const u8 oplen = inst[0] & 0b00000011;
+  // Only qword instructions have vectorized handlers.
+  if (oplen != OPLEN_8) {
+    spmd_step_scalar(spmd, pc);
+    return true;
+  }
+  switch (opcode) {
+  case OPCODE_NOP: {
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_LOAD_IMM: {
+    u64 imm = decode_imm(&inst[4], GET_FLAGS(inst));
+    u64 *dest = &spmd->regs[GET_OPERAND0(inst) * n];
+    u64 *status = &spmd->regs[REG_STATUS * n];
+    u64 flags = FLAGS_NZ(imm);
+    for (u32 lane = 0; lane < n; ++lane) {
+      u64 m = spmd->mask[lane];
+      status[lane] = (flags & m) | (status[lane] & ~m);
+      dest[lane] = (imm & m) | (dest[lane] & ~m);
+    }
+    spmd_advance_pc(spmd, pc + 4 + imm_len(GET_FLAGS(inst)));
+  } break;
+  case OPCODE_MOV: {
+    SPMD_UNARY_OP(lhs, FLAG_IF((i64)lhs < 0, CONDFLAG_N));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_CMP: {
+    u64 *status = &spmd->regs[REG_STATUS * n];
+    const u64 *lhs_ = &spmd->regs[GET_OPERAND0(inst) * n];
+    const u64 *rhs_ = &spmd->regs[GET_OPERAND1(inst) * n];
+    for (u32 lane = 0; lane < n; ++lane) {
+      u64 lhs = lhs_[lane];
+      u64 rhs = rhs_[lane];
+      u64 flags = FLAG_IF(lhs == 0, CONDFLAG_Z) | FLAG_IF(lhs == rhs, CONDFLAG_E) | FLAG_IF(lhs > rhs, CONDFLAG_G) |
+                  FLAG_IF(lhs < rhs, CONDFLAG_L);
+      u64 m = spmd->mask[lane];
+      status[lane] = (flags & m) | (status[lane] & ~m);
+    }
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_B: {
+    u8 cond_flag = GET_FLAGS(inst);
+    u8 rev = cond_flag & 0b10000000;
+    u16 target = pc + 4 + GET_JUMP_OFFSET(inst);
+    const u64 *status = &spmd->regs[REG_STATUS * n];
+    for (u32 lane = 0; lane < n; ++lane) {
+      if (!spmd->mask[lane])
+        continue;
+      bool cond = (u64)(cond_flag & 0b011111111) & status[lane];
+      if (rev)
+        cond = !cond;
+      spmd->pc[lane] = cond ? target : pc + 4;
+    }
+  } break;
+  case OPCODE_J: {
+    spmd_advance_pc(spmd, pc + 4 + GET_JUMP_OFFSET(inst));
+  } break;
+  case OPCODE_ADD: {
+    SPMD_BINARY_OP(lhs + rhs, FLAGS_NZ(result) | FLAG_IF((result < lhs) | (result < rhs), CONDFLAG_C | CONDFLAG_V));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_SUB: {
+    SPMD_BINARY_OP(lhs - rhs, FLAGS_NZ(result) | FLAG_IF((result < lhs) | (result < rhs), CONDFLAG_C) |
+                                  FLAG_IF((result > lhs) | (result > rhs), CONDFLAG_V));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_MUL: {
+    SPMD_BINARY_OP(lhs * rhs, FLAGS_NZ(result) | FLAG_IF((result < lhs) | (result < rhs), CONDFLAG_V));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_AND: {
+    SPMD_BINARY_OP(lhs & rhs, FLAGS_NZ(result));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_OR: {
+    SPMD_BINARY_OP(lhs | rhs, FLAG_IF((i64)result < 0, CONDFLAG_N));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  case OPCODE_XOR: {
+    SPMD_BINARY_OP(lhs ^ rhs, FLAGS_NZ(result));
+    spmd_advance_pc(spmd, pc + 4);
+  } break;
+  default:
+    spmd_step_scalar(spmd, pc);
+  }
+  return true;
+}
+
+void spmd_run(SpmdMachine *spmd) {
+  while (spmd_step(spmd))
+    ;
+}
+
+i32 spmd_main(const char *program_path, char **input_paths, u32 n_inputs) {
+  if (n_inputs == 0) {
+    panic_printf("Expect at least one input file for SPMD mode\n");
+  }
+  FILE *file = fopen(program_path, "rb");
+  if (file == NULL) {
+    panic_printf("Path %s doesn't exist\n", program_path);
+  }
+  ProgramImage image;
+  ProgramLoadResult load_result = load_program_image_from_file(&image, file);
+  fclose(file);
+  if (load_result != ProgramLoadOk) {
+    panic_printf("Program load error: %s\n", program_load_result_name(load_result));
+  }
+  SpmdMachine *spmd = spmd_new(&image, n_inputs, MACHINE_NOT_SILENT);
+  program_image_free(&image);
+
+  FILE **inputs = xalloc(FILE *, n_inputs);
+  char **stdout_bufs = xalloc(char *, n_inputs);
+  usize *stdout_lens = xalloc(usize, n_inputs);
+  char **stderr_bufs = xalloc(char *, n_inputs);
+  usize *stderr_lens = xalloc(usize, n_inputs);
+  FILE **outputs = xalloc(FILE *, n_inputs);
+  FILE **errors = xalloc(FILE *, n_inputs);
+  for (u32 lane = 0; lane < n_inputs; ++lane) {
+    inputs[lane] = fopen(input_paths[lane], "rb");
+    if (inputs[lane] == NULL) {
+      panic_printf("Input path %s doesn't exist\n", input_paths[lane]);
+    }
+    outputs[lane] = open_memstream(&stdout_bufs[lane], &stdout_lens[lane]);
+    errors[lane] = open_memstream(&stderr_bufs[lane], &stderr_lens[lane]);
+    if (outputs[lane] == NULL || errors[lane] == NULL)
+      alloc_fail_handler();
+    spmd_set_lane_io(spmd, lane, inputs[lane], outputs[lane], errors[lane]);
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  spmd_run(spmd);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  f64 elapsed = (f64)(end.tv_sec - start.tv_sec) + (f64)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+  u32 n_failed = 0;
+  for (u32 lane = 0; lane < n_inputs; ++lane) {
+    fclose(inputs[lane]);
+    fclose(outputs[lane]);
+    fclose(errors[lane]);
+    i32 exit_code = spmd_lane_exit_code(spmd, lane);
+    if (exit_code != 0)
+      ++n_failed;
+    if (exit_code == MACHINE_EXIT_FAULT)
+      printf("--- lane %u: %s (fault)\n", lane, input_paths[lane]);
+    else
+      printf("--- lane %u: %s (exit code %d)\n", lane, input_paths[lane], exit_code);
+    fwrite(stdout_bufs[lane], 1, stdout_lens[lane], stdout);
+    if (stderr_lens[lane] != 0) {
+      fprintf(stderr, "--- lane %u: %s (stderr)\n", lane, input_paths[lane]);
+      fwrite(stderr_bufs[lane], 1, stderr_lens[lane], stderr);
+    }
+    free(stdout_bufs[lane]);
+    free(stderr_bufs[lane]);
+  }
+  fflush(stdout);
+  fprintf(stderr, "--- %u lanes (%u failed) in %.3lfs\n", n_inputs, n_failed, elapsed);
+
+  spmd_free(spmd);
+  xfree(inputs);
+  xfree(outputs);
+  xfree(errors);
+  xfree(stdout_bufs);
+  xfree(stdout_lens);
+  xfree(stderr_bufs);
+  xfree(stderr_lens);
+  return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "common.h"
+#include "fileformat.h"
+
+/// Runs many instances ("lanes") of one program in lockstep.
+///
+/// Registers are stored as struct-of-arrays, so that the handlers of common qword instructions process all lanes in
+/// branch-free loops the host compiler can vectorize.
+/// Each step executes one instruction for all the running lanes whose `pc` is the lowest, so lanes that diverged on a
+/// branch are masked off and reconverge once their `pc`s meet again.
+/// Other instructions (including `libc_call`) are serviced for all the lanes of the step in a batch, by running them
+/// one lane at a time on a scalar machine.
+///
+/// Every lane has its own stack and data segment, the text segment is shared between all lanes.
+typedef struct SpmdMachine SpmdMachine;
+
+SpmdMachine *spmd_new(const ProgramImage *image, u32 n_lanes, bool config_silent);
+
+void spmd_free(SpmdMachine *spmd);
+
+u64 *spmd_lane_reg(SpmdMachine *spmd, u32 lane, u8 reg_code);
+
+/// Streams used by the lane in place of stdin/stdout/stderr, see `Machine::io_stdin`.
+void spmd_set_lane_io(SpmdMachine *spmd, u32 lane, FILE *io_stdin, FILE *io_stdout, FILE *io_stderr);
+
+/// Exit code of the lane, `MACHINE_EXIT_FAULT` if it stopped on a fault.
+i32 spmd_lane_exit_code(const SpmdMachine *spmd, u32 lane);
+
+/// Run until all lanes have stopped.
+void spmd_run(SpmdMachine *spmd);
+
+/// Run the program with one lane per input file (used as stdin of the lane).
+/// The stdout, stderr and exit code of every lane are reported in lane order.
+/// Returns `0` if all lanes exited with code `0`, `1` otherwise.
+i32 spmd_main(const char *program_path, char **input_paths, u32 n_inputs);
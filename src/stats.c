@@ -0,0 +1,112 @@
+#include "common.h"
+#include "values.h"
+
+typedef struct Stats {
+  /// Indexed by the first byte of instructions (opcode and oplen).
+  u64 inst_counts[256];
+  /// Indexed by pc.
+  u64 pc_counts[VMEM_SEG_SIZE];
+  /// Number of times the conditional branch is taken, indexed by pc.
+  u64 taken_counts[VMEM_SEG_SIZE];
+  /// Indexed by the pc of call targets.
+  u64 call_counts[VMEM_SEG_SIZE];
+} Stats;
+
+/// Stats of the machine running on this thread.
+static _Thread_local Stats *stats;
+
+#define MACHINE_COUNT_INSTS 1
+#define MACHINE_HOOK_INST(MACHINE, INST) (++stats->inst_counts[(INST)[0]], ++stats->pc_counts[(MACHINE)->pc])
+#define MACHINE_HOOK_BRANCH(MACHINE, PC, TAKEN) (stats->taken_counts[PC] += (TAKEN))
+#define MACHINE_HOOK_CALL(MACHINE) (++stats->call_counts[(MACHINE)->pc])
+
+#include "disasm.h"
+#include "report.h"
+#include "stats.h"
+
+static bool is_conditional_branch(u8 inst0) {
+  u8 opcode = inst0 & 0b11111100;
+  return opcode == OPCODE_B || opcode == OPCODE_CCALL || opcode == OPCODE_LOOP;
+}
+
+static void print_listing(const Machine *machine, u64 n_insts, FILE *report) {
+  const u8 *text = machine->vmem_text;
+  u32 end = 0;
+  for (u32 pc = 0; pc < VMEM_SEG_SIZE; ++pc) {
+    if (stats->pc_counts[pc] != 0)
+      end = pc + 4;
+  }
+  fprintf(report, "%-9s %14s %8s %8s  %s\n", "address", "count", "share", "taken", "instruction");
+  char buf[128];
+  u32 pc = 0;
+  while (pc < end) {
+    u32 len = disasm(text, (u16)pc, buf, sizeof(buf));
+    // Resynchronize on the next executed instruction if the linear sweep runs into data.
+    u32 next = pc + 1;
+    for (; next < pc + (len == 0 ? 4 : len) && next < end; ++next) {
+      if (stats->pc_counts[next] != 0)
+        break;
+    }
+    if (len == 0 || next < pc + len) {
+      if (stats->pc_counts[pc] == 0) {
+        fprintf(report, "0x1%04X   ...\n", pc);
+        while (next < end && stats->pc_counts[next] == 0)
+          ++next;
+        pc = next;
+        continue;
+      }
+    }
+    u64 count = stats->pc_counts[pc];
+    if (count == 0)
+      fprintf(report, "0x1%04X   %14s %8s", pc, "", "");
+    else
+      fprintf(report, "0x1%04X   %14llu %7.2f%%", pc, count, report_percentage(count, n_insts));
+    if (is_conditional_branch(text[pc]) && count != 0)
+      fprintf(report, " %7.2f%%", report_percentage(stats->taken_counts[pc], count));
+    else
+      fprintf(report, " %8s", "");
+    fprintf(report, "  %s\n", buf);
+    pc = len == 0 ? next : pc + len;
+  }
+}
+
+static void print_report(const Machine *machine, FILE *report) {
+  u64 n_insts = 0;
+  for (u32 i = 0; i < 256; ++i)
+    n_insts += stats->inst_counts[i];
+  fprintf(report, "=== %llu instructions executed\n", n_insts);
+
+  fprintf(report, "\n--- by instruction\n");
+  fprintf(report, "%-16s %14s %8s\n", "instruction", "count", "share");
+  u32 len;
+  u32 *indices = report_sorted_nonzero(stats->inst_counts, 256, &len);
+  for (u32 i = 0; i < len; ++i) {
+    u8 inst0 = (u8)indices[i];
+    char label[32];
+    disasm_label(inst0, label, sizeof(label));
+    u64 count = stats->inst_counts[inst0];
+    fprintf(report, "%-16s %14llu %7.2f%%\n", label, count, report_percentage(count, n_insts));
+  }
+  xfree(indices);
+
+  indices = report_sorted_nonzero(stats->call_counts, VMEM_SEG_SIZE, &len);
+  if (len != 0) {
+    fprintf(report, "\n--- by call target\n");
+    fprintf(report, "%-16s %14s\n", "target", "calls");
+    for (u32 i = 0; i < len; ++i)
+      fprintf(report, "0x1%04X          %14llu\n", indices[i], stats->call_counts[indices[i]]);
+  }
+  xfree(indices);
+
+  fprintf(report, "\n--- listing\n");
+  print_listing(machine, n_insts, report);
+}
+
+void stats_run(Machine *machine, FILE *report) {
+  stats = xalloc(Stats, 1);
+  memset(stats, 0, sizeof(Stats));
+  machine_run(machine);
+  print_report(machine, report);
+  xfree(stats);
+  stats = NULL;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "machine.h"
+
+/// Run the machine with a separately compiled variant of the interpreter, which counts the executed instructions per
+/// opcode and oplen, per text address, per conditional branch (taken or not) and per call target.
+/// After the machine stops, print a report to `report`, with a listing of the text segment annotated with the share of
+/// execution of each instruction.
+void stats_run(Machine *machine, FILE *report);
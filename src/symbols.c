@@ -0,0 +1,66 @@
+#include "symbols.h"
+#include "values.h"
+
+static int compare_symbols(const void *lhs, const void *rhs) {
+  return (int)((const Symbol *)lhs)->addr - (int)((const Symbol *)rhs)->addr;
+}
+
+Symbols symbols_load(const char *path) {
+  Symbols symbols = {0};
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    panic_printf("Path %s doesn't exist\n", path);
+  u32 cap = 0;
+  char line[512];
+  char name[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#')
+      continue;
+    char *end;
+    u64 addr = strtoull(line, &end, 0);
+    if (end == line)
+      continue;
+    if (sscanf(end, "%255s", name) != 1)
+      panic_printf("Expect a name after address 0x%llX in symbol map %s\n", addr, path);
+    if ((addr & ~(u64)0xFFFF) == 0x10000)
+      addr &= 0xFFFF;
+    else if (addr >= VMEM_SEG_SIZE)
+      continue;
+    if (symbols.len == cap) {
+      cap = cap == 0 ? 64 : cap * 2;
+      symbols.symbols = xrealloc(symbols.symbols, Symbol, cap);
+    }
+    symbols.symbols[symbols.len++] = (Symbol){(u16)addr, strdup(name)};
+  }
+  fclose(file);
+  qsort(symbols.symbols, symbols.len, sizeof(Symbol), compare_symbols);
+  return symbols;
+}
+
+void symbols_free(Symbols *symbols) {
+  for (u32 i = 0; i < symbols->len; ++i)
+    xfree(symbols->symbols[i].name);
+  xfree(symbols->symbols);
+}
+
+const Symbol *symbols_lookup(const Symbols *symbols, u16 addr) {
+  u32 lo = 0, hi = symbols->len;
+  while (lo < hi) {
+    u32 mid = (lo + hi) / 2;
+    if (symbols->symbols[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo == 0 ? NULL : &symbols->symbols[lo - 1];
+}
+
+void symbols_name(const Symbols *symbols, u16 addr, bool with_offset, char *buf, usize buf_len) {
+  const Symbol *symbol = symbols_lookup(symbols, addr);
+  if (symbol == NULL)
+    snprintf(buf, buf_len, "0x1%04X", addr);
+  else if (with_offset)
+    snprintf(buf, buf_len, "%s+0x%X", symbol->name, addr - symbol->addr);
+  else
+    snprintf(buf, buf_len, "%s", symbol->name);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+
+/// A named address in the text segment.
+typedef struct Symbol {
+  /// Offset into the text segment.
+  u16 addr;
+  char *name;
+} Symbol;
+
+/// Symbol map of a program, for naming functions in profiles and traces.
+typedef struct Symbols {
+  /// Sorted by address.
+  Symbol *symbols;
+  u32 len;
+} Symbols;
+
+/// Load a symbol map of `ADDRESS NAME` lines, addresses may be in the text segment (`0x1XXXX`) or offsets into it.
+/// Empty lines, lines starting with `#` and symbols outside of the text segment are ignored.
+Symbols symbols_load(const char *path);
+
+void symbols_free(Symbols *symbols);
+
+/// The symbol with the greatest address not after `addr`, `NULL` if there is none.
+const Symbol *symbols_lookup(const Symbols *symbols, u16 addr);
+
+/// Print the name of the function on `addr` into `buf`, being the name of the symbol containing it, or the address
+/// (`0x1XXXX`) if there is none.
+/// If `with_offset` is true, the offset from the symbol is also printed (e.g. `fib+0x1C`).
+void symbols_name(const Symbols *symbols, u16 addr, bool with_offset, char *buf, usize buf_len);
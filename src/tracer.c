@@ -0,0 +1,273 @@
+#include "common.h"
+#include "perf.h"
+#include "values.h"
+
+typedef struct machine Machine;
+
+typedef enum TraceEventKind {
+  TRACE_CALL,
+  TRACE_RET,
+  TRACE_LIBC_ENTER,
+  TRACE_LIBC_EXIT,
+} TraceEventKind;
+
+typedef struct TraceEvent {
+  u64 ns;
+  /// `pc` after the event, being the call target, the return address, or the instruction after `libc_call`.
+  u16 pc;
+  /// `sp` after the event.
+  u16 sp;
+  /// Return address on the top of the stack after a call (which is the caller's for `tcall`).
+  u16 ret;
+  u8 kind;
+  u8 callcode;
+} TraceEvent;
+
+typedef struct Tracer {
+  TraceEvent *events;
+  u32 len;
+  u32 cap;
+} Tracer;
+
+/// Tracer of the machine running on this thread.
+static _Thread_local Tracer *tracer;
+
+static void tracer_record(Machine *machine, TraceEventKind kind, u8 callcode);
+
+#define MACHINE_HOOK_CALL(MACHINE) tracer_record(MACHINE, TRACE_CALL, 0)
+#define MACHINE_HOOK_RET(MACHINE) tracer_record(MACHINE, TRACE_RET, 0)
+#define MACHINE_HOOK_LIBC_ENTER(MACHINE, CALLCODE) tracer_record(MACHINE, TRACE_LIBC_ENTER, CALLCODE)
+#define MACHINE_HOOK_LIBC_EXIT(MACHINE, CALLCODE) tracer_record(MACHINE, TRACE_LIBC_EXIT, CALLCODE)
+
+#include "disasm.h"
+#include "tracer.h"
+
+attribute(noinline) static void tracer_record(Machine *machine, TraceEventKind kind, u8 callcode) {
+  Tracer *t = tracer;
+  if (t->len == t->cap)
+    return;
+  TraceEvent *event = &t->events[t->len++];
+  event->ns = monotonic_ns();
+  event->pc = machine->pc;
+  event->sp = (u16)machine->reg_sp;
+  event->ret = 0;
+  if (kind == TRACE_CALL && machine->reg_sp >= 2)
+    memcpy(&event->ret, &machine->vmem_stack[machine->reg_sp - 2], 2);
+  event->kind = (u8)kind;
+  event->callcode = callcode;
+}
+
+/// A function (or libc call) that has been entered but not returned from yet.
+typedef struct OpenFrame {
+  /// `sp` right after the return address was pushed.
+  u16 sp;
+  /// Entry of the function, or the callcode of the libc call.
+  u16 target;
+  /// Address of the call instruction.
+  u16 site;
+  bool is_libc;
+  /// Whether the frame has a call site (the root frame and frames tail-called from it don't).
+  bool has_site;
+  u64 start;
+  /// Total time spent in the callees.
+  u64 child_ns;
+} OpenFrame;
+
+/// Timings of the calls from a call site to a callee.
+typedef struct SiteStats {
+  u16 site;
+  u16 target;
+  bool is_libc;
+  bool has_site;
+  u64 calls;
+  u64 inclusive_ns;
+  u64 exclusive_ns;
+  u64 max_ns;
+} SiteStats;
+
+typedef struct TraceWriter {
+  const Symbols *symbols;
+  FILE *output;
+  u64 start_ns;
+  /// Whether any trace event is written, for the separating commas.
+  bool has_written;
+  /// Every call pushes a 2-byte return address, plus the root frame and a libc call.
+  OpenFrame frames[VMEM_SEG_SIZE / 2 + 2];
+  u32 depth;
+  SiteStats *sites;
+  u32 sites_len;
+  u32 sites_cap;
+} TraceWriter;
+
+static SiteStats *site_stats_get(TraceWriter *w, const OpenFrame *frame) {
+  for (u32 i = 0; i < w->sites_len; ++i) {
+    SiteStats *stats = &w->sites[i];
+    if (stats->site == frame->site && stats->target == frame->target && stats->is_libc == frame->is_libc &&
+        stats->has_site == frame->has_site)
+      return stats;
+  }
+  if (w->sites_len == w->sites_cap) {
+    w->sites_cap = w->sites_cap == 0 ? 64 : w->sites_cap * 2;
+    w->sites = xrealloc(w->sites, SiteStats, w->sites_cap);
+  }
+  SiteStats *stats = &w->sites[w->sites_len++];
+  *stats = (SiteStats){frame->site, frame->target, frame->is_libc, frame->has_site, 0, 0, 0, 0};
+  return stats;
+}
+
+static void frame_name(const TraceWriter *w, const OpenFrame *frame, char *buf, usize buf_len) {
+  const char *libc_name;
+  if (!frame->is_libc)
+    symbols_name(w->symbols, frame->target, false, buf, buf_len);
+  else if ((libc_name = disasm_libc_name((u8)frame->target)) != NULL)
+    snprintf(buf, buf_len, "libc %s", libc_name);
+  else
+    snprintf(buf, buf_len, "libc %u", frame->target);
+}
+
+static void site_name(const TraceWriter *w, const OpenFrame *frame, char *buf, usize buf_len) {
+  if (frame->has_site)
+    symbols_name(w->symbols, frame->site, true, buf, buf_len);
+  else
+    snprintf(buf, buf_len, "-");
+}
+
+static void open_frame(TraceWriter *w, OpenFrame frame) {
+  w->frames[w->depth++] = frame;
+}
+
+/// Write `str` as a JSON string, quoted and escaped (symbol names are arbitrary text of the symbol file).
+static void write_json_string(FILE *output, const char *str) {
+  fputc('"', output);
+  for (; *str != '\0'; ++str) {
+    u8 c = (u8)*str;
+    if (c == '"' || c == '\\')
+      fprintf(output, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(output, "\\u%04x", c);
+    else
+      fputc(c, output);
+  }
+  fputc('"', output);
+}
+
+/// Close the innermost frame at `end`, writing it as a complete event.
+static void close_frame(TraceWriter *w, u64 end) {
+  OpenFrame *frame = &w->frames[--w->depth];
+  u64 duration = end - frame->start;
+  if (w->depth != 0)
+    w->frames[w->depth - 1].child_ns += duration;
+  SiteStats *stats = site_stats_get(w, frame);
+  ++stats->calls;
+  stats->inclusive_ns += duration;
+  stats->exclusive_ns += duration - frame->child_ns;
+  if (duration > stats->max_ns)
+    stats->max_ns = duration;
+
+  char name[256], site[256];
+  frame_name(w, frame, name, sizeof(name));
+  site_name(w, frame, site, sizeof(site));
+  u64 ts = frame->start - w->start_ns;
+  fprintf(w->output, "%s\n{\"name\":", w->has_written ? "," : "");
+  write_json_string(w->output, name);
+  fprintf(w->output,
+          ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":1,\"tid\":1,\"args\":{\"site\":",
+          frame->is_libc ? "libc" : "call", ts / 1000, ts % 1000, duration / 1000, duration % 1000);
+  write_json_string(w->output, site);
+  fprintf(w->output, "}}");
+  w->has_written = true;
+}
+
+/// Close the frames that have returned, judging by `sp`.
+static void unwind(TraceWriter *w, u16 sp, u64 end) {
+  while (w->depth > 1 && w->frames[w->depth - 1].sp > sp)
+    close_frame(w, end);
+}
+
+static void replay_event(TraceWriter *w, const TraceEvent *event) {
+  switch (event->kind) {
+  case TRACE_CALL: {
+    unwind(w, event->sp, event->ns);
+    OpenFrame *top = &w->frames[w->depth - 1];
+    if (top->sp == event->sp) {
+      // `tcall` pushes no return address, the callee replaces the frame of the caller and inherits its call site.
+      OpenFrame frame = {top->sp, event->pc, top->site, false, top->has_site, event->ns, 0};
+      close_frame(w, event->ns);
+      open_frame(w, frame);
+    } else {
+      open_frame(w, (OpenFrame){event->sp, event->pc, (u16)(event->ret - 4), false, true, event->ns, 0});
+    }
+  } break;
+  case TRACE_RET:
+    unwind(w, event->sp, event->ns);
+    break;
+  case TRACE_LIBC_ENTER:
+    open_frame(w, (OpenFrame){event->sp, event->callcode, (u16)(event->pc - 4), true, true, event->ns, 0});
+    break;
+  case TRACE_LIBC_EXIT:
+    if (w->frames[w->depth - 1].is_libc)
+      close_frame(w, event->ns);
+    break;
+  }
+}
+
+static int compare_sites(const void *lhs, const void *rhs) {
+  u64 a = ((const SiteStats *)lhs)->inclusive_ns;
+  u64 b = ((const SiteStats *)rhs)->inclusive_ns;
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static void print_report(TraceWriter *w, FILE *report) {
+  qsort(w->sites, w->sites_len, sizeof(SiteStats), compare_sites);
+  fprintf(report, "\n--- by call site\n");
+  fprintf(report, "%-24s %-24s %10s %14s %14s %12s %12s\n", "site", "callee", "calls", "inclusive ns",
+          "exclusive ns", "avg ns", "max ns");
+  for (u32 i = 0; i < w->sites_len; ++i) {
+    const SiteStats *stats = &w->sites[i];
+    OpenFrame frame = {.site = stats->site, .target = stats->target, .is_libc = stats->is_libc,
+                       .has_site = stats->has_site};
+    char name[256], site[256];
+    frame_name(w, &frame, name, sizeof(name));
+    site_name(w, &frame, site, sizeof(site));
+    fprintf(report, "%-24s %-24s %10llu %14llu %14llu %12llu %12llu\n", site, name, stats->calls,
+            stats->inclusive_ns, stats->exclusive_ns, stats->inclusive_ns / stats->calls, stats->max_ns);
+  }
+}
+
+void tracer_run(Machine *machine, u32 capacity, const Symbols *symbols, FILE *output, FILE *report) {
+  Tracer t = {xalloc(TraceEvent, capacity), 0, capacity};
+  // Touch the buffer up front, so that page faults don't skew the timings.
+  memset(t.events, 0, sizeof(TraceEvent) * capacity);
+  tracer = &t;
+  u16 entry = machine->pc;
+  u64 start_ns = monotonic_ns();
+  machine_run(machine);
+  u64 end_ns = monotonic_ns();
+  tracer = NULL;
+
+  TraceWriter *w = xalloc(TraceWriter, 1);
+  memset(w, 0, sizeof(TraceWriter));
+  w->symbols = symbols;
+  w->output = output;
+  w->start_ns = start_ns;
+  open_frame(w, (OpenFrame){0, entry, 0, false, false, start_ns, 0});
+  fprintf(output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (u32 i = 0; i < t.len; ++i)
+    replay_event(w, &t.events[i]);
+  // The frames still open when the buffer filled up are closed at the last event, the rest of the run is not traced.
+  bool full = t.len == t.cap;
+  if (full && t.len != 0)
+    end_ns = t.events[t.len - 1].ns;
+  while (w->depth != 0)
+    close_frame(w, end_ns);
+  fprintf(output, "\n]}\n");
+
+  fprintf(report, "=== %u call events traced in %llu ns\n", t.len, end_ns - start_ns);
+  if (full)
+    fprintf(report, "Trace buffer of %u events is full, the rest of the run is not traced\n", t.cap);
+  print_report(w, report);
+
+  xfree(w->sites);
+  xfree(w);
+  xfree(t.events);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "machine.h"
+#include "symbols.h"
+
+/// Run the machine with a separately compiled variant of the interpreter, which records a timestamped event on every
+/// call, return and libc call into a preallocated buffer of `capacity` events (the rest of the run is not traced once
+/// it is full).
+/// After the machine stops, the calls are written to `output` as Chrome trace-event JSON (loadable by Perfetto and
+/// `chrome://tracing`), and the inclusive and exclusive time per call site is reported to `report`.
+void tracer_run(Machine *machine, u32 capacity, const Symbols *symbols, FILE *output, FILE *report);
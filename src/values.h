@@ -48,6 +48,9 @@
 #define LIBC_strcpy     20
 #define LIBC_strcat     21
 #define LIBC_strcmp     22
+#define LIBC_chan_send  23
+#define LIBC_chan_recv  24
+#define LIBC_chan_close 25
 
 #define CONDFLAG_N     0b00000001
 #define CONDFLAG_Z     0b00000010
@@ -117,4 +120,83 @@
 #define OPCODE_LIBC_CALL   OPCODE(44)
 #define OPCODE_NATIVE_CALL OPCODE(45)
 #define OPCODE_VTOREAL     OPCODE(46)
+#define OPCODE_CVT         OPCODE(47)  // CONVERSION & FLOATING POINT MATH
+#define OPCODE_FMATH       OPCODE(48)
+#define OPCODE_ALUI        OPCODE(49)  // IMMEDIATE ARITHMETICS & LOOPS
+#define OPCODE_LOOP        OPCODE(50)
+#define OPCODE_JR          OPCODE(51)  // INDIRECT BRANCHES & TAIL CALLS
+#define OPCODE_JTAB        OPCODE(52)
+#define OPCODE_TCALL       OPCODE(53)
+#define OPCODE_PUSHM       OPCODE(54)  // MULTI-REGISTER PUSH & POP
+#define OPCODE_POPM        OPCODE(55)
+#define OPCODE_LDSP        OPCODE(56)  // SP-RELATIVE LOAD & STORE
+#define OPCODE_STSP        OPCODE(57)
+#define OPCODE_LOAD_IDX    OPCODE(58)  // SCALED-INDEX LOAD & STORE
+#define OPCODE_STORE_IDX   OPCODE(59)
+#define OPCODE_BITOP       OPCODE(60)  // BIT MANIPULATION & WIDE MULTIPLY
+#define OPCODE_PERF        OPCODE(61)  // PERFORMANCE COUNTERS
 #define OPCODE_BREAKPOINT  0b11111100
+
+// Flags of load/store instructions, in the form of `[-:4][signed:1][scale:2][vmem:1]`.
+// `scale` is only used by `load_idx` and `store_idx`, `signed` is only used by loads.
+#define MEMFLAG_VMEM   0b00000001
+#define MEMFLAG_SIGNED 0b00001000
+#define MEMFLAG_SCALE(FLAGS) (((FLAGS) >> 1) & 0b11)
+
+// Width of the immediate of big instructions, in bits 4~5 of their `flags`.
+// The immediate is zero-extended to 64 bits, or sign-extended if `IMMFLAG_SIGNED` is set.
+#define IMMFLAG_64     0b00000000
+#define IMMFLAG_16     0b00010000
+#define IMMFLAG_32     0b00100000
+#define IMMFLAG_8      0b00110000
+#define IMMFLAG_WIDTH  0b00110000
+#define IMMFLAG_SIGNED 0b01000000
+
+// Types of `cvt`, whose `flags` is in the form of `[-:4][from:2][to:2]`.
+#define CVT_U64 0b00
+#define CVT_I64 0b01
+#define CVT_F32 0b10
+#define CVT_F64 0b11
+#define CVT(FROM, TO) (((FROM) << 2) | (TO))
+
+// Operations of `fmath`.
+#define FMATH_SQRT  0
+#define FMATH_ABS   1
+#define FMATH_FLOOR 2
+#define FMATH_CEIL  3
+#define FMATH_TRUNC 4
+#define FMATH_ROUND 5
+#define FMATH_MIN   6
+#define FMATH_MAX   7
+#define FMATH_FMA   8
+
+// Operations of `bitop`.
+#define BITOP_POPCNT 0
+#define BITOP_CLZ    1
+#define BITOP_CTZ    2
+#define BITOP_BSWAP  3
+#define BITOP_ROL    4
+#define BITOP_ROR    5
+#define BITOP_MULHI  6
+#define BITOP_IMULHI 7
+#define BITOP_CRC32C 8
+
+// Operations of `perf`.
+#define PERF_INSTRET 0
+#define PERF_CLOCK   1
+#define PERF_MARK    2
+#define PERF_ZONE_BEGIN 3
+#define PERF_ZONE_END   4
+
+// Operations of `alui`, in the upper 4 bits of the second byte.
+#define ALUI_ADD 0
+#define ALUI_SUB 1
+#define ALUI_AND 2
+#define ALUI_OR  3
+#define ALUI_XOR 4
+#define ALUI_SHL 5
+#define ALUI_SHR 6
+#define ALUI_CMP 7
+
+// Flags of `jr`, set for `callr`.
+#define JR_CALL 0b00000001
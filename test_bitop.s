@@ -0,0 +1,203 @@
+; Edge cases of `bitop`: counting the bits of 0, rotating by 0 and by the full width, and the upper halves of the widest
+; products of dwords and qwords.
+;
+; Prints a line per check and exits with 0, expected output:
+;	clz q 0 -> 40
+;	clz d 0 -> 20
+;	clz w 0 -> 10
+;	clz b 0 -> 8
+;	ctz q 0 -> 40
+;	ctz d 0 -> 20
+;	ctz w 0 -> 10
+;	ctz b 0 -> 8
+;	clz q 1 -> 3F
+;	ctz q 8000000000000000 -> 3F
+;	clz d 123456789ABCDEF -> 0
+;	popcnt q FFFFFFFFFFFFFFFF -> 40
+;	rol q 0 -> 123456789ABCDEF
+;	ror q 0 -> 123456789ABCDEF
+;	rol q 40 -> 123456789ABCDEF
+;	rol d 0 -> 89ABCDEF
+;	ror b 8 -> EF
+;	rol q 1 -> 3
+;	ror w 4 -> 8001
+;	mulhi q FFFFFFFFFFFFFFFF -> FFFFFFFFFFFFFFFE
+;	mulhi d FFFFFFFF -> FFFFFFFE
+;	mulhi q 100000000 -> 1
+;	mulhi d 10000 -> 1
+;	imulhi q FFFFFFFFFFFFFFFF -> FFFFFFFFFFFFFFFF
+;	imulhi d FFFFFFFE -> FFFFFFFF
+;	imulhi q 8000000000000000 -> 4000000000000000
+
+segment data
+	FMT:
+	bytes "%s %llX -> %llX\n\0"
+	CLZ_Q:
+	bytes "clz q\0"
+	CLZ_D:
+	bytes "clz d\0"
+	CLZ_W:
+	bytes "clz w\0"
+	CLZ_B:
+	bytes "clz b\0"
+	CTZ_Q:
+	bytes "ctz q\0"
+	CTZ_D:
+	bytes "ctz d\0"
+	CTZ_W:
+	bytes "ctz w\0"
+	CTZ_B:
+	bytes "ctz b\0"
+	POPCNT_Q:
+	bytes "popcnt q\0"
+	ROL_Q:
+	bytes "rol q\0"
+	ROR_Q:
+	bytes "ror q\0"
+	ROL_D:
+	bytes "rol d\0"
+	ROR_W:
+	bytes "ror w\0"
+	ROR_B:
+	bytes "ror b\0"
+	MULHI_Q:
+	bytes "mulhi q\0"
+	MULHI_D:
+	bytes "mulhi d\0"
+	IMULHI_Q:
+	bytes "imulhi q\0"
+	IMULHI_D:
+	bytes "imulhi d\0"
+
+segment text
+	; counting the bits of 0 gives the width of the oplen
+	load_imm	q r6, 0
+	bitop		q r7, r6, clz
+	load_imm	q r0, CLZ_Q
+	call		_show
+	bitop		d r7, r6, clz
+	load_imm	q r0, CLZ_D
+	call		_show
+	bitop		w r7, r6, clz
+	load_imm	q r0, CLZ_W
+	call		_show
+	bitop		b r7, r6, clz
+	load_imm	q r0, CLZ_B
+	call		_show
+	bitop		q r7, r6, ctz
+	load_imm	q r0, CTZ_Q
+	call		_show
+	bitop		d r7, r6, ctz
+	load_imm	q r0, CTZ_D
+	call		_show
+	bitop		w r7, r6, ctz
+	load_imm	q r0, CTZ_W
+	call		_show
+	bitop		b r7, r6, ctz
+	load_imm	q r0, CTZ_B
+	call		_show
+	load_imm	q r6, 1
+	bitop		q r7, r6, clz
+	load_imm	q r0, CLZ_Q
+	call		_show
+	load_imm	q r6, 0x8000000000000000
+	bitop		q r7, r6, ctz
+	load_imm	q r0, CTZ_Q
+	call		_show
+	load_imm	q r6, 0x0123456789ABCDEF
+	bitop		d r7, r6, clz			; of 0x89ABCDEF
+	load_imm	q r0, CLZ_D
+	call		_show
+	load_imm	q r6, -1
+	bitop		q r7, r6, popcnt
+	load_imm	q r0, POPCNT_Q
+	call		_show
+
+	; rotating by 0 or by the width leaves the value unchanged
+	load_imm	q r6, 0x0123456789ABCDEF
+	load_imm	q r8, 0
+	bitop		q r7, r6, r8, rol
+	load_imm	q r0, ROL_Q
+	call		_show_rhs
+	bitop		q r7, r6, r8, ror
+	load_imm	q r0, ROR_Q
+	call		_show_rhs
+	load_imm	q r8, 64
+	bitop		q r7, r6, r8, rol
+	load_imm	q r0, ROL_Q
+	call		_show_rhs
+	load_imm	q r8, 0
+	bitop		d r7, r6, r8, rol		; truncated to the oplen
+	load_imm	q r0, ROL_D
+	call		_show_rhs
+	load_imm	q r8, 8
+	bitop		b r7, r6, r8, ror
+	load_imm	q r0, ROR_B
+	call		_show_rhs
+	load_imm	q r6, 0x8000000000000001
+	load_imm	q r8, 1
+	bitop		q r7, r6, r8, rol
+	load_imm	q r0, ROL_Q
+	call		_show_rhs
+	load_imm	q r6, 0x0018
+	load_imm	q r8, 4
+	bitop		w r7, r6, r8, ror
+	load_imm	q r0, ROR_W
+	call		_show_rhs
+
+	; upper halves of the widest products
+	load_imm	q r6, -1
+	mov		q r8, r6
+	bitop		q r7, r6, r8, mulhi
+	load_imm	q r0, MULHI_Q
+	call		_show_rhs
+	load_imm	q r6, 0xFFFFFFFF
+	mov		q r8, r6
+	bitop		d r7, r6, r8, mulhi
+	load_imm	q r0, MULHI_D
+	call		_show_rhs
+	load_imm	q r6, 0x100000000
+	mov		q r8, r6
+	bitop		q r7, r6, r8, mulhi
+	load_imm	q r0, MULHI_Q
+	call		_show_rhs
+	load_imm	q r6, 0x10000
+	mov		q r8, r6
+	bitop		d r7, r6, r8, mulhi
+	load_imm	q r0, MULHI_D
+	call		_show_rhs
+	load_imm	q r6, 1
+	load_imm	q r8, -1
+	bitop		q r7, r6, r8, imulhi		; -1 * 1
+	load_imm	q r0, IMULHI_Q
+	call		_show_rhs
+	load_imm	q r6, 3
+	load_imm	q r8, 0xFFFFFFFE
+	bitop		d r7, r6, r8, imulhi		; -2 * 3
+	load_imm	q r0, IMULHI_D
+	call		_show_rhs
+	load_imm	q r6, 0x8000000000000000
+	mov		q r8, r6
+	bitop		q r7, r6, r8, imulhi		; -2^63 * -2^63
+	load_imm	q r0, IMULHI_Q
+	call		_show_rhs
+
+	load_imm	q r0, 0
+	libc_call	exit
+
+	; printf(FMT, r0, r8, r7), with r0 being a vmem address
+	_show_rhs:
+	mov		q r2, r8
+	j		_print
+
+	; printf(FMT, r0, r6, r7), with r0 being a vmem address
+	_show:
+	mov		q r2, r6
+	_print:
+	vtoreal		r0, r0
+	mov		q r1, r0
+	load_imm	q r0, FMT
+	vtoreal		r0, r0
+	mov		q r3, r7
+	libc_call	printf
+	ret
@@ -0,0 +1,179 @@
+; Immediates of big instructions, encoded in the narrowest width that holds them, zero-extended or sign-extended.
+; Also the 16-bit sign-extended immediates of `alui`.
+;
+; Prints a line per check and exits with 0, expected output:
+;	u8 FF
+;	i8 FFFFFFFFFFFFFF80
+;	u16 FFFF
+;	i16 FFFFFFFFFFFF8000
+;	u16 100
+;	i16 FFFFFFFFFFFFFF7F
+;	u32 FFFFFFFF
+;	i32 FFFFFFFF80000000
+;	u32 10000
+;	i32 FFFFFFFFFFFF7FFF
+;	u64 8000000000000000
+;	i64 FFFFFFFF7FFFFFFF
+;	u64 100000000
+;	load_imm d FFFFFFFF
+;	load_imm w FFFE
+;	load_imm b 80
+;	load_ind -8 1122334455667788
+;	store_idx -24 1122334455667788
+;	load_ind 256 99
+;	alui add -1 FFFFFFFFFFFFFFFF
+;	alui or -32768 FFFFFFFFFFFF8000
+;	alui and 32767 7FFF
+;	alui d add -1 FFFFFFFF
+;	alui w sub -1 0
+
+segment data
+	FMT_U8:
+	bytes "u8 %llX\n\0"
+	FMT_I8:
+	bytes "i8 %llX\n\0"
+	FMT_U16:
+	bytes "u16 %llX\n\0"
+	FMT_I16:
+	bytes "i16 %llX\n\0"
+	FMT_U32:
+	bytes "u32 %llX\n\0"
+	FMT_I32:
+	bytes "i32 %llX\n\0"
+	FMT_U64:
+	bytes "u64 %llX\n\0"
+	FMT_I64:
+	bytes "i64 %llX\n\0"
+	FMT_LOAD_IMM_D:
+	bytes "load_imm d %llX\n\0"
+	FMT_LOAD_IMM_W:
+	bytes "load_imm w %llX\n\0"
+	FMT_LOAD_IMM_B:
+	bytes "load_imm b %llX\n\0"
+	FMT_LOAD_IND_NEG:
+	bytes "load_ind -8 %llX\n\0"
+	FMT_STORE_IDX_NEG:
+	bytes "store_idx -24 %llX\n\0"
+	FMT_LOAD_IND_U16:
+	bytes "load_ind 256 %llX\n\0"
+	FMT_ALUI_ADD:
+	bytes "alui add -1 %llX\n\0"
+	FMT_ALUI_OR:
+	bytes "alui or -32768 %llX\n\0"
+	FMT_ALUI_AND:
+	bytes "alui and 32767 %llX\n\0"
+	FMT_ALUI_ADD_D:
+	bytes "alui d add -1 %llX\n\0"
+	FMT_ALUI_SUB_W:
+	bytes "alui w sub -1 %llX\n\0"
+
+segment text
+	; widest value of each width
+	load_imm	q r1, 0xFF			; 8 bits
+	load_imm	q r0, FMT_U8
+	call		_show
+	load_imm	q r1, -128			; 8 bits, sign-extended
+	load_imm	q r0, FMT_I8
+	call		_show
+	load_imm	q r1, 0xFFFF			; 16 bits
+	load_imm	q r0, FMT_U16
+	call		_show
+	load_imm	q r1, -32768			; 16 bits, sign-extended
+	load_imm	q r0, FMT_I16
+	call		_show
+
+	; narrowest value of each width
+	load_imm	q r1, 0x100			; 16 bits
+	load_imm	q r0, FMT_U16
+	call		_show
+	load_imm	q r1, -129			; 16 bits, sign-extended
+	load_imm	q r0, FMT_I16
+	call		_show
+	load_imm	q r1, 0xFFFFFFFF		; 32 bits
+	load_imm	q r0, FMT_U32
+	call		_show
+	load_imm	q r1, -2147483648		; 32 bits, sign-extended
+	load_imm	q r0, FMT_I32
+	call		_show
+	load_imm	q r1, 0x10000			; 32 bits
+	load_imm	q r0, FMT_U32
+	call		_show
+	load_imm	q r1, -32769			; 32 bits, sign-extended
+	load_imm	q r0, FMT_I32
+	call		_show
+	load_imm	q r1, 0x8000000000000000	; 64 bits
+	load_imm	q r0, FMT_U64
+	call		_show
+	load_imm	q r1, -2147483649		; 64 bits
+	load_imm	q r0, FMT_I64
+	call		_show
+	load_imm	q r1, 0x100000000		; 64 bits
+	load_imm	q r0, FMT_U64
+	call		_show
+
+	; the sign-extended immediate is truncated to the oplen
+	load_imm	d r1, -1
+	load_imm	q r0, FMT_LOAD_IMM_D
+	call		_show
+	load_imm	w r1, -2
+	load_imm	q r0, FMT_LOAD_IMM_W
+	call		_show
+	load_imm	b r1, -128
+	load_imm	q r0, FMT_LOAD_IMM_B
+	call		_show
+
+	; offsets of load_ind and displacements of store_idx
+	load_imm	q r2, 64
+	add		q sp, sp, r2			; 64 bytes of locals
+	load_imm	q r1, 0x1122334455667788
+	load_imm	q r3, 8
+	store_dir	q r1, r3, vmem
+	load_imm	q r3, 16
+	load_ind	q r1, r3, -8, vmem		; 8 bits, sign-extended
+	load_imm	q r0, FMT_LOAD_IND_NEG
+	call		_show
+	load_imm	q r3, 40
+	load_imm	q r4, 1
+	store_idx	q r1, r3, r4, 8, -24, vmem	; 8 bits, sign-extended
+	load_imm	q r3, 24
+	load_dir	q r1, r3, vmem
+	load_imm	q r0, FMT_STORE_IDX_NEG
+	call		_show
+	load_imm	q r1, 0x99
+	load_imm	q r3, 256
+	store_dir	b r1, r3, vmem
+	load_imm	q r3, 0
+	load_ind	b r1, r3, 256, vmem		; 16 bits
+	load_imm	q r0, FMT_LOAD_IND_U16
+	call		_show
+
+	; `alui` sign-extends its 16-bit immediate
+	load_imm	q r1, 0
+	alui		q r1, add, -1
+	load_imm	q r0, FMT_ALUI_ADD
+	call		_show
+	load_imm	q r1, 0
+	alui		q r1, or, -32768
+	load_imm	q r0, FMT_ALUI_OR
+	call		_show
+	load_imm	q r1, -1
+	alui		q r1, and, 32767
+	load_imm	q r0, FMT_ALUI_AND
+	call		_show
+	load_imm	q r1, 0
+	alui		d r1, add, -1
+	load_imm	q r0, FMT_ALUI_ADD_D
+	call		_show
+	load_imm	q r1, 0xFFFF
+	alui		w r1, sub, -1
+	load_imm	q r0, FMT_ALUI_SUB_W
+	call		_show
+
+	load_imm	q r0, 0
+	libc_call	exit
+
+	; printf(r0, r1), with r0 being a vmem address
+	_show:
+	vtoreal		r0, r0
+	libc_call	printf
+	ret
@@ -0,0 +1,70 @@
+; Bounds of `jtab`: an index less than the length jumps through the table, any other index (including the length
+; itself and indices with bits above 16) continues after the table.
+;
+; Prints a line per check and exits with 0, expected output:
+;	case 0 -> A
+;	case 1 -> B
+;	case 2 -> C
+;	case 3 -> D
+;	case 4 -> D
+;	case 10000 -> D
+;	case FFFFFFFFFFFFFFFF -> D
+;	empty 0 -> D
+
+segment data
+	FMT_CASE:
+	bytes "case %llX -> %c\n\0"
+	FMT_EMPTY:
+	bytes "empty %llX -> %c\n\0"
+
+segment text
+	load_imm	q r6, 0
+	call		_switch
+	load_imm	q r6, 1
+	call		_switch
+	load_imm	q r6, 2
+	call		_switch
+	load_imm	q r6, 3				; == len
+	call		_switch
+	load_imm	q r6, 4
+	call		_switch
+	load_imm	q r6, 0x10000			; 0 in the low 16 bits
+	call		_switch
+	load_imm	q r6, -1
+	call		_switch
+
+	; a table of no entries always continues after it
+	load_imm	q r6, 0
+	load_imm	q r2, 68			; 'D'
+	jtab		r6, 0
+	load_imm	q r0, FMT_EMPTY
+	mov		q r1, r6
+	vtoreal		r0, r0
+	libc_call	printf
+
+	load_imm	q r0, 0
+	libc_call	exit
+
+	; printf(FMT_CASE, r6, switch (r6) { case 0: 'A'; case 1: 'B'; case 2: 'C'; default: 'D'; })
+	_switch:
+	jtab		r6, 3
+	i16		_case0 - _default
+	i16		_case1 - _default
+	i16		_case2 - _default
+	_default:
+	load_imm	q r2, 68			; 'D'
+	j		_print
+	_case0:
+	load_imm	q r2, 65			; 'A'
+	j		_print
+	_case1:
+	load_imm	q r2, 66			; 'B'
+	j		_print
+	_case2:
+	load_imm	q r2, 67			; 'C'
+	_print:
+	load_imm	q r0, FMT_CASE
+	vtoreal		r0, r0
+	mov		q r1, r6
+	libc_call	printf
+	ret
@@ -0,0 +1,70 @@
+; `native_call` of the `libm` functions registered by `bin/lbvm`, with `f64` arguments and return values, an integer
+; argument after a `f64` one, and an integer return value. Values are printed as their bits.
+;
+; Prints a line per check and exits with 0, expected output:
+;	sqrt 4010000000000000 -> 4000000000000000
+;	pow 4000000000000000 -> 4090000000000000
+;	fma 4000000000000000 -> 401C000000000000
+;	ldexp 3FF8000000000000 -> 4038000000000000
+;	llround C004000000000000 -> FFFFFFFFFFFFFFFD
+
+segment data
+	FMT:
+	bytes "%s %llX -> %llX\n\0"
+	SQRT:
+	bytes "sqrt\0"
+	POW:
+	bytes "pow\0"
+	FMA:
+	bytes "fma\0"
+	LDEXP:
+	bytes "ldexp\0"
+	LLROUND:
+	bytes "llround\0"
+
+segment text
+	load_imm	q r6, 0x4010000000000000	; 4.0
+	mov		q r0, r6
+	native_call	0				; sqrt(4.0)
+	load_imm	q r1, SQRT
+	call		_show
+
+	load_imm	q r6, 0x4000000000000000	; 2.0
+	mov		q r0, r6
+	load_imm	q r1, 0x4024000000000000	; 10.0
+	native_call	4				; pow(2.0, 10.0)
+	load_imm	q r1, POW
+	call		_show
+
+	mov		q r0, r6
+	load_imm	q r1, 0x4008000000000000	; 3.0
+	load_imm	q r2, 0x3FF0000000000000	; 1.0
+	native_call	12				; fma(2.0, 3.0, 1.0)
+	load_imm	q r1, FMA
+	call		_show
+
+	load_imm	q r6, 0x3FF8000000000000	; 1.5
+	mov		q r0, r6
+	load_imm	q r1, 4
+	native_call	13				; ldexp(1.5, 4)
+	load_imm	q r1, LDEXP
+	call		_show
+
+	load_imm	q r6, 0xC004000000000000	; -2.5
+	mov		q r0, r6
+	native_call	14				; llround(-2.5)
+	load_imm	q r1, LLROUND
+	call		_show
+
+	load_imm	q r0, 0
+	libc_call	exit
+
+	; printf(FMT, r1, r6, r0), with r1 being a vmem address
+	_show:
+	mov		q r3, r0
+	mov		q r2, r6
+	vtoreal		r1, r1
+	load_imm	q r0, FMT
+	vtoreal		r0, r0
+	libc_call	printf
+	ret
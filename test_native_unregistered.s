@@ -0,0 +1,9 @@
+; `native_call` of an ID without a registered function, which stops the machine (see test_native.s).
+;
+; Expected to print "Machine stopped on a fault" and exit with 255.
+; With `--dbg`, the machine also reports "Machine called unregistered native function 1000 @ 0x10000".
+
+segment text
+	native_call	1000
+	load_imm	q r0, 0
+	libc_call	exit
@@ -0,0 +1,10 @@
+; `popm` past the bottom of the stack, which stops the machine before popping anything (see test_stack.s).
+;
+; Expected to print "Machine stopped on a fault" and exit with 255.
+; With `--dbg`, the machine also reports "Stack underflowed".
+
+segment text
+	load_imm	q sp, 16
+	popm		{r1, r2}, 1			; 24 bytes, 8 more than are on the stack
+	load_imm	q r0, 0
+	libc_call	exit
@@ -0,0 +1,10 @@
+; `pushm` past the end of the stack, which stops the machine before pushing anything (see test_stack.s).
+;
+; Expected to print "Machine stopped on a fault" and exit with 255.
+; With `--dbg`, the machine also reports "Stack overflowed".
+
+segment text
+	load_imm	q sp, 0xFFF0
+	pushm		{r1, r2, r3}			; 24 bytes, 8 more than are left
+	load_imm	q r0, 0
+	libc_call	exit
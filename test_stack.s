@@ -0,0 +1,117 @@
+; Stack bounds of `pushm`, `popm` and `tcall`, which may fill the stack up to its end and free it down to its bottom.
+; The accesses just past those bounds stop the machine, see test_pushm_overflow.s, test_popm_underflow.s and
+; test_tcall_underflow.s.
+;
+; Prints a line per check and exits with 0, expected output:
+;	enter sp 30
+;	locals 7
+;	leave 1 2 3
+;	leave sp 0
+;	pushm full sp 10000
+;	popm full sp FFE8
+;	popm bottom sp 0
+;	tcall bottom sp 0
+;	tcall F
+
+segment data
+	FMT_SP:
+	bytes "%s sp %llX\n\0"
+	FMT_LOCALS:
+	bytes "locals %llX\n\0"
+	FMT_REGS:
+	bytes "leave %llX %llX %llX\n\0"
+	FMT_TCALL:
+	bytes "tcall %llX\n\0"
+	ENTER:
+	bytes "enter\0"
+	LEAVE:
+	bytes "leave\0"
+	PUSHM_FULL:
+	bytes "pushm full\0"
+	POPM_FULL:
+	bytes "popm full\0"
+	POPM_BOTTOM:
+	bytes "popm bottom\0"
+	TCALL_BOTTOM:
+	bytes "tcall bottom\0"
+
+segment text
+	; enter and leave a frame of 3 registers and 3 qwords of locals
+	load_imm	q r1, 1
+	load_imm	q r2, 2
+	load_imm	q r3, 3
+	enter		{r1, r2, r3}, 3
+	mov		q r6, sp
+	load_imm	q r0, ENTER
+	call		_show_sp
+	load_imm	q r4, 7
+	stsp		q r4, 24			; bottom of the locals
+	load_imm	q r1, 0
+	load_imm	q r2, 0
+	load_imm	q r3, 0
+	ldsp		q r1, 24
+	load_imm	q r0, FMT_LOCALS
+	vtoreal		r0, r0
+	libc_call	printf
+	leave		{r1, r2, r3}, 3
+	mov		q r6, sp
+	load_imm	q r0, FMT_REGS
+	vtoreal		r0, r0
+	libc_call	printf
+	load_imm	q r0, LEAVE
+	call		_show_sp
+
+	; pushm fills the stack up to its end
+	load_imm	q sp, 0xFFE8
+	pushm		{r1, r2, r3}
+	mov		q r6, sp
+	popm		{r1, r2, r3}
+	load_imm	q r0, PUSHM_FULL
+	call		_show_sp
+	; (`call` pushed and `ret` popped the return address)
+	mov		q r6, sp
+	load_imm	q r0, POPM_FULL
+	call		_show_sp
+
+	; popm and tcall free the stack down to its bottom
+	load_imm	q sp, 16
+	popm		{r1, r2}
+	mov		q r6, sp
+	load_imm	q r0, POPM_BOTTOM
+	call		_show_sp
+	load_imm	q sp, 16
+	tcall		_tcall_bottom, 2
+	_tcall_bottom:
+	mov		q r6, sp
+	load_imm	q r0, TCALL_BOTTOM
+	call		_show_sp
+
+	; tcall reuses the frame of its caller, and returns to the caller's caller
+	load_imm	q r1, 5
+	call		_outer
+	load_imm	q r0, FMT_TCALL
+	vtoreal		r0, r0
+	libc_call	printf
+
+	load_imm	q r0, 0
+	libc_call	exit
+
+	; r1 = _inner(r1 + 10), in a frame of 1 qword
+	_outer:
+	enter		{}, 1
+	alui		q r1, add, 10
+	tcall		_inner, 1
+
+	; r1 = r1
+	_inner:
+	ret
+
+	; printf(FMT_SP, r0, r6), with r0 being a vmem address
+	_show_sp:
+	vtoreal		r0, r0
+	mov		q r1, r0
+	load_imm	q r0, FMT_SP
+	vtoreal		r0, r0
+	mov		q r2, r6
+	libc_call	printf
+	ret
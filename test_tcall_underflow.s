@@ -0,0 +1,11 @@
+; `tcall` freeing a frame past the bottom of the stack, which stops the machine before jumping (see test_stack.s).
+;
+; Expected to print "Machine stopped on a fault" and exit with 255.
+; With `--dbg`, the machine also reports "Stack underflowed".
+
+segment text
+	load_imm	q sp, 8
+	tcall		_callee, 2			; 16 bytes, 8 more than are on the stack
+	_callee:
+	load_imm	q r0, 0
+	libc_call	exit